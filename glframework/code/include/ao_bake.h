@@ -0,0 +1,11 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+
+namespace AOBake {
+	// Per-vertex ambient occlusion for a triangle soup, 255 = fully open.
+	// Rays are cast against a MeshBVH of the mesh on every core. The result is
+	// stored in cachePath and reused as long as the mesh and settings match.
+	std::vector<unsigned char> bakeVertexAO(const std::vector<glm::vec3>& verts,
+		const std::vector<glm::vec3>& norms, const char* cachePath, int numRays = 64);
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <emmintrin.h>
+
+// Matrix kernels over contiguous arrays of plain glm types, with SSE and
+// AVX2+FMA versions picked at runtime from what the CPU supports. Arrays need
+// no particular alignment. In-place calls (out == an input) are allowed.
+namespace BatchMath {
+	enum Level { Scalar, SSE, AVX2, NumLevels };
+	extern const char* levelNames[NumLevels];
+
+	// Best level the CPU supports
+	Level detect();
+	Level level();
+	// Forces a level, for comparisons; clamped to what the CPU supports
+	void setLevel(Level l);
+
+	// out[i] = a[i] * b[i]
+	void mul(const glm::mat4* a, const glm::mat4* b, glm::mat4* out, int count);
+	// out[i] = a * b[i], e.g. view projection times model matrices
+	void mul(const glm::mat4& a, const glm::mat4* b, glm::mat4* out, int count);
+	// out[i] = m * v[i]
+	void transform(const glm::mat4& m, const glm::vec4* v, glm::vec4* out, int count);
+	// Inverse of matrices whose last row is (0, 0, 0, 1): rotation, scale, shear and translation
+	void inverseAffine(const glm::mat4* m, glm::mat4* out, int count);
+	// transpose(inverse(mat3(m))) in the upper 3x3, zero translation; ready for
+	// mat3(normalMat) in a shader
+	void normalMatrix(const glm::mat4* m, glm::mat4* out, int count);
+
+	// Single product with SSE2, which every x64 CPU has. For gathers and
+	// scattered updates where the batch calls don't fit.
+	inline void mul(const glm::mat4& a, const glm::mat4& b, glm::mat4& out) {
+		const float* pa = &a[0][0];
+		const float* pb = &b[0][0];
+		__m128 a0 = _mm_loadu_ps(pa), a1 = _mm_loadu_ps(pa + 4), a2 = _mm_loadu_ps(pa + 8), a3 = _mm_loadu_ps(pa + 12);
+		__m128 r[4];
+		for (int j = 0; j < 4; j++) {
+			__m128 bj = _mm_loadu_ps(pb + 4 * j);
+			__m128 c = _mm_mul_ps(a0, _mm_shuffle_ps(bj, bj, 0x00));
+			c = _mm_add_ps(c, _mm_mul_ps(a1, _mm_shuffle_ps(bj, bj, 0x55)));
+			c = _mm_add_ps(c, _mm_mul_ps(a2, _mm_shuffle_ps(bj, bj, 0xAA)));
+			r[j] = _mm_add_ps(c, _mm_mul_ps(a3, _mm_shuffle_ps(bj, bj, 0xFF)));
+		}
+		float* po = &out[0][0];
+		for (int j = 0; j < 4; j++) _mm_storeu_ps(po + 4 * j, r[j]);
+	}
+
+	struct BenchResult {
+		double glmNs[5];	// per item: mul, shared mul, transform, inverse, normal
+		double batchNs[5];
+		float maxError[5];	// largest difference to glm, relative above magnitude 1
+		bool mismatch[5];	// maxError beyond float rounding
+	};
+	extern const char* kernelNames[5];
+	// Checks every kernel's output against the plain glm loop over count items,
+	// then times both
+	BenchResult benchmark(int count);
+}
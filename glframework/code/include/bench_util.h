@@ -0,0 +1,33 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+
+// Shared by the module benchmarks: a seeded generator so every run measures
+// the same data, and wall clock timing from a start point.
+namespace BenchUtil {
+	typedef std::chrono::steady_clock Clock;
+
+	// xorshift32, plenty for scattering test data
+	struct Random {
+		uint32_t state;
+
+		explicit Random(uint32_t seed) : state(seed) {}
+		uint32_t next() {
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			return state;
+		}
+		// Uniform in [0, 1)
+		float unit() { return (next() >> 8) * (1.f / 16777216.f); }
+		// Uniform in [-1, 1)
+		float signedUnit() { return unit() * 2.f - 1.f; }
+	};
+
+	inline double msSince(Clock::time_point start) {
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	}
+	inline double nsSince(Clock::time_point start) {
+		return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+	}
+}
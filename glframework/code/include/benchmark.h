@@ -0,0 +1,43 @@
+#pragma once
+#include <cstddef>
+#include "frame_stats.h"
+
+// Repeatable runs for comparing builds and machines. The camera follows a
+// scripted path, the simulation advances exactly one fixed step per frame and
+// the timings of every frame are written out as JSON.
+namespace Benchmark {
+	struct Options {
+		bool enabled = false;
+		int frames = 1440;
+		int warmupFrames = 60;	// not reported, covers shader compiles and cache warm up
+		const char* outPath = "benchmark.json";
+		const char* pathFile = NULL;
+	};
+	// Reads --benchmark [frames], --benchmark-warmup <frames>, --benchmark-out <file>
+	// and --camera-path <file>. Returns false on malformed arguments.
+	bool parseArgs(int argc, char** argv, Options& opt);
+
+	struct CameraPose {
+		float panv[3];
+		float rota[2];
+		int dollyEffect;
+	};
+	// Camera path script, one entry per line:
+	//   key <time> <pan x> <pan y> <pan z> <rot x> <rot y>
+	//   dolly <time> <mode>
+	// Keys are interpolated with Catmull-Rom, dolly modes hold until the next entry.
+	bool loadPath(const char* path);
+	void useDefaultPath();
+	CameraPose evaluatePath(float time);
+
+	struct RunInfo {
+		const char* renderer;
+		const char* glVersion;
+		int width, height;
+		float timestep;
+	};
+	void begin(const Options& opt);
+	// Returns false once all frames were collected
+	bool addFrame(const FrameStats::Sample& s);
+	bool writeReport(const RunInfo& info);
+}
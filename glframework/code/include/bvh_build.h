@@ -0,0 +1,144 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cfloat>
+
+// Internal to MeshBVH and SceneBVH: the binned SAH builder and the ray vs. box
+// test both trees are built and traversed with.
+namespace BVHBuild {
+	const int numBins = 12;
+	// Entries of the fixed traversal stacks
+	const int maxStack = 64;
+	// Past this depth nodes are split at the centroid median, which halves the
+	// item count per level and keeps the tree, and so the traversal stack,
+	// within maxStack for any 32-bit item count
+	const int maxSahDepth = 24;
+
+	struct Item {
+		glm::vec3 bmin, bmax, centroid;
+		int idx;
+	};
+
+	inline float surfaceArea(const glm::vec3& bmin, const glm::vec3& bmax) {
+		glm::vec3 d = glm::max(bmax - bmin, glm::vec3(0.f));
+		return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+
+	// Reorders items [begin, end) into two non-empty halves, returns where the
+	// second one starts. cmin/cmax bound the centroids of the range.
+	inline int split(Item* items, int begin, int end, const glm::vec3& cmin, const glm::vec3& cmax, int depth) {
+		int count = end - begin;
+		if (depth >= maxSahDepth) {
+			glm::vec3 extent = cmax - cmin;
+			int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+			int mid = begin + count / 2;
+			std::nth_element(items + begin, items + mid, items + end, [&](const Item& a, const Item& b) {
+				return a.centroid[axis] < b.centroid[axis];
+			});
+			return mid;
+		}
+
+		// Binned SAH over all three axes
+		float bestCost = FLT_MAX;
+		int bestAxis = -1;
+		float bestSplit = 0.f;
+		for (int axis = 0; axis < 3; axis++) {
+			float extent = cmax[axis] - cmin[axis];
+			if (extent <= 0.f) continue;
+			int binCount[numBins] = {};
+			glm::vec3 binMin[numBins], binMax[numBins];
+			for (int b = 0; b < numBins; b++) {
+				binMin[b] = glm::vec3(FLT_MAX);
+				binMax[b] = glm::vec3(-FLT_MAX);
+			}
+			float scale = numBins / extent;
+			for (int i = begin; i < end; i++) {
+				int b = std::min(numBins - 1, (int)((items[i].centroid[axis] - cmin[axis]) * scale));
+				binCount[b]++;
+				binMin[b] = glm::min(binMin[b], items[i].bmin);
+				binMax[b] = glm::max(binMax[b], items[i].bmax);
+			}
+			// Sweep from the right to get the cost of every right-hand side
+			float rightArea[numBins];
+			int rightCount[numBins];
+			glm::vec3 rmin(FLT_MAX), rmax(-FLT_MAX);
+			int rc = 0;
+			for (int b = numBins - 1; b > 0; b--) {
+				rc += binCount[b];
+				rmin = glm::min(rmin, binMin[b]);
+				rmax = glm::max(rmax, binMax[b]);
+				rightCount[b] = rc;
+				rightArea[b] = surfaceArea(rmin, rmax);
+			}
+			glm::vec3 lmin(FLT_MAX), lmax(-FLT_MAX);
+			int lc = 0;
+			for (int b = 0; b < numBins - 1; b++) {
+				lc += binCount[b];
+				lmin = glm::min(lmin, binMin[b]);
+				lmax = glm::max(lmax, binMax[b]);
+				if (lc == 0 || rightCount[b + 1] == 0) continue;
+				float cost = lc * surfaceArea(lmin, lmax) + rightCount[b + 1] * rightArea[b + 1];
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = cmin[axis] + (b + 1) / scale;
+				}
+			}
+		}
+
+		int mid = begin;
+		if (bestAxis >= 0) {
+			Item* m = std::partition(items + begin, items + end, [&](const Item& it) {
+				return it.centroid[bestAxis] < bestSplit;
+			});
+			mid = (int)(m - items);
+		}
+		if (mid == begin || mid == end) {
+			// All centroids coincide, fall back to an even split
+			mid = begin + count / 2;
+		}
+		return mid;
+	}
+
+	// Top down build of node over items [begin, end). Tree provides leafSize and
+	// setBounds(node, bmin, bmax), makeLeaf(node, begin, end) and makeInner(node),
+	// which allocates the two children and returns the index of the first.
+	template <typename Tree>
+	void build(Tree& tree, Item* items, int node, int begin, int end, int depth) {
+		glm::vec3 bmin(FLT_MAX), bmax(-FLT_MAX), cmin(FLT_MAX), cmax(-FLT_MAX);
+		for (int i = begin; i < end; i++) {
+			bmin = glm::min(bmin, items[i].bmin);
+			bmax = glm::max(bmax, items[i].bmax);
+			cmin = glm::min(cmin, items[i].centroid);
+			cmax = glm::max(cmax, items[i].centroid);
+		}
+		tree.setBounds(node, bmin, bmax);
+		if (end - begin <= Tree::leafSize) {
+			tree.makeLeaf(node, begin, end);
+			return;
+		}
+		int mid = split(items, begin, end, cmin, cmax, depth);
+		int left = tree.makeInner(node);
+		build(tree, items, left, begin, mid, depth + 1);
+		build(tree, items, left + 1, mid, end, depth + 1);
+	}
+
+	// 1 / dir with zero components nudged off zero. Their infinite inverse times
+	// a box plane the ray starts on would be NaN and make the box a miss.
+	inline glm::vec3 safeInverse(const glm::vec3& dir) {
+		glm::vec3 inv;
+		for (int a = 0; a < 3; a++) inv[a] = 1.f / (dir[a] != 0.f ? dir[a] : 1e-30f);
+		return inv;
+	}
+
+	// Ray vs. box slab test, returns the entry distance or FLT_MAX on a miss
+	inline float rayBox(const glm::vec3& bmin, const glm::vec3& bmax, const glm::vec3& orig, const glm::vec3& invDir, float tmin, float tmax) {
+		glm::vec3 t0 = (bmin - orig) * invDir;
+		glm::vec3 t1 = (bmax - orig) * invDir;
+		glm::vec3 tnear = glm::min(t0, t1);
+		glm::vec3 tfar = glm::max(t0, t1);
+		float enter = std::max(std::max(tnear.x, tnear.y), std::max(tnear.z, tmin));
+		float exit = std::min(std::min(tfar.x, tfar.y), std::min(tfar.z, tmax));
+		return enter <= exit ? enter : FLT_MAX;
+	}
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <glm/glm.hpp>
+
+// Camera with versioned parameters. Setters bump the version only when a value
+// actually changes, and the derived matrices and frustum planes are rebuilt on
+// first use after that, so a still camera costs a few compares per frame.
+// Anything cached per camera (culling results, uniform uploads) can compare
+// version() against the one it was built for.
+struct Camera {
+	// Planes are (n, d) with n pointing inside: dot(n, p) + d >= 0 for visible p
+	enum Plane { Left, Right, Bottom, Top, Near, Far, NumPlanes };
+
+	Camera();
+
+	// Translated by pan, then rotated by rotX around X and rotY around Y
+	void setOrbit(const glm::vec3& pan, float rotX, float rotY);
+	void setLookAt(const glm::vec3& eye, const glm::vec3& target, const glm::vec3& up);
+	void setPerspective(float fovY, float zNear, float zFar);
+	// Width over height of the viewport, ignored when not positive
+	void setAspect(float aspect);
+
+	float fovY() const { return fov; }
+	float aspectRatio() const { return aspect; }
+	float nearPlane() const { return zNear; }
+	float farPlane() const { return zFar; }
+
+	const glm::mat4& view() const;
+	const glm::mat4& projection() const;
+	const glm::mat4& viewProjection() const;
+	const glm::mat4& inverseView() const;
+	const glm::vec4* frustumPlanes() const;
+	glm::vec3 position() const;
+	// World space direction from position() through a point of the viewport in
+	// normalized device coordinates, e.g. the mouse for picking. Normalized, so
+	// ray distances are world units.
+	glm::vec3 ray(float ndcX, float ndcY) const;
+
+	// Changes with any parameter; projectionVersion only with the projection ones
+	unsigned version() const { return viewVersion + projVersion; }
+	unsigned projectionVersion() const { return projVersion; }
+
+private:
+	enum Mode { Orbit, LookAt };
+	Mode mode;
+	glm::vec3 pan, eye, target, up;
+	float rot[2];
+	float fov, aspect, zNear, zFar;
+	unsigned viewVersion, projVersion;
+
+	// Version each derived value was last built for
+	mutable unsigned builtView, builtProj, builtCombined;
+	mutable glm::mat4 viewMat, projMat, viewProjMat, invViewMat;
+	mutable glm::vec4 planes[NumPlanes];
+};
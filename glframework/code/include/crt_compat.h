@@ -0,0 +1,28 @@
+#pragma once
+#include <cstdio>
+#include <cstddef>
+
+// The MSVC secure CRT calls used across the code base, mapped onto standard C
+// for other compilers. The mapping only holds for numeric conversions: %s takes
+// a buffer size argument under MSVC that standard C would read as the next
+// pointer, so strings are read with fscanWord below instead.
+#ifndef _MSC_VER
+inline int fopen_s(FILE** file, const char* path, const char* mode) {
+	*file = fopen(path, mode);
+	return *file == NULL ? 1 : 0;
+}
+#define fscanf_s fscanf
+#define sscanf_s sscanf
+#endif
+
+// Reads the next whitespace separated word into word, cut to the array's size
+template <size_t N>
+inline int fscanWord(FILE* file, char (&word)[N]) {
+	char format[16];
+	snprintf(format, sizeof(format), "%%%us", (unsigned)(N - 1));
+#ifdef _MSC_VER
+	return fscanf_s(file, format, word, (unsigned)N);
+#else
+	return fscanf(file, format, word);
+#endif
+}
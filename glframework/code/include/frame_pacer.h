@@ -0,0 +1,21 @@
+#pragma once
+
+// Paces the main loop to a target frame rate using the high resolution
+// performance counter. Frames are scheduled against absolute deadlines so
+// timing errors don't accumulate; most of the wait is slept and the last
+// stretch is spun, with the spin margin adapting to how late the OS wakes us.
+namespace FramePacer {
+	void init(double targetHz);
+	void shutdown();
+	void setTargetRate(double targetHz);
+	double targetRate();
+	// Blocks until the current frame's deadline. Returns the time waited in ms.
+	double waitForFrameEnd();
+	// Restarts the schedule after the loop idled; the gap is not counted as a frame
+	void resume();
+
+	// Statistics over the last frames, measured between waitForFrameEnd returns
+	double frameTimeMeanMs();
+	double frameTimeJitterMs();	// standard deviation
+	double spinMarginMs();
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+// Per frame timings kept in a fixed ring buffer. One thread records samples,
+// any thread may read them without locking: slots carry a sequence number and
+// readers drop the ones overwritten while they were being copied.
+namespace FrameStats {
+	const int capacity = 512;
+
+	struct Sample {
+		float frameMs;	// whole main loop iteration
+		float cpuMs;	// main thread work, without the pacer wait
+		float renderMs;	// render thread CPU time for the frame
+		float gpuMs;	// scene GPU time
+		float sleepMs;	// time spent in the frame pacer
+	};
+	enum Channel { Frame, Cpu, Render, Gpu, Sleep, NumChannels };
+	extern const char* channelNames[NumChannels];
+
+	struct Summary {
+		float mean, p50, p95, p99, max;
+	};
+
+	// Latest render thread timings, merged into the next recorded sample
+	void reportRender(float renderMs, float gpuMs);
+	// Records a main loop frame, called from the main thread only
+	void record(float frameMs, float cpuMs, float sleepMs);
+	void reset();
+
+	// Copies up to maxSamples of the newest samples, oldest first; returns the count
+	int copyRecent(Sample* out, int maxSamples);
+	float value(const Sample& s, Channel channel);
+	Summary summarize(const Sample* samples, int count, Channel channel);
+	// Counts samples into numBins equal bins over [0, maxMs], the last bin takes the overflow
+	void histogram(const Sample* samples, int count, Channel channel, float maxMs, float* bins, int numBins);
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+struct Camera;
+
+// View frustum culling over bounding volumes kept structure-of-arrays, tested
+// 4 (SSE) or 8 (AVX2) at a time following BatchMath's CPU level. Every item
+// has both an AABB and a sphere; each plane is tested with whichever of the
+// two reaches less far across it, so the result is as tight as the better fit.
+namespace Culling {
+	struct Bounds {
+		glm::vec3 center;
+		glm::vec3 extents;	// half size of the AABB
+		float radius;	// sphere around center
+	};
+	// Bounds of a point cloud, e.g. a mesh's vertices at load
+	Bounds computeBounds(const glm::vec3* points, int count);
+	// Bounds of b after transforming it with m
+	Bounds transformBounds(const Bounds& b, const glm::mat4& m);
+
+	// World space bounds of the drawables, one slot per item
+	struct BoundsSet {
+		std::vector<float> cx, cy, cz;
+		std::vector<float> ex, ey, ez;
+		std::vector<float> radius;
+
+		void resize(int count);
+		int size() const { return (int)cx.size(); }
+		void set(int i, const Bounds& b);
+	};
+
+	// planes as from Camera::frustumPlanes. Writes 1 to visible[i] for items
+	// that may be in view, 0 otherwise, and returns the visible count.
+	int cull(const glm::vec4* planes, const BoundsSet& set, unsigned char* visible);
+
+	// Benchmark data: count random boxes scattered over 120 units around the
+	// origin, each with the sphere around it, and a view over part of them
+	BoundsSet randomBounds(int count, uint32_t seed);
+	void setBenchmarkView(Camera& camera);
+	// Average ms to cull count random items against a typical frustum
+	double benchmark(int count);
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include <GL/glew.h>
+
+// Offscreen GL 3.3 core context for running without a window, e.g. benchmarks
+// on machines with nothing but Mesa llvmpipe. Uses a surfaceless EGL context
+// where available and a hidden SDL window elsewhere; frames are drawn into a
+// framebuffer object either way.
+namespace Headless {
+	// Creates and makes current the context; call before glewInit
+	bool createContext();
+	// Creates the color+depth target, needs GL entry points loaded
+	bool createFramebuffer(int width, int height);
+	void destroy();
+
+	GLuint framebuffer();
+	// Dumps the framebuffer as a binary PPM
+	bool writePPM(const char* path);
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// Work stealing job scheduler. Every worker owns a deque: it pushes and pops
+// its own jobs LIFO and steals FIFO from the others when it runs dry. Jobs are
+// a function pointer plus a user pointer so submitting one never allocates.
+namespace Jobs {
+	struct Counter;
+
+	struct Job {
+		void(*fn)(void* data);
+		void* data;
+		Counter* counter;	// decremented once the job has run, may be NULL
+	};
+
+	// Tracks a group of jobs. Jobs chained with runAfter start once it drops to zero.
+	struct Counter {
+		std::atomic<int> value;
+		std::mutex lock;
+		std::vector<Job> continuations;
+		Counter() : value(0) {}
+	};
+
+	// Starts numWorkers threads, or one less than the hardware threads if 0
+	void init(unsigned numWorkers = 0);
+	void shutdown();
+	unsigned numWorkers();
+
+	void run(void(*fn)(void*), void* data, Counter* counter);
+	// Queues the job once dependency reaches zero
+	void runAfter(Counter& dependency, void(*fn)(void*), void* data, Counter* counter);
+	// Helps running jobs until the counter reaches zero. Workers run any job
+	// meanwhile, other threads only the counter's own.
+	void wait(Counter& counter);
+
+	// Jobs pinned to the thread that owns the GL context. They only run when that
+	// thread calls runGLJobs, normally once per frame.
+	void runOnGLThread(void(*fn)(void*), void* data, Counter* counter);
+	void runGLJobs();
+
+	// Calls fn(begin, end) over [first, last) split in chunks of at least grain
+	// items. Small ranges run inline on the calling thread.
+	template<typename F>
+	void parallelFor(int first, int last, int grain, const F& fn) {
+		int count = last - first;
+		if (count <= 0) return;
+		if (grain < 1) grain = 1;
+		int maxChunks = (int)numWorkers() * 4 + 1;
+		int numChunks = (count + grain - 1) / grain;
+		if (numChunks > maxChunks) numChunks = maxChunks;
+		if (numChunks <= 1) {
+			fn(first, last);
+			return;
+		}
+
+		struct Chunk {
+			const F* fn;
+			int begin, end;
+			static void exec(void* p) {
+				Chunk* c = (Chunk*)p;
+				(*c->fn)(c->begin, c->end);
+			}
+		};
+		std::vector<Chunk> chunks(numChunks);
+		Counter counter;
+		for (int i = 0; i < numChunks; i++) {
+			chunks[i].fn = &fn;
+			chunks[i].begin = first + (int)((long long)count * i / numChunks);
+			chunks[i].end = first + (int)((long long)count * (i + 1) / numChunks);
+			if (i > 0) run(&Chunk::exec, &chunks[i], &counter);
+		}
+		// The calling thread takes the first chunk itself
+		Chunk::exec(&chunks[0]);
+		wait(counter);
+	}
+
+	// Average cost of submitting, running and retiring numTasks empty jobs, in ns
+	double benchmarkOverheadNs(int numTasks);
+}
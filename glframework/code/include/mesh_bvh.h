@@ -0,0 +1,34 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+
+// Bounding volume hierarchy over a triangle soup (3 consecutive vertices per
+// triangle, the layout loadOBJ produces). Built with binned SAH; every leaf
+// holds up to 4 triangles stored as SoA so a ray is tested against the whole
+// leaf with one set of SSE instructions.
+struct MeshBVH {
+	struct Node {
+		glm::vec3 bmin;
+		int left;		// first child (the second is left + 1), or leaf pack index
+		glm::vec3 bmax;
+		int isLeaf;
+	};
+	struct TriPack {
+		float v0[3][4];
+		float e1[3][4];
+		float e2[3][4];
+		int triIdx[4];	// -1 marks padding
+	};
+
+	std::vector<Node> nodes;
+	std::vector<TriPack> packs;
+
+	void build(const std::vector<glm::vec3>& verts);
+	// Closest hit with t in (tmin, tmax); returns false on miss
+	bool intersect(const glm::vec3& orig, const glm::vec3& dir, float tmin, float tmax, float& tHit, int& triHit) const;
+	// Any hit with t in (tmin, tmax), cheaper than intersect
+	bool occluded(const glm::vec3& orig, const glm::vec3& dir, float tmin, float tmax) const;
+
+	glm::vec3 boundsMin() const { return nodes.empty() ? glm::vec3(0.f) : nodes[0].bmin; }
+	glm::vec3 boundsMax() const { return nodes.empty() ? glm::vec3(0.f) : nodes[0].bmax; }
+};
@@ -0,0 +1,36 @@
+#pragma once
+#include <glm/glm.hpp>
+
+// Software occlusion culling. Occluders (a few hundred triangles, not the full
+// meshes) are rasterized into a small depth buffer split in tiles that the job
+// system fills in parallel, four pixels per SSE edge function step. A max
+// depth pyramid over it then rejects bounding boxes hidden behind them with a
+// handful of reads and no GPU readback.
+namespace Occlusion {
+	const int width = 256;
+	const int height = 128;
+	const int tileWidth = 32;
+	const int tileHeight = 16;
+
+	// Clears the depth buffer and the queued occluders
+	void begin(const glm::mat4& viewProj);
+	// Triangle list, 3 vertices per triangle, in the space model maps to world.
+	// Both windings are drawn, so meshes need no particular orientation.
+	void addOccluder(const glm::mat4& model, const glm::vec3* verts, int numVerts);
+	// The 12 triangles of a box, e.g. for meshes that are their own bounding box
+	void addBox(const glm::mat4& model, const glm::vec3& center, const glm::vec3& extents);
+	// Bins the queued triangles, rasterizes the tiles and builds the pyramid
+	void rasterize();
+
+	// False only when the world space box is certainly hidden by the occluders
+	bool testBox(const glm::vec3& center, const glm::vec3& extents);
+
+	int numTriangles();
+	// Nearest occluder depth per pixel in [0, 1], row major from the bottom row
+	const float* depthBuffer();
+
+	// Picks up to maxTris of the largest triangles of a triangle list as its
+	// occluder. They are a subset of the surface, so they never hide more than
+	// the mesh itself would. Returns the vertex count written to out.
+	int selectOccluder(const glm::vec3* verts, int numVerts, glm::vec3* out, int maxTris);
+}
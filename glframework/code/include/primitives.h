@@ -0,0 +1,297 @@
+#pragma once
+#include <cstdint>
+
+// Geometry of the basic shapes, generated at compile time. A generator returns
+// a Mesh of interleaved vertices and indices ready for the GL buffers as they
+// are, e.g.
+//   constexpr auto ball = Primitives::sphere<32, 16>(1.f);
+// Tessellation comes in as template arguments so the array sizes are known to
+// the compiler. Solids are indexed triangle lists, counter clockwise seen from
+// outside, without duplicate or degenerate vertices. Only C++14 constexpr is
+// used: loops over plain arrays, no lambdas and no <cmath>.
+namespace Primitives {
+	// Position and normal, 24 bytes
+	struct Vertex {
+		float position[3];
+		float normal[3];
+	};
+	// Position and RGBA color, for lines
+	struct ColorVertex {
+		float position[3];
+		float color[4];
+	};
+
+	template<typename V, int NumVerts, int NumIndices>
+	struct Mesh {
+		static_assert(NumVerts <= 65536, "16 bit indices");
+		static constexpr int numVerts = NumVerts;
+		static constexpr int numIndices = NumIndices;
+		V verts[NumVerts];
+		uint16_t indices[NumIndices];
+	};
+
+	namespace detail {
+		constexpr double pi = 3.14159265358979323846;
+
+		// Taylor series after reducing x to [-pi, pi], where 14 terms are
+		// already past double precision
+		constexpr double sin(double x) {
+			x -= 2.0 * pi * (double)(long long)(x / (2.0 * pi));
+			if (x > pi) x -= 2.0 * pi;
+			if (x < -pi) x += 2.0 * pi;
+			double term = x, sum = x;
+			for (int n = 1; n < 14; n++) {
+				term *= -x * x / ((2 * n) * (2 * n + 1));
+				sum += term;
+			}
+			return sum;
+		}
+		constexpr double cos(double x) {
+			return sin(x + pi / 2.0);
+		}
+
+		constexpr void set(float* out, float x, float y, float z) {
+			out[0] = x;
+			out[1] = y;
+			out[2] = z;
+		}
+
+		// Grid of (segments + 1)^2 vertices at origin + u * col + w * row, in
+		// steps of 1 / segments, two triangles per cell. u x w points along normal.
+		template<typename M>
+		constexpr void grid(M& m, int& v, int& i, int segments, const float* normal, const float* origin, const float* u, const float* w) {
+			int first = v;
+			for (int row = 0; row <= segments; row++) {
+				for (int col = 0; col <= segments; col++) {
+					Vertex& out = m.verts[v++];
+					for (int k = 0; k < 3; k++) {
+						out.position[k] = origin[k] + u[k] * col / segments + w[k] * row / segments;
+						out.normal[k] = normal[k];
+					}
+				}
+			}
+			for (int row = 0; row < segments; row++) {
+				for (int col = 0; col < segments; col++) {
+					int a = first + row * (segments + 1) + col;
+					int c = a + segments + 1;
+					m.indices[i++] = (uint16_t)a;
+					m.indices[i++] = (uint16_t)(a + 1);
+					m.indices[i++] = (uint16_t)c;
+					m.indices[i++] = (uint16_t)c;
+					m.indices[i++] = (uint16_t)(a + 1);
+					m.indices[i++] = (uint16_t)(c + 1);
+				}
+			}
+		}
+	}
+
+	// Axis aligned cube of the given half size around the origin, each face a
+	// grid of Segments x Segments quads. Faces come in the order -y, +y, -x,
+	// +x, -z, +z.
+	template<int Segments>
+	constexpr Mesh<Vertex, 6 * (Segments + 1) * (Segments + 1), 36 * Segments * Segments> box(float halfSize) {
+		// Per face: normal, first corner and the two edges, in half sizes
+		const float faces[6][12] = {
+			{ 0, -1, 0, -1, -1, 1, 0, 0, -2, 2, 0, 0 },
+			{ 0, 1, 0, -1, 1, 1, 2, 0, 0, 0, 0, -2 },
+			{ -1, 0, 0, -1, -1, 1, 0, 2, 0, 0, 0, -2 },
+			{ 1, 0, 0, 1, -1, 1, 0, 0, -2, 0, 2, 0 },
+			{ 0, 0, -1, -1, -1, -1, 0, 2, 0, 2, 0, 0 },
+			{ 0, 0, 1, -1, -1, 1, 2, 0, 0, 0, 2, 0 }
+		};
+		Mesh<Vertex, 6 * (Segments + 1) * (Segments + 1), 36 * Segments * Segments> m{};
+		int v = 0, i = 0;
+		for (int f = 0; f < 6; f++) {
+			float origin[3] = {}, u[3] = {}, w[3] = {};
+			for (int k = 0; k < 3; k++) {
+				origin[k] = faces[f][3 + k] * halfSize;
+				u[k] = faces[f][6 + k] * halfSize;
+				w[k] = faces[f][9 + k] * halfSize;
+			}
+			detail::grid(m, v, i, Segments, faces[f], origin, u, w);
+		}
+		return m;
+	}
+
+	// Square in the XZ plane facing +y, halfSize from the origin along both axes
+	template<int Segments>
+	constexpr Mesh<Vertex, (Segments + 1) * (Segments + 1), 6 * Segments * Segments> plane(float halfSize) {
+		Mesh<Vertex, (Segments + 1) * (Segments + 1), 6 * Segments * Segments> m{};
+		const float normal[3] = { 0.f, 1.f, 0.f };
+		const float origin[3] = { -halfSize, 0.f, halfSize };
+		const float u[3] = { 2.f * halfSize, 0.f, 0.f };
+		const float w[3] = { 0.f, 0.f, -2.f * halfSize };
+		int v = 0, i = 0;
+		detail::grid(m, v, i, Segments, normal, origin, u, w);
+		return m;
+	}
+
+	// Sphere around the origin from Stacks bands between the poles on the Y
+	// axis, each of Slices segments. One vertex per pole.
+	template<int Slices, int Stacks>
+	constexpr Mesh<Vertex, 2 + Slices * (Stacks - 1), 6 * Slices * (Stacks - 1)> sphere(float radius) {
+		static_assert(Slices >= 3 && Stacks >= 2, "sphere needs 3 slices and 2 stacks");
+		Mesh<Vertex, 2 + Slices * (Stacks - 1), 6 * Slices * (Stacks - 1)> m{};
+		const int bottom = 1 + Slices * (Stacks - 1);
+		detail::set(m.verts[0].normal, 0.f, 1.f, 0.f);
+		detail::set(m.verts[bottom].normal, 0.f, -1.f, 0.f);
+		for (int stack = 1; stack < Stacks; stack++) {
+			double phi = detail::pi * stack / Stacks;
+			for (int slice = 0; slice < Slices; slice++) {
+				double theta = 2.0 * detail::pi * slice / Slices;
+				Vertex& out = m.verts[1 + (stack - 1) * Slices + slice];
+				detail::set(out.normal, (float)(detail::sin(phi) * detail::cos(theta)), (float)detail::cos(phi),
+					(float)(detail::sin(phi) * detail::sin(theta)));
+			}
+		}
+		for (int v = 0; v < m.numVerts; v++) {
+			for (int k = 0; k < 3; k++) m.verts[v].position[k] = m.verts[v].normal[k] * radius;
+		}
+
+		int i = 0;
+		for (int slice = 0; slice < Slices; slice++) {
+			int next = (slice + 1) % Slices;
+			m.indices[i++] = (uint16_t)(1 + slice);
+			m.indices[i++] = 0;
+			m.indices[i++] = (uint16_t)(1 + next);
+			for (int stack = 1; stack < Stacks - 1; stack++) {
+				int a = 1 + (stack - 1) * Slices + slice, b = 1 + (stack - 1) * Slices + next;
+				m.indices[i++] = (uint16_t)a;
+				m.indices[i++] = (uint16_t)b;
+				m.indices[i++] = (uint16_t)(a + Slices);
+				m.indices[i++] = (uint16_t)(a + Slices);
+				m.indices[i++] = (uint16_t)b;
+				m.indices[i++] = (uint16_t)(b + Slices);
+			}
+			m.indices[i++] = (uint16_t)(bottom - Slices + slice);
+			m.indices[i++] = (uint16_t)(bottom - Slices + next);
+			m.indices[i++] = (uint16_t)bottom;
+		}
+		return m;
+	}
+
+	// Closed cylinder around the Y axis, centered on the origin. The side and
+	// the two caps have their own vertices so the edges stay sharp.
+	template<int Slices>
+	constexpr Mesh<Vertex, 4 * Slices + 2, 12 * Slices> cylinder(float radius, float height) {
+		static_assert(Slices >= 3, "cylinder needs 3 slices");
+		Mesh<Vertex, 4 * Slices + 2, 12 * Slices> m{};
+		const float top = 0.5f * height;
+		// Side top ring, side bottom ring, top cap rim, bottom cap rim, centers
+		const int topCenter = 4 * Slices, bottomCenter = 4 * Slices + 1;
+		for (int slice = 0; slice < Slices; slice++) {
+			double theta = 2.0 * detail::pi * slice / Slices;
+			float x = (float)detail::cos(theta), z = (float)detail::sin(theta);
+			for (int ring = 0; ring < 4; ring++) {
+				Vertex& out = m.verts[ring * Slices + slice];
+				detail::set(out.position, x * radius, ring % 2 == 0 ? top : -top, z * radius);
+				if (ring < 2) detail::set(out.normal, x, 0.f, z);
+				else detail::set(out.normal, 0.f, ring == 2 ? 1.f : -1.f, 0.f);
+			}
+		}
+		detail::set(m.verts[topCenter].position, 0.f, top, 0.f);
+		detail::set(m.verts[topCenter].normal, 0.f, 1.f, 0.f);
+		detail::set(m.verts[bottomCenter].position, 0.f, -top, 0.f);
+		detail::set(m.verts[bottomCenter].normal, 0.f, -1.f, 0.f);
+
+		int i = 0;
+		for (int slice = 0; slice < Slices; slice++) {
+			int next = (slice + 1) % Slices;
+			const int side[6] = { slice, next, Slices + slice, Slices + slice, next, Slices + next };
+			const int caps[6] = { topCenter, 2 * Slices + next, 2 * Slices + slice, bottomCenter, 3 * Slices + slice, 3 * Slices + next };
+			for (int k = 0; k < 6; k++) m.indices[i++] = (uint16_t)side[k];
+			for (int k = 0; k < 6; k++) m.indices[i++] = (uint16_t)caps[k];
+		}
+		return m;
+	}
+
+	// X, Y and Z from the origin as red, green and blue lines
+	constexpr Mesh<ColorVertex, 6, 6> axes(float length) {
+		Mesh<ColorVertex, 6, 6> m{};
+		for (int axis = 0; axis < 3; axis++) {
+			for (int end = 0; end < 2; end++) {
+				ColorVertex& out = m.verts[2 * axis + end];
+				out.position[axis] = end * length;
+				out.color[axis] = 1.f;
+				out.color[3] = 1.f;
+				m.indices[2 * axis + end] = (uint16_t)(2 * axis + end);
+			}
+		}
+		return m;
+	}
+
+	// Checks for the generated meshes, usable in static_assert
+
+	template<typename M>
+	constexpr bool indicesInRange(const M& m) {
+		for (int i = 0; i < m.numIndices; i++) {
+			if (m.indices[i] >= m.numVerts) return false;
+		}
+		return true;
+	}
+	template<typename M>
+	constexpr bool normalsUnit(const M& m) {
+		for (int v = 0; v < m.numVerts; v++) {
+			const float* n = m.verts[v].normal;
+			float len2 = n[0] * n[0] + n[1] * n[1] + n[2] * n[2];
+			if (len2 < 0.9999f || len2 > 1.0001f) return false;
+		}
+		return true;
+	}
+	// Every triangle has area and turns counter clockwise around its normals
+	template<typename M>
+	constexpr bool facesOutward(const M& m) {
+		for (int i = 0; i + 2 < m.numIndices; i += 3) {
+			const Vertex& a = m.verts[m.indices[i]];
+			const Vertex& b = m.verts[m.indices[i + 1]];
+			const Vertex& c = m.verts[m.indices[i + 2]];
+			float e1[3] = {}, e2[3] = {}, n[3] = {};
+			for (int k = 0; k < 3; k++) {
+				e1[k] = b.position[k] - a.position[k];
+				e2[k] = c.position[k] - a.position[k];
+				n[k] = a.normal[k] + b.normal[k] + c.normal[k];
+			}
+			float cross[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+			if (cross[0] * n[0] + cross[1] * n[1] + cross[2] * n[2] <= 0.f) return false;
+		}
+		return true;
+	}
+	// Every vertex at distance radius from the origin
+	template<typename M>
+	constexpr bool onSphere(const M& m, float radius) {
+		for (int v = 0; v < m.numVerts; v++) {
+			const float* p = m.verts[v].position;
+			float d2 = p[0] * p[0] + p[1] * p[1] + p[2] * p[2];
+			if (d2 < radius * radius * 0.9999f || d2 > radius * radius * 1.0001f) return false;
+		}
+		return true;
+	}
+	template<typename M>
+	constexpr bool valid(const M& m) {
+		return indicesInRange(m) && normalsUnit(m) && facesOutward(m);
+	}
+
+	namespace checks {
+		constexpr bool approx(double a, double b) { return a - b < 1e-12 && b - a < 1e-12; }
+		static_assert(sizeof(Vertex) == 24 && sizeof(ColorVertex) == 28, "vertices are tightly packed");
+		static_assert(approx(detail::sin(detail::pi / 6.0), 0.5) && approx(detail::cos(detail::pi), -1.0)
+			&& approx(detail::sin(-10.0), 0.54402111088936981), "constexpr sin and cos");
+
+		constexpr auto cube = box<1>(0.5f);
+		static_assert(cube.numVerts == 24 && cube.numIndices == 36 && valid(cube), "unit cube");
+		static_assert(cube.verts[0].position[0] == -0.5f && cube.verts[0].position[1] == -0.5f && cube.verts[0].position[2] == 0.5f
+			&& cube.verts[23].position[0] == 0.5f && cube.verts[23].position[1] == 0.5f && cube.verts[23].position[2] == 0.5f,
+			"cube corners in the order of the old hand written cube");
+		static_assert(valid(box<3>(2.f)), "tessellated box");
+		static_assert(valid(plane<4>(1.f)), "plane");
+
+		constexpr auto ball = sphere<12, 6>(2.f);
+		static_assert(ball.numVerts == 62 && valid(ball) && onSphere(ball, 2.f), "sphere");
+		static_assert(valid(sphere<3, 2>(1.f)), "coarsest sphere");
+		static_assert(valid(cylinder<8>(1.f, 3.f)), "cylinder");
+
+		constexpr auto lines = axes(1.f);
+		static_assert(indicesInRange(lines) && lines.verts[5].position[2] == 1.f && lines.verts[5].color[2] == 1.f
+			&& lines.verts[1].color[1] == 0.f, "axes");
+	}
+}
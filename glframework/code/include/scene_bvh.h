@@ -0,0 +1,57 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "frustum_cull.h"
+
+// Bounding volume hierarchy over the scene's drawables, one AABB per item, for
+// the queries a flat list answers in linear time: ray picking and hierarchical
+// frustum culling. Built top down with binned SAH like MeshBVH. When items move
+// refit() only recomputes the boxes bottom up; the tree is rebuilt once the
+// refits have made it much worse than a fresh build would be.
+struct SceneBVH {
+	struct Node {
+		glm::vec3 bmin;
+		int first;	// first child (the second is first + 1), or first leaf slot
+		glm::vec3 bmax;
+		int count;	// items in a leaf, 0 for inner nodes
+	};
+	std::vector<Node> nodes;
+	// Per leaf slot: the item, its box and its sphere radius
+	std::vector<int> items;
+	std::vector<glm::vec3> itemMin, itemMax;
+	std::vector<float> itemRadius;
+
+	// Narrow phase for one item: closest hit with t in (0, tHit). Lowers tHit
+	// and returns true on a hit.
+	typedef bool(*ItemRay)(void* user, int item, const glm::vec3& orig, const glm::vec3& dir, float& tHit);
+
+	SceneBVH() : builtCost(0.f) {}
+
+	// Builds over the AABBs of set
+	void build(const Culling::BoundsSet& set);
+	// Takes the new bounds of the same items. Rebuilds instead of refitting when
+	// the tree got too loose; returns true if it did.
+	bool refit(const Culling::BoundsSet& set);
+	int numItems() const { return (int)items.size(); }
+
+	// Closest item hit within tmax, or -1. Items are handed to test in order of
+	// their box entry distance, and boxes beyond the closest hit are skipped.
+	int raycast(const glm::vec3& orig, const glm::vec3& dir, float tmax, ItemRay test, void* user, float& tHit) const;
+	// Same contract and item test as Culling::cull. Nodes are tested on their
+	// AABB: fully inside a plane drops it for the subtree, outside one rejects
+	// the subtree. Items in the leaves then get the box and sphere test.
+	int cull(const glm::vec4* planes, unsigned char* visible) const;
+
+	struct BenchResult {
+		double buildMs, refitMs;
+		double cullMs, flatCullMs;	// flatCullMs is Culling::cull on the same set
+		double rayNs;
+	};
+	// Times the queries on count random boxes
+	static BenchResult benchmark(int count);
+
+private:
+	float builtCost;	// cost() right after the last build
+	float cost() const;
+};
@@ -0,0 +1,60 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+
+// Transform hierarchy. Nodes are stored structure-of-arrays, one set of arrays
+// per depth level, so parents always sit in the level before their children
+// and update() can walk the levels in order. Changing a local transform only
+// queues that node; update() recomputes the queued nodes and their subtrees
+// and nothing else.
+struct SceneGraph {
+	// Depth in the top bits, index within the level below
+	typedef unsigned NodeId;
+	static const NodeId invalid = ~0u;
+	static const int indexBits = 24;
+
+	SceneGraph() : updateVersion(0) {}
+
+	// parent == invalid makes a root. At most 256 levels of 16M nodes each.
+	NodeId create(NodeId parent, const glm::mat4& local);
+	void setLocal(NodeId node, const glm::mat4& local);
+	void clear();
+
+	const glm::mat4& local(NodeId node) const { return levels[depth(node)].local[index(node)]; }
+	// Up to date as of the last update()
+	const glm::mat4& world(NodeId node) const { return levels[depth(node)].world[index(node)]; }
+	NodeId parent(NodeId node) const;
+	static int depth(NodeId node) { return (int)(node >> indexBits); }
+	static unsigned index(NodeId node) { return node & ((1u << indexBits) - 1); }
+	size_t size() const;
+
+	// Recomputes the world transforms of changed nodes and their descendants,
+	// returns how many were recomputed
+	int update();
+	// Nodes whose world transform the last update() recomputed
+	const std::vector<NodeId>& changed() const { return changedNodes; }
+	// Incremented by every update() that changed something
+	unsigned version() const { return updateVersion; }
+
+	// Times update() on a generated tree of numNodes nodes, once with every
+	// node dirty and once with numChanged random nodes moved. Returns how many
+	// nodes the second update recomputed.
+	static int benchmark(int numNodes, int numChanged, double& fullMs, double& partialMs);
+
+private:
+	struct Level {
+		std::vector<glm::mat4> local;
+		std::vector<glm::mat4> world;
+		std::vector<unsigned> parent;	// index in the level above
+		std::vector<unsigned> firstChild;	// index in the level below
+		std::vector<unsigned> nextSibling;	// index in this level
+		std::vector<unsigned char> dirty;
+		std::vector<unsigned> queued;	// dirty nodes, each once
+	};
+	std::vector<Level> levels;
+	std::vector<NodeId> changedNodes;
+	unsigned updateVersion;
+
+	static NodeId makeId(int depth, unsigned index) { return ((unsigned)depth << indexBits) | index; }
+	void markDirty(Level& level, unsigned i);
+};
@@ -0,0 +1,55 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+// Uniform grid over points for broad-phase neighbor and overlap queries,
+// meant to be rebuilt from scratch every frame. Cells are hashed into a table
+// sized to the point count, and a parallel counting sort stores the points of
+// each bucket contiguously, positions included. A query walks its few buckets
+// linearly and never touches the input arrays.
+struct SpatialGrid {
+	explicit SpatialGrid(float cellSize = 1.f);
+
+	// Cell edge length, best around the typical query radius
+	void setCellSize(float size) { cell = size; invCell = 1.f / size; }
+	float cellSize() const { return cell; }
+
+	void build(const glm::vec3* points, int count);
+	int size() const { return (int)entries.size(); }
+
+	// Appends the indices of points within radius of center, or inside the
+	// box, to out and returns how many it appended. The order is unspecified.
+	int queryRadius(const glm::vec3& center, float radius, std::vector<int>& out) const;
+	int queryBox(const glm::vec3& bmin, const glm::vec3& bmax, std::vector<int>& out) const;
+
+	// Times build() on numPoints random points spread one per cell, moved a
+	// little between runs, and radius queries of two cells against the result
+	static void benchmark(int numPoints, double& buildMs, double& queryUs);
+
+private:
+	float cell, invCell;
+	unsigned mask;	// table size - 1, the size is a power of two
+	// Per bucket: begin in the sorted arrays, and the end at bucketStart[b + 1]
+	std::vector<int> bucketStart;
+	// Sorted by bucket. One entry per point keeps the scatter to one write
+	// stream and a query to one cache line per point.
+	struct Entry {
+		float x, y, z;
+		int index;	// in the input
+		uint64_t cell;	// packed cell coordinates
+	};
+	std::vector<Entry> entries;
+	// Build scratch
+	std::vector<uint64_t> keys;
+	std::vector<unsigned> buckets;
+	// Sorted by first level bin only
+	std::vector<Entry> binned;
+	std::vector<unsigned> binnedBucket;
+	std::vector<int> binStart;
+	std::vector<int> chunkOffsets;	// per chunk and bin
+
+	uint64_t keyOf(int x, int y, int z) const;
+	unsigned bucketOf(int x, int y, int z) const;
+	template<typename F> int visitCells(const glm::vec3& bmin, const glm::vec3& bmax, const F& test, std::vector<int>& out) const;
+};
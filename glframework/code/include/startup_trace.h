@@ -0,0 +1,39 @@
+#pragma once
+
+// Timeline of the work done between process start and the first frame.
+// Sections nest per thread and are stamped in ns from a clock read during
+// static initialization, so the time before main shows up as well. Recording
+// stops at finish(); later sections cost a clock read and nothing else.
+namespace StartupTrace {
+	const int capacity = 64;
+
+	struct Event {
+		const char* name;	// must outlive the trace, string literals in practice
+		long long startNs;
+		long long endNs;	// -1 while the section is open
+		int depth;
+		int thread;	// 0 for the thread that recorded first
+	};
+
+	long long nowNs();
+	// Opens a section, returns its id for end() or -1 if nothing was recorded
+	int begin(const char* name);
+	void end(int id);
+
+	struct Scope {
+		int id;
+		explicit Scope(const char* name) : id(begin(name)) {}
+		~Scope() { end(id); }
+	};
+
+	// Marks the first frame and stops recording
+	void finish();
+	bool finished();
+	long long totalNs();
+
+	// Copies up to maxEvents events in the order they were opened; returns the count
+	int copyEvents(Event* out, int maxEvents);
+	void print();
+	// Chrome trace event format, for chrome://tracing or Perfetto
+	bool writeChromeTrace(const char* path);
+}
@@ -0,0 +1,129 @@
+#include <glm/gtc/constants.hpp>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include "crt_compat.h"
+#include "ao_bake.h"
+#include "mesh_bvh.h"
+#include "job_system.h"
+
+namespace {
+	const char cacheMagic[4] = { 'A', 'O', 'V', '1' };
+	const int chunkSize = 256;
+
+	struct CacheHeader {
+		char magic[4];
+		uint32_t numVerts;
+		uint32_t numRays;
+		uint32_t pad;
+		uint64_t meshHash;
+	};
+
+	uint64_t fnv1a(const void* data, size_t size, uint64_t h) {
+		const unsigned char* p = (const unsigned char*)data;
+		for (size_t i = 0; i < size; i++) {
+			h ^= p[i];
+			h *= 1099511628211ull;
+		}
+		return h;
+	}
+
+	uint64_t hashMesh(const std::vector<glm::vec3>& verts, const std::vector<glm::vec3>& norms) {
+		uint64_t h = 14695981039346656037ull;
+		h = fnv1a(verts.data(), verts.size() * sizeof(glm::vec3), h);
+		h = fnv1a(norms.data(), norms.size() * sizeof(glm::vec3), h);
+		return h;
+	}
+
+	bool readCache(const char* path, const CacheHeader& expected, std::vector<unsigned char>& ao) {
+		FILE* f;
+		fopen_s(&f, path, "rb");
+		if (f == NULL) return false;
+		CacheHeader h;
+		bool ok = fread(&h, sizeof(h), 1, f) == 1
+			&& memcmp(h.magic, expected.magic, sizeof(h.magic)) == 0
+			&& h.numVerts == expected.numVerts
+			&& h.numRays == expected.numRays
+			&& h.meshHash == expected.meshHash;
+		if (ok) {
+			ao.resize(h.numVerts);
+			ok = fread(ao.data(), 1, ao.size(), f) == ao.size();
+		}
+		fclose(f);
+		return ok;
+	}
+
+	void writeCache(const char* path, const CacheHeader& h, const std::vector<unsigned char>& ao) {
+		FILE* f;
+		fopen_s(&f, path, "wb");
+		if (f == NULL) {
+			printf("Couldn't write AO cache %s\n", path);
+			return;
+		}
+		fwrite(&h, sizeof(h), 1, f);
+		fwrite(ao.data(), 1, ao.size(), f);
+		fclose(f);
+	}
+
+	// Small deterministic generator so repeated bakes give identical caches
+	inline float rand01(uint32_t& state) {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return (state >> 8) * (1.f / 16777216.f);
+	}
+
+	unsigned char vertexAO(const MeshBVH& bvh, const glm::vec3& p, const glm::vec3& n, int numRays, float radius, uint32_t seed) {
+		glm::vec3 N = glm::normalize(n);
+		glm::vec3 T = glm::abs(N.x) > 0.9f ? glm::vec3(0.f, 1.f, 0.f) : glm::vec3(1.f, 0.f, 0.f);
+		T = glm::normalize(glm::cross(T, N));
+		glm::vec3 B = glm::cross(N, T);
+		glm::vec3 orig = p + N * (radius * 1e-3f);
+
+		int hits = 0;
+		for (int r = 0; r < numRays; r++) {
+			// Cosine weighted hemisphere direction
+			float u1 = rand01(seed), u2 = rand01(seed);
+			float rr = glm::sqrt(u1);
+			float phi = glm::two_pi<float>() * u2;
+			glm::vec3 dir = T * (rr * glm::cos(phi)) + B * (rr * glm::sin(phi)) + N * glm::sqrt(1.f - u1);
+			if (bvh.occluded(orig, dir, 0.f, radius)) hits++;
+		}
+		return (unsigned char)(255 * (numRays - hits) / numRays);
+	}
+}
+
+namespace AOBake {
+	std::vector<unsigned char> bakeVertexAO(const std::vector<glm::vec3>& verts,
+		const std::vector<glm::vec3>& norms, const char* cachePath, int numRays) {
+		std::vector<unsigned char> ao;
+		if (verts.empty() || norms.size() != verts.size()) {
+			ao.assign(verts.size(), 255);
+			return ao;
+		}
+
+		CacheHeader header;
+		memcpy(header.magic, cacheMagic, sizeof(header.magic));
+		header.numVerts = (uint32_t)verts.size();
+		header.numRays = (uint32_t)numRays;
+		header.pad = 0;
+		header.meshHash = hashMesh(verts, norms);
+		if (readCache(cachePath, header, ao)) return ao;
+
+		MeshBVH bvh;
+		bvh.build(verts);
+		// Occlusion only counts within a fraction of the mesh size
+		float radius = 0.25f * glm::length(bvh.boundsMax() - bvh.boundsMin());
+
+		ao.resize(verts.size());
+		Jobs::parallelFor(0, (int)verts.size(), chunkSize, [&](int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				ao[i] = vertexAO(bvh, verts[i], norms[i], numRays, radius, 2654435761u * (i + 1));
+			}
+		});
+
+		writeCache(cachePath, header, ao);
+		return ao;
+	}
+}
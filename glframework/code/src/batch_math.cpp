@@ -0,0 +1,368 @@
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/matrix_inverse.hpp>
+#include <immintrin.h>
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "batch_math.h"
+#include "bench_util.h"
+
+// MSVC emits AVX intrinsics anywhere, GCC and Clang only in functions built for it
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+#define TARGET_AVX2
+#endif
+
+namespace {
+	typedef void(*MulFn)(const glm::mat4*, const glm::mat4*, glm::mat4*, int);
+	typedef void(*MulSharedFn)(const glm::mat4&, const glm::mat4*, glm::mat4*, int);
+	typedef void(*TransformFn)(const glm::mat4&, const glm::vec4*, glm::vec4*, int);
+	typedef void(*InverseFn)(const glm::mat4*, glm::mat4*, int);
+
+	struct Kernels {
+		MulFn mul;
+		MulSharedFn mulShared;
+		TransformFn transform;
+		InverseFn inverseAffine;
+		InverseFn normalMatrix;
+	};
+
+	////////////////////////////////////////////////// Scalar, plain glm
+	void mulScalar(const glm::mat4* a, const glm::mat4* b, glm::mat4* out, int count) {
+		for (int i = 0; i < count; i++) out[i] = a[i] * b[i];
+	}
+	void mulSharedScalar(const glm::mat4& a, const glm::mat4* b, glm::mat4* out, int count) {
+		glm::mat4 m = a;
+		for (int i = 0; i < count; i++) out[i] = m * b[i];
+	}
+	void transformScalar(const glm::mat4& m, const glm::vec4* v, glm::vec4* out, int count) {
+		glm::mat4 mm = m;
+		for (int i = 0; i < count; i++) out[i] = mm * v[i];
+	}
+	void inverseAffineScalar(const glm::mat4* m, glm::mat4* out, int count) {
+		for (int i = 0; i < count; i++) out[i] = glm::affineInverse(m[i]);
+	}
+	void normalMatrixScalar(const glm::mat4* m, glm::mat4* out, int count) {
+		for (int i = 0; i < count; i++) out[i] = glm::mat4(glm::inverseTranspose(glm::mat3(m[i])));
+	}
+
+	////////////////////////////////////////////////// SSE
+	#define SPLAT(v, i) _mm_shuffle_ps(v, v, _MM_SHUFFLE(i, i, i, i))
+
+	// c[0] * v.x + c[1] * v.y + c[2] * v.z + c[3] * v.w
+	inline __m128 combine(const __m128 c[4], __m128 v) {
+		__m128 r = _mm_mul_ps(c[0], SPLAT(v, 0));
+		r = _mm_add_ps(r, _mm_mul_ps(c[1], SPLAT(v, 1)));
+		r = _mm_add_ps(r, _mm_mul_ps(c[2], SPLAT(v, 2)));
+		return _mm_add_ps(r, _mm_mul_ps(c[3], SPLAT(v, 3)));
+	}
+	inline void load(const glm::mat4& m, __m128 c[4]) {
+		const float* p = &m[0][0];
+		for (int j = 0; j < 4; j++) c[j] = _mm_loadu_ps(p + 4 * j);
+	}
+	inline void store(glm::mat4& m, const __m128 c[4]) {
+		float* p = &m[0][0];
+		for (int j = 0; j < 4; j++) _mm_storeu_ps(p + 4 * j, c[j]);
+	}
+	// w of the result is 0
+	inline __m128 cross(__m128 a, __m128 b) {
+		__m128 a1 = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+		__m128 b1 = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+		__m128 c = _mm_sub_ps(_mm_mul_ps(a, b1), _mm_mul_ps(a1, b));
+		return _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1));
+	}
+	inline __m128 dotSplat(__m128 a, __m128 b) {
+		__m128 m = _mm_mul_ps(a, b);
+		m = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+		return _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+	}
+	// Adjugate rows of the upper 3x3, pre divided by the determinant. They are
+	// the rows of its inverse and the columns of the normal matrix.
+	inline void inverseRows(const __m128 c[4], __m128 r[3]) {
+		r[0] = cross(c[1], c[2]);
+		r[1] = cross(c[2], c[0]);
+		r[2] = cross(c[0], c[1]);
+		__m128 invDet = _mm_div_ps(_mm_set1_ps(1.f), dotSplat(c[0], r[0]));
+		for (int k = 0; k < 3; k++) r[k] = _mm_mul_ps(r[k], invDet);
+	}
+
+	void mulSSE(const glm::mat4* a, const glm::mat4* b, glm::mat4* out, int count) {
+		for (int i = 0; i < count; i++) BatchMath::mul(a[i], b[i], out[i]);
+	}
+	void mulSharedSSE(const glm::mat4& a, const glm::mat4* b, glm::mat4* out, int count) {
+		__m128 ac[4], bc[4], r[4];
+		load(a, ac);
+		for (int i = 0; i < count; i++) {
+			load(b[i], bc);
+			for (int j = 0; j < 4; j++) r[j] = combine(ac, bc[j]);
+			store(out[i], r);
+		}
+	}
+	void transformSSE(const glm::mat4& m, const glm::vec4* v, glm::vec4* out, int count) {
+		__m128 c[4];
+		load(m, c);
+		for (int i = 0; i < count; i++) {
+			_mm_storeu_ps(&out[i][0], combine(c, _mm_loadu_ps(&v[i][0])));
+		}
+	}
+	void inverseAffineSSE(const glm::mat4* m, glm::mat4* out, int count) {
+		for (int i = 0; i < count; i++) {
+			__m128 c[4], r[4];
+			load(m[i], c);
+			inverseRows(c, r);
+			r[3] = _mm_setzero_ps();
+			_MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+			// (0, 0, 0, 1) - R^-1 t
+			__m128 t = combine(r, _mm_and_ps(c[3], _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1))));
+			r[3] = _mm_sub_ps(_mm_set_ps(1.f, 0.f, 0.f, 0.f), t);
+			store(out[i], r);
+		}
+	}
+	void normalMatrixSSE(const glm::mat4* m, glm::mat4* out, int count) {
+		for (int i = 0; i < count; i++) {
+			__m128 c[4], r[4];
+			load(m[i], c);
+			inverseRows(c, r);
+			r[3] = _mm_set_ps(1.f, 0.f, 0.f, 0.f);
+			store(out[i], r);
+		}
+	}
+
+	////////////////////////////////////////////////// AVX2, two matrices or vectors per iteration
+	#define SPLAT8(v, i) _mm256_permute_ps(v, _MM_SHUFFLE(i, i, i, i))
+
+	TARGET_AVX2 inline __m256 combine8(const __m256 c[4], __m256 v) {
+		__m256 r = _mm256_mul_ps(c[0], SPLAT8(v, 0));
+		r = _mm256_fmadd_ps(c[1], SPLAT8(v, 1), r);
+		r = _mm256_fmadd_ps(c[2], SPLAT8(v, 2), r);
+		return _mm256_fmadd_ps(c[3], SPLAT8(v, 3), r);
+	}
+	// Column j of m0 in the low lane, of m1 in the high one
+	TARGET_AVX2 inline void loadPair(const glm::mat4& m0, const glm::mat4& m1, __m256 c[4]) {
+		for (int j = 0; j < 4; j++) {
+			c[j] = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(&m0[j][0])), _mm_loadu_ps(&m1[j][0]), 1);
+		}
+	}
+	TARGET_AVX2 inline void storePair(glm::mat4& m0, glm::mat4& m1, const __m256 c[4]) {
+		for (int j = 0; j < 4; j++) {
+			_mm_storeu_ps(&m0[j][0], _mm256_castps256_ps128(c[j]));
+			_mm_storeu_ps(&m1[j][0], _mm256_extractf128_ps(c[j], 1));
+		}
+	}
+	TARGET_AVX2 inline void broadcast(const glm::mat4& m, __m256 c[4]) {
+		for (int j = 0; j < 4; j++) c[j] = _mm256_broadcast_ps((const __m128*)&m[j][0]);
+	}
+	TARGET_AVX2 inline __m256 cross8(__m256 a, __m256 b) {
+		__m256 a1 = _mm256_permute_ps(a, _MM_SHUFFLE(3, 0, 2, 1));
+		__m256 b1 = _mm256_permute_ps(b, _MM_SHUFFLE(3, 0, 2, 1));
+		__m256 c = _mm256_fmsub_ps(a, b1, _mm256_mul_ps(a1, b));
+		return _mm256_permute_ps(c, _MM_SHUFFLE(3, 0, 2, 1));
+	}
+	TARGET_AVX2 inline void inverseRows8(const __m256 c[4], __m256 r[3]) {
+		r[0] = cross8(c[1], c[2]);
+		r[1] = cross8(c[2], c[0]);
+		r[2] = cross8(c[0], c[1]);
+		__m256 d = _mm256_mul_ps(c[0], r[0]);
+		d = _mm256_add_ps(d, _mm256_permute_ps(d, _MM_SHUFFLE(1, 0, 3, 2)));
+		d = _mm256_add_ps(d, _mm256_permute_ps(d, _MM_SHUFFLE(2, 3, 0, 1)));
+		__m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.f), d);
+		for (int k = 0; k < 3; k++) r[k] = _mm256_mul_ps(r[k], invDet);
+	}
+	TARGET_AVX2 inline void transpose8(__m256 r[4]) {
+		__m256 t0 = _mm256_unpacklo_ps(r[0], r[1]);
+		__m256 t1 = _mm256_unpacklo_ps(r[2], r[3]);
+		__m256 t2 = _mm256_unpackhi_ps(r[0], r[1]);
+		__m256 t3 = _mm256_unpackhi_ps(r[2], r[3]);
+		r[0] = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(1, 0, 1, 0));
+		r[1] = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 2, 3, 2));
+		r[2] = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(1, 0, 1, 0));
+		r[3] = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(3, 2, 3, 2));
+	}
+
+	TARGET_AVX2 void mulAVX2(const glm::mat4* a, const glm::mat4* b, glm::mat4* out, int count) {
+		for (int i = 0; i < count; i++) {
+			__m256 ac[4];
+			broadcast(a[i], ac);
+			// Columns 0-1 and 2-3 are contiguous, each pair is one load
+			const float* pb = &b[i][0][0];
+			__m256 lo = combine8(ac, _mm256_loadu_ps(pb));
+			__m256 hi = combine8(ac, _mm256_loadu_ps(pb + 8));
+			float* po = &out[i][0][0];
+			_mm256_storeu_ps(po, lo);
+			_mm256_storeu_ps(po + 8, hi);
+		}
+	}
+	TARGET_AVX2 void mulSharedAVX2(const glm::mat4& a, const glm::mat4* b, glm::mat4* out, int count) {
+		__m256 ac[4];
+		broadcast(a, ac);
+		for (int i = 0; i < count; i++) {
+			// Columns 0-1 and 2-3 are contiguous, each pair is one load
+			const float* pb = &b[i][0][0];
+			__m256 lo = combine8(ac, _mm256_loadu_ps(pb));
+			__m256 hi = combine8(ac, _mm256_loadu_ps(pb + 8));
+			float* po = &out[i][0][0];
+			_mm256_storeu_ps(po, lo);
+			_mm256_storeu_ps(po + 8, hi);
+		}
+	}
+	TARGET_AVX2 void transformAVX2(const glm::mat4& m, const glm::vec4* v, glm::vec4* out, int count) {
+		__m256 c[4];
+		broadcast(m, c);
+		int i = 0;
+		for (; i + 2 <= count; i += 2) {
+			_mm256_storeu_ps(&out[i][0], combine8(c, _mm256_loadu_ps(&v[i][0])));
+		}
+		transformSSE(m, v + i, out + i, count - i);
+	}
+	TARGET_AVX2 void inverseAffineAVX2(const glm::mat4* m, glm::mat4* out, int count) {
+		const __m256 mask = _mm256_castsi256_ps(_mm256_set_epi32(0, -1, -1, -1, 0, -1, -1, -1));
+		const __m256 w1 = _mm256_set_ps(1.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f, 0.f);
+		int i = 0;
+		for (; i + 2 <= count; i += 2) {
+			__m256 c[4], r[4];
+			loadPair(m[i], m[i + 1], c);
+			inverseRows8(c, r);
+			r[3] = _mm256_setzero_ps();
+			transpose8(r);
+			__m256 t = combine8(r, _mm256_and_ps(c[3], mask));
+			r[3] = _mm256_sub_ps(w1, t);
+			storePair(out[i], out[i + 1], r);
+		}
+		inverseAffineSSE(m + i, out + i, count - i);
+	}
+	const Kernels kernels[BatchMath::NumLevels] = {
+		{ mulScalar, mulSharedScalar, transformScalar, inverseAffineScalar, normalMatrixScalar },
+		{ mulSSE, mulSharedSSE, transformSSE, inverseAffineSSE, normalMatrixSSE },
+		// Normal matrices skip the inverse's transpose and gain nothing from pairing
+		{ mulAVX2, mulSharedAVX2, transformAVX2, inverseAffineAVX2, normalMatrixSSE },
+	};
+
+	BatchMath::Level detectLevel() {
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7) return BatchMath::SSE;
+		__cpuid(info, 1);
+		bool fma = (info[2] & (1 << 12)) != 0;
+		bool osAvx = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+		__cpuidex(info, 7, 0);
+		bool avx2 = (info[1] & (1 << 5)) != 0;
+		return avx2 && fma && osAvx ? BatchMath::AVX2 : BatchMath::SSE;
+#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ? BatchMath::AVX2 : BatchMath::SSE;
+#endif
+	}
+
+	const BatchMath::Level supported = detectLevel();
+	// Set from the GUI thread while the render thread and workers multiply.
+	// The tables never change, so relaxed loads are enough.
+	std::atomic<BatchMath::Level> current(supported);
+	std::atomic<const Kernels*> active(&kernels[supported]);
+
+	// Vectorized kernels reorder the arithmetic, so they differ from glm by a
+	// few ulps; more than this means a broken kernel
+	const float benchTolerance = 1e-4f;
+
+	// Largest element difference, relative for magnitudes over 1
+	float maxDiff(const float* ref, const float* val, int n) {
+		float worst = 0.f;
+		for (int i = 0; i < n; i++) {
+			float d = fabsf(val[i] - ref[i]) / std::max(1.f, fabsf(ref[i]));
+			// NaN compares false, count it as a full mismatch
+			worst = d <= worst ? worst : (d == d ? d : FLT_MAX);
+		}
+		return worst;
+	}
+}
+
+namespace BatchMath {
+	const char* levelNames[NumLevels] = { "scalar", "SSE", "AVX2" };
+	const char* kernelNames[5] = { "mat4 * mat4", "shared * mat4", "mat4 * vec4", "affine inverse", "normal matrix" };
+
+	Level detect() {
+		return supported;
+	}
+	Level level() {
+		return current.load(std::memory_order_relaxed);
+	}
+	void setLevel(Level l) {
+		if (l > supported) l = supported;
+		if (l < Scalar) l = Scalar;
+		current.store(l, std::memory_order_relaxed);
+		active.store(&kernels[l], std::memory_order_relaxed);
+	}
+
+	void mul(const glm::mat4* a, const glm::mat4* b, glm::mat4* out, int count) {
+		active.load(std::memory_order_relaxed)->mul(a, b, out, count);
+	}
+	void mul(const glm::mat4& a, const glm::mat4* b, glm::mat4* out, int count) {
+		active.load(std::memory_order_relaxed)->mulShared(a, b, out, count);
+	}
+	void transform(const glm::mat4& m, const glm::vec4* v, glm::vec4* out, int count) {
+		active.load(std::memory_order_relaxed)->transform(m, v, out, count);
+	}
+	void inverseAffine(const glm::mat4* m, glm::mat4* out, int count) {
+		active.load(std::memory_order_relaxed)->inverseAffine(m, out, count);
+	}
+	void normalMatrix(const glm::mat4* m, glm::mat4* out, int count) {
+		active.load(std::memory_order_relaxed)->normalMatrix(m, out, count);
+	}
+
+	BenchResult benchmark(int count) {
+		std::vector<glm::mat4> a(count), b(count), out(count);
+		std::vector<glm::vec4> v(count), vout(count);
+		BenchUtil::Random rnd(12345u);
+		for (int i = 0; i < count; i++) {
+			glm::mat4 m = glm::translate(glm::mat4(1.f), glm::vec3(rnd.signedUnit(), rnd.signedUnit(), rnd.signedUnit()) * 10.f);
+			m = glm::rotate(m, rnd.signedUnit() * 3.f, glm::normalize(glm::vec3(rnd.signedUnit(), rnd.signedUnit(), rnd.signedUnit()) + glm::vec3(0.f, 0.f, 2.f)));
+			a[i] = glm::scale(m, glm::vec3(1.5f + rnd.signedUnit()));
+			b[i] = glm::transpose(a[i]);
+			v[i] = glm::vec4(rnd.signedUnit(), rnd.signedUnit(), rnd.signedUnit(), 1.f);
+		}
+		glm::mat4 shared = a[0];
+
+		BenchResult res;
+		const Kernels* levels[2] = { &kernels[Scalar], active.load(std::memory_order_relaxed) };
+		double* results[2] = { res.glmNs, res.batchNs };
+		std::vector<glm::mat4> refOut(count);
+		std::vector<glm::vec4> refV(count);
+		for (int kernel = 0; kernel < 5; kernel++) {
+			for (int l = 0; l < 2; l++) {
+				const Kernels& k = *levels[l];
+				// Best of a few runs, the first one also pays for faulting the pages in
+				double best = 1e30;
+				for (int run = 0; run < 5; run++) {
+					auto start = BenchUtil::Clock::now();
+					switch (kernel) {
+					case 0: k.mul(a.data(), b.data(), out.data(), count); break;
+					case 1: k.mulShared(shared, b.data(), out.data(), count); break;
+					case 2: k.transform(shared, v.data(), vout.data(), count); break;
+					case 3: k.inverseAffine(a.data(), out.data(), count); break;
+					case 4: k.normalMatrix(a.data(), out.data(), count); break;
+					}
+					double ns = BenchUtil::nsSince(start) / count;
+					if (ns < best) best = ns;
+				}
+				results[l][kernel] = best;
+				// The glm results go first and are what the batch level is held to
+				if (l == 0) {
+					refOut = out;
+					refV = vout;
+				}
+			}
+			res.maxError[kernel] = kernel == 2 ? maxDiff(&refV[0][0], &vout[0][0], 4 * count)
+				: maxDiff(&refOut[0][0][0], &out[0][0][0], 16 * count);
+			res.mismatch[kernel] = !(res.maxError[kernel] <= benchTolerance);
+		}
+		return res;
+	}
+}
@@ -0,0 +1,221 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+
+#include "crt_compat.h"
+#include "benchmark.h"
+
+namespace {
+	struct Key {
+		float time;
+		float v[5];	// pan xyz, rotation xy
+	};
+	struct DollyEvent {
+		float time;
+		int mode;
+	};
+
+	std::vector<Key> keys;
+	std::vector<DollyEvent> dollyEvents;
+
+	Benchmark::Options options;
+	int frameIndex = 0;
+	std::vector<FrameStats::Sample> samples;
+
+	float catmullRom(float p0, float p1, float p2, float p3, float t) {
+		float t2 = t * t, t3 = t2 * t;
+		return 0.5f * (2.f * p1 + (p2 - p0) * t + (2.f * p0 - 5.f * p1 + 4.f * p2 - p3) * t2 + (3.f * p1 - p0 - 3.f * p2 + p3) * t3);
+	}
+
+	void writeString(FILE* f, const char* s) {
+		fputc('"', f);
+		for (; s != NULL && *s != '\0'; s++) {
+			if (*s == '"' || *s == '\\') fputc('\\', f);
+			if ((unsigned char)*s >= 0x20) fputc(*s, f);
+		}
+		fputc('"', f);
+	}
+
+	bool isNumber(const char* s) {
+		char* end;
+		strtol(s, &end, 10);
+		return end != s && *end == '\0';
+	}
+}
+
+namespace Benchmark {
+	bool parseArgs(int argc, char** argv, Options& opt) {
+		for (int i = 1; i < argc; i++) {
+			if (strcmp(argv[i], "--benchmark") == 0) {
+				opt.enabled = true;
+				if (i + 1 < argc && isNumber(argv[i + 1])) opt.frames = atoi(argv[++i]);
+			}
+			else if (strcmp(argv[i], "--benchmark-warmup") == 0) {
+				if (i + 1 >= argc || !isNumber(argv[i + 1])) return false;
+				opt.warmupFrames = atoi(argv[++i]);
+			}
+			else if (strcmp(argv[i], "--benchmark-out") == 0) {
+				if (i + 1 >= argc) return false;
+				opt.outPath = argv[++i];
+			}
+			else if (strcmp(argv[i], "--camera-path") == 0) {
+				if (i + 1 >= argc) return false;
+				opt.pathFile = argv[++i];
+			}
+		}
+		return opt.frames > 0 && opt.warmupFrames >= 0;
+	}
+
+	bool loadPath(const char* path) {
+		FILE* f;
+		fopen_s(&f, path, "r");
+		if (f == NULL) {
+			printf("Couldn't open camera path %s\n", path);
+			return false;
+		}
+		std::vector<Key> newKeys;
+		std::vector<DollyEvent> newEvents;
+		char line[256];
+		int lineNum = 0;
+		bool ok = true;
+		while (ok && fgets(line, sizeof(line), f) != NULL) {
+			lineNum++;
+			char* p = line;
+			while (*p == ' ' || *p == '\t') p++;
+			if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') continue;
+			Key k;
+			DollyEvent d;
+			if (strncmp(p, "key", 3) == 0) {
+				ok = sscanf_s(p + 3, "%f %f %f %f %f %f", &k.time, &k.v[0], &k.v[1], &k.v[2], &k.v[3], &k.v[4]) == 6;
+				if (ok) newKeys.push_back(k);
+			}
+			else if (strncmp(p, "dolly", 5) == 0) {
+				ok = sscanf_s(p + 5, "%f %d", &d.time, &d.mode) == 2 && d.mode >= 0 && d.mode < 4;
+				if (ok) newEvents.push_back(d);
+			}
+			else ok = false;
+		}
+		fclose(f);
+		if (!ok) {
+			printf("Camera path %s: bad entry on line %d\n", path, lineNum);
+			return false;
+		}
+		if (newKeys.empty()) {
+			printf("Camera path %s has no keys\n", path);
+			return false;
+		}
+		for (size_t i = 1; i < newKeys.size(); i++) {
+			if (newKeys[i].time <= newKeys[i - 1].time) {
+				printf("Camera path %s: key times must increase\n", path);
+				return false;
+			}
+		}
+		keys.swap(newKeys);
+		dollyEvents.swap(newEvents);
+		return true;
+	}
+
+	void useDefaultPath() {
+		// Orbit the scene with the free camera, then run through the three dolly modes
+		const Key defaultKeys[] = {
+			{ 0.f,  { 0.f, -5.f, -15.f, 0.f, 0.f } },
+			{ 3.f,  { 0.f, -5.f, -15.f, 1.57f, 0.3f } },
+			{ 6.f,  { 3.f, -3.f, -25.f, 3.14f, 0.5f } },
+			{ 9.f,  { -2.f, -6.f, -10.f, 4.71f, 0.1f } },
+			{ 12.f, { 0.f, -5.f, -15.f, 6.28f, 0.f } },
+		};
+		const DollyEvent defaultEvents[] = {
+			{ 12.f, 1 }, { 16.f, 2 }, { 20.f, 3 }, { 24.f, 0 },
+		};
+		keys.assign(defaultKeys, defaultKeys + sizeof(defaultKeys) / sizeof(defaultKeys[0]));
+		dollyEvents.assign(defaultEvents, defaultEvents + sizeof(defaultEvents) / sizeof(defaultEvents[0]));
+	}
+
+	CameraPose evaluatePath(float time) {
+		CameraPose pose;
+		memset(&pose, 0, sizeof(pose));
+		if (keys.empty()) useDefaultPath();
+
+		int n = (int)keys.size();
+		int i = 0;
+		while (i + 1 < n && keys[i + 1].time <= time) i++;
+		float v[5];
+		if (i + 1 >= n || time <= keys[0].time) {
+			// Before the first or past the last key the pose holds
+			memcpy(v, keys[time <= keys[0].time ? 0 : n - 1].v, sizeof(v));
+		}
+		else {
+			const Key& k0 = keys[i > 0 ? i - 1 : i];
+			const Key& k1 = keys[i];
+			const Key& k2 = keys[i + 1];
+			const Key& k3 = keys[i + 2 < n ? i + 2 : i + 1];
+			float t = (time - k1.time) / (k2.time - k1.time);
+			for (int c = 0; c < 5; c++) v[c] = catmullRom(k0.v[c], k1.v[c], k2.v[c], k3.v[c], t);
+		}
+		memcpy(pose.panv, v, sizeof(pose.panv));
+		memcpy(pose.rota, v + 3, sizeof(pose.rota));
+
+		for (const DollyEvent& d : dollyEvents) {
+			if (d.time <= time) pose.dollyEffect = d.mode;
+		}
+		return pose;
+	}
+
+	void begin(const Options& opt) {
+		options = opt;
+		frameIndex = 0;
+		samples.clear();
+		samples.reserve(opt.frames);
+	}
+
+	bool addFrame(const FrameStats::Sample& s) {
+		if (frameIndex++ >= options.warmupFrames) samples.push_back(s);
+		return (int)samples.size() < options.frames;
+	}
+
+	bool writeReport(const RunInfo& info) {
+		FILE* f;
+		fopen_s(&f, options.outPath, "w");
+		if (f == NULL) {
+			printf("Couldn't write benchmark report %s\n", options.outPath);
+			return false;
+		}
+		int count = (int)samples.size();
+		fprintf(f, "{\n");
+		fprintf(f, "  \"renderer\": ");
+		writeString(f, info.renderer);
+		fprintf(f, ",\n  \"gl_version\": ");
+		writeString(f, info.glVersion);
+		fprintf(f, ",\n");
+		fprintf(f, "  \"width\": %d,\n  \"height\": %d,\n", info.width, info.height);
+		fprintf(f, "  \"timestep_s\": %.6f,\n", info.timestep);
+		fprintf(f, "  \"camera_path\": ");
+		writeString(f, options.pathFile != NULL ? options.pathFile : "default");
+		fprintf(f, ",\n");
+		fprintf(f, "  \"warmup_frames\": %d,\n  \"frames\": %d,\n", options.warmupFrames, count);
+		fprintf(f, "  \"summary\": {\n");
+		for (int c = 0; c < FrameStats::NumChannels; c++) {
+			FrameStats::Summary s = FrameStats::summarize(samples.data(), count, (FrameStats::Channel)c);
+			fprintf(f, "    \"%s\": { \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f }%s\n",
+				FrameStats::channelNames[c], s.mean, s.p50, s.p95, s.p99, s.max, c + 1 < FrameStats::NumChannels ? "," : "");
+		}
+		fprintf(f, "  },\n");
+		fprintf(f, "  \"samples_ms\": {\n");
+		for (int c = 0; c < FrameStats::NumChannels; c++) {
+			fprintf(f, "    \"%s\": [", FrameStats::channelNames[c]);
+			for (int i = 0; i < count; i++) {
+				fprintf(f, "%s%.4f", i > 0 ? ", " : "", FrameStats::value(samples[i], (FrameStats::Channel)c));
+			}
+			fprintf(f, "]%s\n", c + 1 < FrameStats::NumChannels ? "," : "");
+		}
+		fprintf(f, "  }\n}\n");
+		bool ok = ferror(f) == 0;
+		fclose(f);
+
+		FrameStats::Summary frame = FrameStats::summarize(samples.data(), count, FrameStats::Frame);
+		printf("Benchmark: %d frames, mean %.3f ms, p50 %.3f, p95 %.3f, p99 %.3f, max %.3f -> %s\n",
+			count, frame.mean, frame.p50, frame.p95, frame.p99, frame.max, options.outPath);
+		return ok;
+	}
+}
@@ -0,0 +1,112 @@
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "camera.h"
+
+Camera::Camera()
+	: mode(Orbit), pan(0.f), eye(0.f), target(0.f, 0.f, -1.f), up(0.f, 1.f, 0.f),
+	fov(glm::radians(75.f)), aspect(4.f / 3.f), zNear(1.f), zFar(50.f),
+	viewVersion(1), projVersion(1), builtView(0), builtProj(0), builtCombined(0) {
+	rot[0] = rot[1] = 0.f;
+}
+
+void Camera::setOrbit(const glm::vec3& p, float rotX, float rotY) {
+	if (mode == Orbit && pan == p && rot[0] == rotX && rot[1] == rotY) return;
+	mode = Orbit;
+	pan = p;
+	rot[0] = rotX;
+	rot[1] = rotY;
+	viewVersion++;
+}
+
+void Camera::setLookAt(const glm::vec3& e, const glm::vec3& t, const glm::vec3& u) {
+	if (mode == LookAt && eye == e && target == t && up == u) return;
+	mode = LookAt;
+	eye = e;
+	target = t;
+	up = u;
+	viewVersion++;
+}
+
+void Camera::setPerspective(float fovY, float n, float f) {
+	if (fov == fovY && zNear == n && zFar == f) return;
+	fov = fovY;
+	zNear = n;
+	zFar = f;
+	projVersion++;
+}
+
+void Camera::setAspect(float a) {
+	if (!(a > 0.f) || aspect == a) return;
+	aspect = a;
+	projVersion++;
+}
+
+const glm::mat4& Camera::view() const {
+	if (builtView != viewVersion) {
+		if (mode == Orbit) {
+			viewMat = glm::translate(glm::mat4(1.f), pan);
+			viewMat = glm::rotate(viewMat, rot[0], glm::vec3(1.f, 0.f, 0.f));
+			viewMat = glm::rotate(viewMat, rot[1], glm::vec3(0.f, 1.f, 0.f));
+		}
+		else {
+			viewMat = glm::lookAt(eye, target, up);
+		}
+		builtView = viewVersion;
+	}
+	return viewMat;
+}
+
+const glm::mat4& Camera::projection() const {
+	if (builtProj != projVersion) {
+		projMat = glm::perspective(fov, aspect, zNear, zFar);
+		builtProj = projVersion;
+	}
+	return projMat;
+}
+
+const glm::mat4& Camera::viewProjection() const {
+	unsigned v = version();
+	if (builtCombined != v) {
+		const glm::mat4& V = view();
+		viewProjMat = projection() * V;
+		// Both are rigid or lookAt views, the inverse is the transposed rotation
+		glm::mat3 R = glm::transpose(glm::mat3(V));
+		invViewMat = glm::mat4(R);
+		invViewMat[3] = glm::vec4(R * -glm::vec3(V[3]), 1.f);
+
+		// Gribb/Hartmann: rows of the combined matrix added to or subtracted from the w row
+		const glm::mat4& m = viewProjMat;
+		glm::vec4 row[4];
+		for (int i = 0; i < 4; i++) row[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+		planes[Left] = row[3] + row[0];
+		planes[Right] = row[3] - row[0];
+		planes[Bottom] = row[3] + row[1];
+		planes[Top] = row[3] - row[1];
+		planes[Near] = row[3] + row[2];
+		planes[Far] = row[3] - row[2];
+		for (int i = 0; i < NumPlanes; i++) planes[i] /= glm::length(glm::vec3(planes[i]));
+		builtCombined = v;
+	}
+	return viewProjMat;
+}
+
+const glm::mat4& Camera::inverseView() const {
+	viewProjection();
+	return invViewMat;
+}
+
+const glm::vec4* Camera::frustumPlanes() const {
+	viewProjection();
+	return planes;
+}
+
+glm::vec3 Camera::position() const {
+	return glm::vec3(inverseView()[3]);
+}
+
+glm::vec3 Camera::ray(float ndcX, float ndcY) const {
+	// Symmetric perspective: the point on the z = -1 plane of view space
+	const glm::mat4& P = projection();
+	glm::vec3 dirView(ndcX / P[0][0], ndcY / P[1][1], -1.f);
+	return glm::normalize(glm::mat3(inverseView()) * dirView);
+}
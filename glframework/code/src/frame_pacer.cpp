@@ -0,0 +1,141 @@
+#ifdef _WIN32
+#include <windows.h>
+#include <timeapi.h>
+#else
+#include <time.h>
+#endif
+#include <SDL2/SDL.h>
+#include <emmintrin.h>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+#include "frame_pacer.h"
+
+namespace {
+	const int historySize = 240;
+	// Sleeps end at least this long before the deadline: wake-ups within a
+	// millisecond or so of the request are common even with a 1 ms timer
+	const double minSpinMs = 1.0;
+	const double maxSpinMs = 4.0;
+	// Closer to the deadline than this the spin stops yielding, a thread
+	// switched out there would not be back in time
+	const double busySpinMs = 0.5;
+
+	double ticksToMs = 0.0;
+	Uint64 period = 0;
+	Uint64 nextDeadline = 0;
+	Uint64 lastFrameEnd = 0;
+	double spinMs = 1.0;
+
+	double history[historySize];
+	int historyCount = 0;
+	int historyPos = 0;
+
+	void osSleepMs(double ms) {
+#ifdef _WIN32
+		Sleep((DWORD)ms);
+#else
+		timespec ts;
+		ts.tv_sec = (time_t)(ms / 1000.0);
+		ts.tv_nsec = (long)((ms - ts.tv_sec * 1000.0) * 1e6);
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+#endif
+	}
+
+	void recordFrame(Uint64 now) {
+		if (lastFrameEnd != 0) {
+			history[historyPos] = (now - lastFrameEnd) * ticksToMs;
+			historyPos = (historyPos + 1) % historySize;
+			historyCount = std::min(historyCount + 1, historySize);
+		}
+		lastFrameEnd = now;
+	}
+}
+
+namespace FramePacer {
+	void init(double targetHz) {
+#ifdef _WIN32
+		// Default scheduler granularity is ~15.6 ms, far too coarse to sleep with
+		timeBeginPeriod(1);
+#endif
+		ticksToMs = 1000.0 / (double)SDL_GetPerformanceFrequency();
+		setTargetRate(targetHz);
+		nextDeadline = SDL_GetPerformanceCounter() + period;
+	}
+
+	void shutdown() {
+#ifdef _WIN32
+		timeEndPeriod(1);
+#endif
+	}
+
+	void setTargetRate(double targetHz) {
+		if (targetHz <= 0.0) return;
+		period = (Uint64)((double)SDL_GetPerformanceFrequency() / targetHz);
+		nextDeadline = SDL_GetPerformanceCounter() + period;
+		historyCount = historyPos = 0;
+	}
+
+	void resume() {
+		nextDeadline = SDL_GetPerformanceCounter() + period;
+		lastFrameEnd = 0;
+	}
+
+	double targetRate() {
+		return (double)SDL_GetPerformanceFrequency() / (double)period;
+	}
+
+	double waitForFrameEnd() {
+		Uint64 start = SDL_GetPerformanceCounter();
+		if (start >= nextDeadline) {
+			// Frame overran, restart the schedule from now instead of rushing to catch up
+			nextDeadline = start + period;
+			recordFrame(start);
+			return 0.0;
+		}
+
+		double remainingMs = (nextDeadline - start) * ticksToMs;
+		if (remainingMs > spinMs) {
+			Uint64 before = SDL_GetPerformanceCounter();
+			double sleepMs = remainingMs - spinMs;
+			osSleepMs(sleepMs);
+			double overshootMs = (SDL_GetPerformanceCounter() - before) * ticksToMs - sleepMs;
+			// Grow the margin quickly on late wake-ups, shrink it slowly otherwise
+			double target = std::max(minSpinMs, std::min(maxSpinMs, overshootMs * 1.5 + minSpinMs));
+			spinMs = target > spinMs ? target : spinMs * 0.95 + target * 0.05;
+		}
+		Uint64 busyFrom = nextDeadline - (Uint64)(busySpinMs / ticksToMs);
+		Uint64 now = SDL_GetPerformanceCounter();
+		while (now < nextDeadline) {
+			if (now < busyFrom) std::this_thread::yield();
+			else _mm_pause();
+			now = SDL_GetPerformanceCounter();
+		}
+
+		// Next deadline is relative to this one, not to when we woke up, so the
+		// average rate stays exact
+		nextDeadline += period;
+		recordFrame(now);
+		return (now - start) * ticksToMs;
+	}
+
+	double frameTimeMeanMs() {
+		if (historyCount == 0) return 0.0;
+		double sum = 0.0;
+		for (int i = 0; i < historyCount; i++) sum += history[i];
+		return sum / historyCount;
+	}
+
+	double frameTimeJitterMs() {
+		if (historyCount < 2) return 0.0;
+		double mean = frameTimeMeanMs();
+		double var = 0.0;
+		for (int i = 0; i < historyCount; i++) var += (history[i] - mean) * (history[i] - mean);
+		return std::sqrt(var / (historyCount - 1));
+	}
+
+	double spinMarginMs() {
+		return spinMs;
+	}
+}
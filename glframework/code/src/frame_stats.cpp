@@ -0,0 +1,102 @@
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "frame_stats.h"
+
+namespace {
+	struct Slot {
+		std::atomic<unsigned> seq;	// odd while the slot is being written
+		FrameStats::Sample sample;
+	};
+
+	Slot slots[FrameStats::capacity];
+	std::atomic<unsigned> written(0);
+	std::atomic<float> lastRenderMs(0.f);
+	std::atomic<float> lastGpuMs(0.f);
+}
+
+namespace FrameStats {
+	const char* channelNames[NumChannels] = { "Frame", "CPU", "Render", "GPU", "Sleep" };
+
+	void reportRender(float renderMs, float gpuMs) {
+		lastRenderMs.store(renderMs, std::memory_order_relaxed);
+		lastGpuMs.store(gpuMs, std::memory_order_relaxed);
+	}
+
+	void record(float frameMs, float cpuMs, float sleepMs) {
+		unsigned n = written.load(std::memory_order_relaxed);
+		Slot& slot = slots[n % capacity];
+		unsigned seq = slot.seq.load(std::memory_order_relaxed);
+		slot.seq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		slot.sample.frameMs = frameMs;
+		slot.sample.cpuMs = cpuMs;
+		slot.sample.renderMs = lastRenderMs.load(std::memory_order_relaxed);
+		slot.sample.gpuMs = lastGpuMs.load(std::memory_order_relaxed);
+		slot.sample.sleepMs = sleepMs;
+		slot.seq.store(seq + 2, std::memory_order_release);
+		written.store(n + 1, std::memory_order_release);
+	}
+
+	void reset() {
+		written.store(0, std::memory_order_release);
+	}
+
+	int copyRecent(Sample* out, int maxSamples) {
+		unsigned end = written.load(std::memory_order_acquire);
+		unsigned count = std::min(end, (unsigned)std::min(maxSamples, capacity));
+		int copied = 0;
+		for (unsigned i = end - count; i != end; i++) {
+			const Slot& slot = slots[i % capacity];
+			unsigned before = slot.seq.load(std::memory_order_acquire);
+			Sample s = slot.sample;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			unsigned after = slot.seq.load(std::memory_order_relaxed);
+			// Skip slots the writer touched meanwhile, they hold a newer frame now
+			if ((before & 1) == 0 && before == after) out[copied++] = s;
+		}
+		return copied;
+	}
+
+	float value(const Sample& s, Channel channel) {
+		switch (channel) {
+		case Frame: return s.frameMs;
+		case Cpu: return s.cpuMs;
+		case Render: return s.renderMs;
+		case Gpu: return s.gpuMs;
+		case Sleep: return s.sleepMs;
+		default: return 0.f;
+		}
+	}
+
+	Summary summarize(const Sample* samples, int count, Channel channel) {
+		Summary r = { 0.f, 0.f, 0.f, 0.f, 0.f };
+		if (count <= 0) return r;
+		std::vector<float> v(count);
+		double sum = 0.0;
+		for (int i = 0; i < count; i++) {
+			v[i] = value(samples[i], channel);
+			sum += v[i];
+		}
+		std::sort(v.begin(), v.end());
+		// Nearest rank percentiles
+		auto rank = [&](float p) { return v[std::max(0, std::min(count - 1, (int)std::ceil(p * count) - 1))]; };
+		r.mean = (float)(sum / count);
+		r.p50 = rank(0.50f);
+		r.p95 = rank(0.95f);
+		r.p99 = rank(0.99f);
+		r.max = v[count - 1];
+		return r;
+	}
+
+	void histogram(const Sample* samples, int count, Channel channel, float maxMs, float* bins, int numBins) {
+		std::fill(bins, bins + numBins, 0.f);
+		if (numBins <= 0 || maxMs <= 0.f) return;
+		for (int i = 0; i < count; i++) {
+			int b = (int)(value(samples[i], channel) / maxMs * numBins);
+			bins[std::max(0, std::min(numBins - 1, b))] += 1.f;
+		}
+	}
+}
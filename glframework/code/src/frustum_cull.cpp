@@ -0,0 +1,213 @@
+#include <glm/gtc/matrix_transform.hpp>
+#include <immintrin.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "frustum_cull.h"
+#include "batch_math.h"
+#include "camera.h"
+#include "job_system.h"
+#include "bench_util.h"
+
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2,fma,popcnt")))
+#else
+#define TARGET_AVX2
+#endif
+
+namespace {
+	const int numPlanes = 6;
+	// Smaller sets aren't worth waking the workers for
+	const int parallelGrain = 16384;
+	// Set bits in a 4 bit movemask, SSE2 has no popcount
+	const int bitCount4[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+	// The 8 visibility bytes for every AVX2 outside mask
+	struct VisibleBytes {
+		uint64_t bytes[256];
+		VisibleBytes() {
+			for (int mask = 0; mask < 256; mask++) {
+				bytes[mask] = 0;
+				for (int k = 0; k < 8; k++) bytes[mask] |= (uint64_t)(((mask >> k) & 1) ^ 1) << (8 * k);
+			}
+		}
+		const uint64_t& operator[](int mask) const { return bytes[mask]; }
+	};
+	const VisibleBytes visibleBytes;
+
+	int cullScalar(const glm::vec4* planes, const Culling::BoundsSet& s, int begin, int end, unsigned char* visible) {
+		int count = 0;
+		for (int i = begin; i < end; i++) {
+			bool in = true;
+			for (int p = 0; p < numPlanes && in; p++) {
+				const glm::vec4& pl = planes[p];
+				float d = pl.x * s.cx[i] + pl.y * s.cy[i] + pl.z * s.cz[i] + pl.w;
+				float r = fabsf(pl.x) * s.ex[i] + fabsf(pl.y) * s.ey[i] + fabsf(pl.z) * s.ez[i];
+				in = d + std::min(r, s.radius[i]) >= 0.f;
+			}
+			visible[i] = in ? 1 : 0;
+			count += in ? 1 : 0;
+		}
+		return count;
+	}
+
+	int cullSSE(const glm::vec4* planes, const Culling::BoundsSet& s, int begin, int end, unsigned char* visible) {
+		const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+		__m128 pn[numPlanes][4], pa[numPlanes][3];
+		for (int p = 0; p < numPlanes; p++) {
+			for (int k = 0; k < 4; k++) pn[p][k] = _mm_set1_ps(planes[p][k]);
+			for (int k = 0; k < 3; k++) pa[p][k] = _mm_and_ps(pn[p][k], absMask);
+		}
+		int count = 0;
+		int i = begin;
+		for (; i + 4 <= end; i += 4) {
+			__m128 cx = _mm_loadu_ps(&s.cx[i]), cy = _mm_loadu_ps(&s.cy[i]), cz = _mm_loadu_ps(&s.cz[i]);
+			__m128 ex = _mm_loadu_ps(&s.ex[i]), ey = _mm_loadu_ps(&s.ey[i]), ez = _mm_loadu_ps(&s.ez[i]);
+			__m128 rad = _mm_loadu_ps(&s.radius[i]);
+			__m128 outside = _mm_setzero_ps();
+			for (int p = 0; p < numPlanes; p++) {
+				__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(pn[p][0], cx), _mm_mul_ps(pn[p][1], cy)), _mm_add_ps(_mm_mul_ps(pn[p][2], cz), pn[p][3]));
+				__m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(pa[p][0], ex), _mm_mul_ps(pa[p][1], ey)), _mm_mul_ps(pa[p][2], ez));
+				r = _mm_min_ps(r, rad);
+				outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(d, r), _mm_setzero_ps()));
+			}
+			int mask = _mm_movemask_ps(outside);
+			for (int k = 0; k < 4; k++) visible[i + k] = (unsigned char)(((mask >> k) & 1) ^ 1);
+			count += 4 - bitCount4[mask];
+		}
+		return count + cullScalar(planes, s, i, end, visible);
+	}
+
+	TARGET_AVX2 int cullAVX2(const glm::vec4* planes, const Culling::BoundsSet& s, int begin, int end, unsigned char* visible) {
+		const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+		__m256 pn[numPlanes][4], pa[numPlanes][3];
+		for (int p = 0; p < numPlanes; p++) {
+			for (int k = 0; k < 4; k++) pn[p][k] = _mm256_set1_ps(planes[p][k]);
+			for (int k = 0; k < 3; k++) pa[p][k] = _mm256_and_ps(pn[p][k], absMask);
+		}
+		int count = 0;
+		int i = begin;
+		for (; i + 8 <= end; i += 8) {
+			__m256 cx = _mm256_loadu_ps(&s.cx[i]), cy = _mm256_loadu_ps(&s.cy[i]), cz = _mm256_loadu_ps(&s.cz[i]);
+			__m256 ex = _mm256_loadu_ps(&s.ex[i]), ey = _mm256_loadu_ps(&s.ey[i]), ez = _mm256_loadu_ps(&s.ez[i]);
+			__m256 rad = _mm256_loadu_ps(&s.radius[i]);
+			__m256 outside = _mm256_setzero_ps();
+			for (int p = 0; p < numPlanes; p++) {
+				__m256 d = _mm256_fmadd_ps(pn[p][0], cx, _mm256_fmadd_ps(pn[p][1], cy, _mm256_fmadd_ps(pn[p][2], cz, pn[p][3])));
+				__m256 r = _mm256_fmadd_ps(pa[p][0], ex, _mm256_fmadd_ps(pa[p][1], ey, _mm256_mul_ps(pa[p][2], ez)));
+				r = _mm256_min_ps(r, rad);
+				outside = _mm256_or_ps(outside, _mm256_cmp_ps(_mm256_add_ps(d, r), _mm256_setzero_ps(), _CMP_LT_OQ));
+			}
+			int mask = _mm256_movemask_ps(outside);
+			memcpy(&visible[i], &visibleBytes[mask], 8);
+			count += 8 - _mm_popcnt_u32(mask);
+		}
+		return count + cullSSE(planes, s, i, end, visible);
+	}
+
+	int cullRange(const glm::vec4* planes, const Culling::BoundsSet& s, int begin, int end, unsigned char* visible) {
+		switch (BatchMath::level()) {
+		case BatchMath::AVX2: return cullAVX2(planes, s, begin, end, visible);
+		case BatchMath::SSE: return cullSSE(planes, s, begin, end, visible);
+		default: return cullScalar(planes, s, begin, end, visible);
+		}
+	}
+}
+
+namespace Culling {
+	Bounds computeBounds(const glm::vec3* points, int count) {
+		Bounds b = { glm::vec3(0.f), glm::vec3(0.f), 0.f };
+		if (count <= 0) return b;
+		glm::vec3 bmin = points[0], bmax = points[0];
+		for (int i = 1; i < count; i++) {
+			bmin = glm::min(bmin, points[i]);
+			bmax = glm::max(bmax, points[i]);
+		}
+		b.center = (bmin + bmax) * 0.5f;
+		b.extents = (bmax - bmin) * 0.5f;
+		float r2 = 0.f;
+		for (int i = 0; i < count; i++) {
+			glm::vec3 d = points[i] - b.center;
+			r2 = std::max(r2, glm::dot(d, d));
+		}
+		b.radius = sqrtf(r2);
+		return b;
+	}
+
+	Bounds transformBounds(const Bounds& b, const glm::mat4& m) {
+		Bounds t;
+		t.center = glm::vec3(m * glm::vec4(b.center, 1.f));
+		glm::mat3 a = glm::mat3(m);
+		// Extents of the rotated box along each axis (Arvo)
+		t.extents = glm::abs(a[0]) * b.extents.x + glm::abs(a[1]) * b.extents.y + glm::abs(a[2]) * b.extents.z;
+		float scale = std::max(glm::length(a[0]), std::max(glm::length(a[1]), glm::length(a[2])));
+		t.radius = b.radius * scale;
+		return t;
+	}
+
+	void BoundsSet::resize(int count) {
+		cx.resize(count);
+		cy.resize(count);
+		cz.resize(count);
+		ex.resize(count);
+		ey.resize(count);
+		ez.resize(count);
+		radius.resize(count);
+	}
+
+	void BoundsSet::set(int i, const Bounds& b) {
+		cx[i] = b.center.x;
+		cy[i] = b.center.y;
+		cz[i] = b.center.z;
+		ex[i] = b.extents.x;
+		ey[i] = b.extents.y;
+		ez[i] = b.extents.z;
+		radius[i] = b.radius;
+	}
+
+	int cull(const glm::vec4* planes, const BoundsSet& set, unsigned char* visible) {
+		int n = set.size();
+		if (n < 2 * parallelGrain) return cullRange(planes, set, 0, n, visible);
+		std::atomic<int> count(0);
+		// Chunk bounds stay multiples of 8 so no vector straddles two chunks
+		int numBlocks = (n + 7) / 8;
+		Jobs::parallelFor(0, numBlocks, parallelGrain / 8, [&](int begin, int end) {
+			count += cullRange(planes, set, begin * 8, std::min(end * 8, n), visible);
+		});
+		return count.load();
+	}
+
+	BoundsSet randomBounds(int count, uint32_t seed) {
+		BoundsSet set;
+		set.resize(count);
+		BenchUtil::Random rnd(seed);
+		for (int i = 0; i < count; i++) {
+			Bounds b;
+			b.center = glm::vec3(rnd.unit(), rnd.unit(), rnd.unit()) * 120.f - 60.f;
+			b.extents = glm::vec3(rnd.unit(), rnd.unit(), rnd.unit()) * 2.f + 0.1f;
+			b.radius = glm::length(b.extents);
+			set.set(i, b);
+		}
+		return set;
+	}
+
+	void setBenchmarkView(Camera& camera) {
+		camera.setOrbit(glm::vec3(0.f, -5.f, -15.f), 0.3f, 0.5f);
+		camera.setPerspective(glm::radians(75.f), 1.f, 50.f);
+	}
+
+	double benchmark(int count) {
+		Camera camera;
+		setBenchmarkView(camera);
+		BoundsSet set = randomBounds(count, 2463534242u);
+		std::vector<unsigned char> visible(count);
+		const int runs = 20;
+		cull(camera.frustumPlanes(), set, visible.data());
+		auto start = BenchUtil::Clock::now();
+		for (int r = 0; r < runs; r++) cull(camera.frustumPlanes(), set, visible.data());
+		return BenchUtil::msSince(start) / runs;
+	}
+}
@@ -0,0 +1,184 @@
+#include <GL/glew.h>
+#ifdef _WIN32
+#include <SDL2/SDL.h>
+#else
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "crt_compat.h"
+#include "headless.h"
+
+namespace {
+	GLuint fbo = 0;
+	GLuint colorRb = 0;
+	GLuint depthRb = 0;
+	int fbWidth = 0, fbHeight = 0;
+
+#ifdef _WIN32
+	// No EGL on Windows drivers, a never shown window provides the context instead
+	SDL_Window* window = NULL;
+	SDL_GLContext context = NULL;
+
+	bool platformCreate() {
+		if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+			printf("Couldn't initialize SDL: %s\n", SDL_GetError());
+			return false;
+		}
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+		window = SDL_CreateWindow("GL_framework", 0, 0, 16, 16, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+		if (window == NULL) {
+			printf("Couldn't create hidden window: %s\n", SDL_GetError());
+			return false;
+		}
+		context = SDL_GL_CreateContext(window);
+		return context != NULL;
+	}
+
+	void platformDestroy() {
+		if (context != NULL) SDL_GL_DeleteContext(context);
+		if (window != NULL) SDL_DestroyWindow(window);
+		context = NULL;
+		window = NULL;
+		SDL_Quit();
+	}
+#else
+	EGLDisplay display = EGL_NO_DISPLAY;
+	EGLContext context = EGL_NO_CONTEXT;
+
+	bool hasExtension(const char* list, const char* name) {
+		size_t len = strlen(name);
+		for (const char* p = list; p != NULL && (p = strstr(p, name)) != NULL; p += len) {
+			if ((p == list || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0')) return true;
+		}
+		return false;
+	}
+
+	bool platformCreate() {
+		// Surfaceless platform first: needs neither X11 nor a GPU device node
+		const char* clientExts = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+		PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+			(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if (getPlatformDisplay != NULL && hasExtension(clientExts, "EGL_MESA_platform_surfaceless")) {
+			display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+		}
+		if (display == EGL_NO_DISPLAY) display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+		if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) {
+			printf("Couldn't initialize EGL (0x%x)\n", eglGetError());
+			return false;
+		}
+		const char* exts = eglQueryString(display, EGL_EXTENSIONS);
+		if (!hasExtension(exts, "EGL_KHR_surfaceless_context")) {
+			printf("EGL_KHR_surfaceless_context is not supported\n");
+			return false;
+		}
+		if (!eglBindAPI(EGL_OPENGL_API)) {
+			printf("EGL can't create desktop GL contexts\n");
+			return false;
+		}
+
+		EGLConfig config = (EGLConfig)0;	// EGL_NO_CONFIG_KHR
+		if (!hasExtension(exts, "EGL_KHR_no_config_context")) {
+			const EGLint configAttribs[] = {
+				EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+				EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+				EGL_NONE
+			};
+			EGLint numConfigs = 0;
+			if (!eglChooseConfig(display, configAttribs, &config, 1, &numConfigs) || numConfigs == 0) {
+				printf("No EGL config for desktop GL\n");
+				return false;
+			}
+		}
+		const EGLint contextAttribs[] = {
+			EGL_CONTEXT_MAJOR_VERSION, 3,
+			EGL_CONTEXT_MINOR_VERSION, 3,
+			EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+			EGL_NONE
+		};
+		context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+		if (context == EGL_NO_CONTEXT) {
+			printf("Couldn't create a GL 3.3 core context (0x%x)\n", eglGetError());
+			return false;
+		}
+		return eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context) == EGL_TRUE;
+	}
+
+	void platformDestroy() {
+		if (display == EGL_NO_DISPLAY) return;
+		eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		if (context != EGL_NO_CONTEXT) eglDestroyContext(display, context);
+		eglTerminate(display);
+		context = EGL_NO_CONTEXT;
+		display = EGL_NO_DISPLAY;
+	}
+#endif
+}
+
+namespace Headless {
+	bool createContext() {
+		if (platformCreate()) return true;
+		platformDestroy();
+		return false;
+	}
+
+	bool createFramebuffer(int width, int height) {
+		fbWidth = width;
+		fbHeight = height;
+		glGenRenderbuffers(1, &colorRb);
+		glBindRenderbuffer(GL_RENDERBUFFER, colorRb);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+		glGenRenderbuffers(1, &depthRb);
+		glBindRenderbuffer(GL_RENDERBUFFER, depthRb);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorRb);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthRb);
+		bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+		if (!complete) printf("Headless framebuffer is incomplete\n");
+		return complete;
+	}
+
+	void destroy() {
+		if (fbo != 0) {
+			glDeleteFramebuffers(1, &fbo);
+			glDeleteRenderbuffers(1, &colorRb);
+			glDeleteRenderbuffers(1, &depthRb);
+			fbo = colorRb = depthRb = 0;
+		}
+		platformDestroy();
+	}
+
+	GLuint framebuffer() {
+		return fbo;
+	}
+
+	bool writePPM(const char* path) {
+		std::vector<unsigned char> pixels(fbWidth * fbHeight * 3);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadPixels(0, 0, fbWidth, fbHeight, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+
+		FILE* f;
+		fopen_s(&f, path, "wb");
+		if (f == NULL) {
+			printf("Couldn't write %s\n", path);
+			return false;
+		}
+		fprintf(f, "P6\n%d %d\n255\n", fbWidth, fbHeight);
+		// GL rows go bottom up, PPM rows top down
+		for (int y = fbHeight - 1; y >= 0; y--) {
+			fwrite(&pixels[y * fbWidth * 3], 1, fbWidth * 3, f);
+		}
+		fclose(f);
+		return true;
+	}
+}
@@ -0,0 +1,264 @@
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+
+#include "job_system.h"
+
+namespace {
+	const int queueCapacity = 4096;
+
+	// Bounded deque guarded by a spinlock. Critical sections are a handful of
+	// instructions, cheaper than a mutex at the rates jobs are pushed.
+	struct WorkQueue {
+		std::atomic_flag busy = ATOMIC_FLAG_INIT;
+		Jobs::Job jobs[queueCapacity];
+		int head = 0;	// steal end
+		int tail = 0;	// owner end
+		char pad[64];
+
+		void lock() { while (busy.test_and_set(std::memory_order_acquire)) std::this_thread::yield(); }
+		void unlock() { busy.clear(std::memory_order_release); }
+
+		bool push(const Jobs::Job& job) {
+			lock();
+			bool ok = tail - head < queueCapacity;
+			if (ok) jobs[tail++ % queueCapacity] = job;
+			unlock();
+			return ok;
+		}
+		bool pop(Jobs::Job& job) {
+			lock();
+			bool ok = tail > head;
+			if (ok) {
+				job = jobs[--tail % queueCapacity];
+				if (tail == head) tail = head = 0;
+			}
+			unlock();
+			return ok;
+		}
+		bool steal(Jobs::Job& job) {
+			lock();
+			bool ok = tail > head;
+			if (ok) {
+				job = jobs[head++ % queueCapacity];
+				if (tail == head) tail = head = 0;
+			}
+			unlock();
+			return ok;
+		}
+		// Oldest job of counter, wherever it sits in the queue
+		bool take(Jobs::Job& job, const Jobs::Counter* counter) {
+			lock();
+			bool ok = false;
+			for (int i = head; i < tail && !ok; i++) {
+				if (jobs[i % queueCapacity].counter != counter) continue;
+				job = jobs[i % queueCapacity];
+				// Close the gap from the head side, matches are mostly near it
+				for (int k = i; k > head; k--) jobs[k % queueCapacity] = jobs[(k - 1) % queueCapacity];
+				head++;
+				if (tail == head) tail = head = 0;
+				ok = true;
+			}
+			unlock();
+			return ok;
+		}
+	};
+
+	std::vector<std::thread> workers;
+	WorkQueue* queues = NULL;	// one per worker plus one shared by outside threads
+	unsigned numQueues = 0;
+	std::atomic<bool> running(false);
+	std::atomic<int> queuedJobs(0);
+	std::atomic<int> sleepers(0);
+	std::atomic<unsigned> nextQueue(0);
+	std::mutex sleepMutex;
+	std::condition_variable sleepCond;
+
+	std::mutex glMutex;
+	std::vector<Jobs::Job> glJobs;
+
+	thread_local int workerIndex = -1;
+
+	void finish(const Jobs::Job& job);
+
+	void submit(const Jobs::Job& job) {
+		if (numQueues == 0) {
+			// Scheduler not running, degrade to a direct call
+			job.fn(job.data);
+			finish(job);
+			return;
+		}
+		unsigned q = workerIndex >= 0 ? (unsigned)workerIndex : numQueues - 1;
+		if (!queues[q].push(job)) {
+			// Full queue, run it here rather than block
+			job.fn(job.data);
+			finish(job);
+			return;
+		}
+		queuedJobs++;
+		if (sleepers.load() > 0) {
+			std::lock_guard<std::mutex> lk(sleepMutex);
+			sleepCond.notify_one();
+		}
+	}
+
+	void finish(const Jobs::Job& job) {
+		Jobs::Counter* c = job.counter;
+		if (c == NULL) return;
+		std::vector<Jobs::Job> ready;
+		{
+			// Hold the lock across the decrement so runAfter never sees a stale value
+			std::lock_guard<std::mutex> lk(c->lock);
+			if (c->value.fetch_sub(1) != 1) return;
+			ready.swap(c->continuations);
+		}
+		for (const Jobs::Job& j : ready) submit(j);
+	}
+
+	bool runOne(unsigned self) {
+		Jobs::Job job;
+		bool found = self < numQueues && queues[self].pop(job);
+		if (!found) {
+			unsigned start = nextQueue++;
+			for (unsigned i = 0; i < numQueues && !found; i++) {
+				unsigned q = (start + i) % numQueues;
+				if (q != self) found = queues[q].steal(job);
+			}
+		}
+		if (!found) return false;
+		queuedJobs--;
+		job.fn(job.data);
+		finish(job);
+		return true;
+	}
+
+	// Outside threads only help with the jobs they wait for, e.g. their own
+	// parallelFor chunks. Anything else, like a long asset bake, is left to
+	// the workers so it can't stall the waiting thread's frame.
+	bool runOwn(const Jobs::Counter* counter) {
+		Jobs::Job job;
+		if (numQueues == 0 || !queues[numQueues - 1].take(job, counter)) return false;
+		queuedJobs--;
+		job.fn(job.data);
+		finish(job);
+		return true;
+	}
+
+	void workerLoop(int index) {
+		workerIndex = index;
+		while (running.load()) {
+			if (runOne(index)) continue;
+			// Spin briefly before going to sleep, jobs tend to come in bursts
+			bool gotWork = false;
+			for (int i = 0; i < 64 && !gotWork; i++) {
+				std::this_thread::yield();
+				gotWork = queuedJobs.load() > 0;
+			}
+			if (gotWork) continue;
+			std::unique_lock<std::mutex> lk(sleepMutex);
+			sleepers++;
+			sleepCond.wait(lk, [] { return queuedJobs.load() > 0 || !running.load(); });
+			sleepers--;
+		}
+		workerIndex = -1;
+	}
+}
+
+namespace Jobs {
+	void init(unsigned count) {
+		if (running.load()) return;
+		if (count == 0) {
+			unsigned hw = std::thread::hardware_concurrency();
+			count = hw > 1 ? hw - 1 : 1;
+		}
+		numQueues = count + 1;
+		queues = new WorkQueue[numQueues];
+		running = true;
+		for (unsigned i = 0; i < count; i++) {
+			workers.emplace_back(workerLoop, (int)i);
+		}
+	}
+
+	void shutdown() {
+		if (!running.load()) return;
+		{
+			std::lock_guard<std::mutex> lk(sleepMutex);
+			running = false;
+			sleepCond.notify_all();
+		}
+		for (std::thread& t : workers) t.join();
+		workers.clear();
+		delete[] queues;
+		queues = NULL;
+		numQueues = 0;
+	}
+
+	unsigned numWorkers() {
+		return numQueues > 0 ? numQueues - 1 : 0;
+	}
+
+	void run(void(*fn)(void*), void* data, Counter* counter) {
+		if (counter) counter->value++;
+		Job job = { fn, data, counter };
+		submit(job);
+	}
+
+	void runAfter(Counter& dependency, void(*fn)(void*), void* data, Counter* counter) {
+		if (counter) counter->value++;
+		Job job = { fn, data, counter };
+		{
+			std::lock_guard<std::mutex> lk(dependency.lock);
+			if (dependency.value.load() > 0) {
+				dependency.continuations.push_back(job);
+				return;
+			}
+		}
+		submit(job);
+	}
+
+	void wait(Counter& counter) {
+		while (counter.value.load() > 0) {
+			bool ran = workerIndex >= 0 ? runOne((unsigned)workerIndex) : runOwn(&counter);
+			if (!ran) std::this_thread::yield();
+		}
+		// The last finish() may still hold the lock it decremented under; the
+		// caller is free to destroy the counter only once it let go
+		std::lock_guard<std::mutex> lk(counter.lock);
+	}
+
+	void runOnGLThread(void(*fn)(void*), void* data, Counter* counter) {
+		if (counter) counter->value++;
+		Job job = { fn, data, counter };
+		std::lock_guard<std::mutex> lk(glMutex);
+		glJobs.push_back(job);
+	}
+
+	void runGLJobs() {
+		std::vector<Job> pending;
+		{
+			std::lock_guard<std::mutex> lk(glMutex);
+			pending.swap(glJobs);
+		}
+		for (const Job& job : pending) {
+			job.fn(job.data);
+			finish(job);
+		}
+	}
+
+	double benchmarkOverheadNs(int numTasks) {
+		struct Nop {
+			static void exec(void*) {}
+		};
+		// Batches stay below the queue capacity so no job falls back to running inline
+		const int batch = queueCapacity / 4;
+		Counter counter;
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < numTasks; i++) {
+			run(&Nop::exec, NULL, &counter);
+			if (i % batch == batch - 1) wait(counter);
+		}
+		wait(counter);
+		auto end = std::chrono::steady_clock::now();
+		return std::chrono::duration<double, std::nano>(end - start).count() / numTasks;
+	}
+}
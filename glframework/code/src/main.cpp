@@ -1,44 +1,198 @@
-#include <windows.h>
-#include <GL\glew.h>
-#include <SDL2\SDL.h>
-#include <imgui\imgui.h>
-#include <imgui\imgui_impl_sdl_gl3.h>
+#include <GL/glew.h>
+#include <SDL2/SDL.h>
+#include <imgui/imgui.h>
+#include <imgui/imgui_impl_sdl_gl3.h>
 #include <cstdio>
+#include <cstring>
+#include <thread>
 
 #include "GL_framework.h"
+#include "crt_compat.h"
+#include "frame_pacer.h"
+#include "job_system.h"
+#include "frame_stats.h"
+#include "benchmark.h"
+#include "headless.h"
+#include "startup_trace.h"
 
 
 extern void GUI();
 extern void GLmousecb(MouseEvent ev);
+extern void GLpublishMouse(int x, int y, Uint32 buttons);
 extern void GLResize(int width, int height);
 extern void GLinit(int width, int height);
 extern void GLcleanup();
-extern void GLrender(float dt);
+extern void GLupdate(float dt);
+extern void GLrender(float alpha);
+extern void GLpublishFrame(float alpha);
+extern bool GLrenderLatest();
+extern void GLstopRendering();
+extern bool GLisAnimating();
+extern void GLsetCameraPose(const float panv[3], const float rota[2], int dollyEffect);
+extern void GLsetOutputFramebuffer(GLuint fbo);
+extern void GLwaitForAssets();
 
 //////
 namespace {
 	const int expected_fps = 30;
-	const double expected_frametime = 1.0 / expected_fps;
-	const uint32_t expected_frametime_ms = (uint32_t) (1e3 * expected_frametime);
-	uint32_t prev_frametimestamp = 0;
-	uint32_t curr_frametimestamp = 0;
+	const double sim_timestep = 1.0 / 60.0;
+	// Longest stretch simulated in one go, so a stall doesn't trigger a burst of steps
+	const double max_frame_time = 0.25;
+	// Frames drawn after the last input so ImGui hover and the pipelined
+	// render thread settle before the loop goes idle
+	const int redraw_frames_after_input = 3;
+	const int idle_timeout_ms = 500;
+	const int default_width = 800;
+	const int default_height = 600;
+}
+
+// Called once the first frame went out: prints the startup timeline and
+// saves it when a trace file was asked for
+void reportStartup(const char* tracePath) {
+	StartupTrace::finish();
+	StartupTrace::print();
+	if (tracePath != NULL) StartupTrace::writeChromeTrace(tracePath);
+}
+
+// Runs without a window, drawing into an offscreen framebuffer: the benchmark
+// when one was asked for, a single frame otherwise. The last frame can be
+// saved as a PPM to check the output.
+int runHeadless(const Benchmark::Options& bench, int width, int height, const char* screenshot, const char* tracePath) {
+	int trace = StartupTrace::begin("Headless context");
+	bool created = Headless::createContext();
+	StartupTrace::end(trace);
+	if (!created) return -1;
+	// Init GLEW. Builds of it targeting GLX report the missing X display here,
+	// after the GL entry points were already loaded
+	trace = StartupTrace::begin("glewInit");
+	glewExperimental = GL_TRUE;
+	GLenum err = glewInit();
+	StartupTrace::end(trace);
+	if (GLEW_OK != err) {
+		SDL_Log("Glew error: %s\n", glewGetErrorString(err));
+	}
+	SDL_Log("Status: Headless on %s\n", glGetString(GL_RENDERER));
+	if (!Headless::createFramebuffer(width, height)) {
+		Headless::destroy();
+		return -1;
+	}
+	GLsetOutputFramebuffer(Headless::framebuffer());
+
+	{
+		StartupTrace::Scope scope("Job system");
+		Jobs::init();
+	}
+	GLinit(width, height);
+	{
+		StartupTrace::Scope scope("ImGui init");
+		// The binding only needs a window for its per frame input, which is done by hand below
+		ImGui_ImplSdlGL3_Init(NULL);
+	}
+	{
+		StartupTrace::Scope scope("Font atlas");
+		ImGui_ImplSdlGL3_CreateDeviceObjects();
+	}
+	ImGuiIO& io = ImGui::GetIO();
+	io.DisplaySize = ImVec2((float)width, (float)height);
+	io.DisplayFramebufferScale = ImVec2(1.f, 1.f);
+	io.DeltaTime = (float)sim_timestep;
+	io.MousePos = ImVec2(-FLT_MAX, -FLT_MAX);
 
-	void waitforFrameEnd() {
-		curr_frametimestamp = SDL_GetTicks();
-		DWORD wait = 0;
-		if ((curr_frametimestamp - prev_frametimestamp) < expected_frametime_ms) {
-			wait = expected_frametime_ms - (curr_frametimestamp - prev_frametimestamp);
+	int frames = bench.enabled ? bench.warmupFrames + bench.frames : 1;
+	// Nobody watches the frames come in: draw the finished scene only, so
+	// benchmarks time full frames and screenshots include the baked AO
+	GLwaitForAssets();
+	if (bench.enabled) Benchmark::begin(bench);
+	for (int frame = 0; frame < frames; frame++) {
+		Uint64 frame_start = SDL_GetPerformanceCounter();
+		ImGui::NewFrame();
+		GUI();
+		if (bench.enabled) {
+			Benchmark::CameraPose pose = Benchmark::evaluatePath((float)(frame * sim_timestep));
+			GLsetCameraPose(pose.panv, pose.rota, pose.dollyEffect);
 		}
-		if(wait > 0) {
-			Sleep(wait);
+		GLupdate((float)sim_timestep);
+		GLrender(1.f);
+		// Nothing presents the frame, finish it here so frame times include the GPU work
+		glFinish();
+		if (frame == 0) reportStartup(tracePath);
+
+		double cpu_ms = (double)(SDL_GetPerformanceCounter() - frame_start) * 1000.0 / (double)SDL_GetPerformanceFrequency();
+		FrameStats::record((float)cpu_ms, (float)cpu_ms, 0.f);
+		if (bench.enabled) {
+			FrameStats::Sample sample;
+			FrameStats::copyRecent(&sample, 1);
+			Benchmark::addFrame(sample);
 		}
-		prev_frametimestamp = SDL_GetTicks();
 	}
+
+	int exit_code = 0;
+	if (screenshot != NULL && !Headless::writePPM(screenshot)) exit_code = 1;
+	if (bench.enabled) {
+		Benchmark::RunInfo info;
+		info.renderer = (const char*)glGetString(GL_RENDERER);
+		info.glVersion = (const char*)glGetString(GL_VERSION);
+		info.width = width;
+		info.height = height;
+		info.timestep = (float)sim_timestep;
+		if (!Benchmark::writeReport(info)) exit_code = 1;
+	}
+
+	ImGui_ImplSdlGL3_Shutdown();
+	GLcleanup();
+	Jobs::shutdown();
+	Headless::destroy();
+	return exit_code;
 }
 
 int main(int argc, char** argv) {
+	// GL submission runs on its own thread unless asked otherwise
+	bool render_thread_enabled = true;
+	bool headless = false;
+	int headless_w = default_width, headless_h = default_height;
+	const char* screenshot = NULL;
+	const char* trace_path = NULL;
+	bool args_ok = true;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--single-thread") == 0) render_thread_enabled = false;
+		else if (strcmp(argv[i], "--headless") == 0) headless = true;
+		else if (strcmp(argv[i], "--size") == 0) {
+			args_ok = args_ok && i + 1 < argc && sscanf_s(argv[++i], "%dx%d", &headless_w, &headless_h) == 2
+				&& headless_w > 0 && headless_h > 0;
+		}
+		else if (strcmp(argv[i], "--screenshot") == 0) {
+			args_ok = args_ok && i + 1 < argc;
+			if (i + 1 < argc) screenshot = argv[++i];
+		}
+		else if (strcmp(argv[i], "--startup-trace") == 0) {
+			args_ok = args_ok && i + 1 < argc;
+			if (i + 1 < argc) trace_path = argv[++i];
+		}
+	}
+	Benchmark::Options bench;
+	if (!args_ok || !Benchmark::parseArgs(argc, argv, bench)) {
+		SDL_Log("Usage: %s [--single-thread] [--headless [--size WxH] [--screenshot file.ppm]] [--startup-trace file.json] "
+			"[--benchmark [frames]] [--benchmark-warmup frames] [--benchmark-out file] [--camera-path file]", argv[0]);
+		return -1;
+	}
+	if (bench.enabled) {
+		// Every published frame has to be drawn and timed, the render thread may drop some
+		render_thread_enabled = false;
+		if (bench.pathFile != NULL) {
+			if (!Benchmark::loadPath(bench.pathFile)) return -1;
+		}
+		else Benchmark::useDefaultPath();
+	}
+	if (headless) {
+		if (!bench.enabled && screenshot == NULL) screenshot = "frame.ppm";
+		return runHeadless(bench, headless_w, headless_h, screenshot, trace_path);
+	}
+
 	//Init GLFW
-	if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+	int trace = StartupTrace::begin("SDL_Init");
+	int sdl_status = SDL_Init(SDL_INIT_VIDEO);
+	StartupTrace::end(trace);
+	if (sdl_status != 0) {
 		SDL_Log("Couldn't initialize SDL: %s", SDL_GetError());
 		SDL_Quit();
 		return -1;
@@ -54,8 +208,10 @@ int main(int argc, char** argv) {
 	SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
 	SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24); //Bits of Depth buffer
 
+	trace = StartupTrace::begin("Create window");
 	mainwindow = SDL_CreateWindow("GL_framework", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-		800, 600, SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
+		default_width, default_height, SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
+	StartupTrace::end(trace);
 		if (!mainwindow) { /* Die if creation failed */
 			SDL_Log("Couldn't create SDL window: %s", SDL_GetError());
 			SDL_Quit();
@@ -63,10 +219,15 @@ int main(int argc, char** argv) {
 		}
 
 	/* Create our opengl context and attach it to our window */
+	trace = StartupTrace::begin("GL context");
 	maincontext = SDL_GL_CreateContext(mainwindow);
+	StartupTrace::end(trace);
 
-	// Init GLEW
+	// Init GLEW. Core profiles need the experimental path to load every entry point
+	trace = StartupTrace::begin("glewInit");
+	glewExperimental = GL_TRUE;
 	GLenum err = glewInit();
+	StartupTrace::end(trace);
 	if(GLEW_OK != err) {
 		SDL_Log("Glew error: %s\n", glewGetErrorString(err));
 	}
@@ -78,15 +239,65 @@ int main(int argc, char** argv) {
 	int display_w, display_h;
 	SDL_GL_GetDrawableSize(mainwindow, &display_w, &display_h);
 
+	// Workers are needed by the scene setup already (AO bake)
+	trace = StartupTrace::begin("Job system");
+	Jobs::init();
+	StartupTrace::end(trace);
+
 	// Init scene
 	GLinit(display_w, display_h);
 	// Setup ImGui binding
+	trace = StartupTrace::begin("ImGui init");
 	ImGui_ImplSdlGL3_Init(mainwindow);
+	StartupTrace::end(trace);
+	// Build the font texture now, NewFrame would otherwise do it without a context
+	trace = StartupTrace::begin("Font atlas");
+	ImGui_ImplSdlGL3_CreateDeviceObjects();
+	StartupTrace::end(trace);
 
+	// The render thread owns the context from here on and consumes the scene
+	// snapshots this thread publishes
+	std::thread render_thread;
+	if (render_thread_enabled) {
+		SDL_GL_MakeCurrent(mainwindow, NULL);
+		render_thread = std::thread([mainwindow, maincontext]() {
+			SDL_GL_MakeCurrent(mainwindow, maincontext);
+			while (GLrenderLatest()) {
+				SDL_GL_SwapWindow(mainwindow);
+			}
+			SDL_GL_MakeCurrent(mainwindow, NULL);
+		});
+	}
+
+	FramePacer::init(expected_fps);
+	if (bench.enabled) {
+		// Only single threaded runs get here, this thread still owns the context
+		GLwaitForAssets();
+		Benchmark::begin(bench);
+	}
+	int bench_frame = 0;
+
+	Uint64 prev_counter = SDL_GetPerformanceCounter();
+	double accumulator = 0.0;
+
+	int redraw_frames = redraw_frames_after_input;
 	bool quit_app = false;
+	Uint32 mouse_buttons = 0;	// as last published to the render thread's late latch
 	while (!quit_app) {
 		SDL_Event eve;
-		while (SDL_PollEvent(&eve)) {
+		// Nothing moves and no input arrived lately: block until something happens
+		// instead of drawing identical frames
+		bool idle = !bench.enabled && redraw_frames == 0 && !GLisAnimating();
+		bool has_event = idle ? SDL_WaitEventTimeout(&eve, idle_timeout_ms) != 0 : SDL_PollEvent(&eve) != 0;
+		if (idle) {
+			// Don't let the simulation or the pacer see the idle time as one long frame
+			prev_counter = SDL_GetPerformanceCounter();
+			FramePacer::resume();
+			if (!has_event) continue;
+		}
+		Uint64 frame_start = SDL_GetPerformanceCounter();
+		for (; has_event; has_event = SDL_PollEvent(&eve) != 0) {
+			redraw_frames = redraw_frames_after_input;
 			ImGui_ImplSdlGL3_ProcessEvent(&eve);
 			switch (eve.type) {
 			case SDL_WINDOWEVENT:
@@ -94,6 +305,16 @@ int main(int argc, char** argv) {
 					GLResize(eve.window.data1, eve.window.data2);
 				}
 				break;
+			case SDL_MOUSEMOTION:
+				mouse_buttons = eve.motion.state;
+				GLpublishMouse(eve.motion.x, eve.motion.y, mouse_buttons);
+				break;
+			case SDL_MOUSEBUTTONDOWN:
+			case SDL_MOUSEBUTTONUP:
+				mouse_buttons = eve.type == SDL_MOUSEBUTTONDOWN ?
+					mouse_buttons | SDL_BUTTON(eve.button.button) : mouse_buttons & ~SDL_BUTTON(eve.button.button);
+				GLpublishMouse(eve.button.x, eve.button.y, mouse_buttons);
+				break;
 			case SDL_QUIT:
 				quit_app = true;
 				break;
@@ -103,7 +324,15 @@ int main(int argc, char** argv) {
 
 		ImGuiIO& io = ImGui::GetIO();
 		GUI();
-		if(!io.WantCaptureMouse) {
+		// A focused text field blinks its cursor
+		if (io.WantTextInput) redraw_frames = redraw_frames_after_input;
+		if (redraw_frames > 0) redraw_frames--;
+		if (bench.enabled) {
+			// The camera follows the script, timed by frame count rather than the clock
+			Benchmark::CameraPose pose = Benchmark::evaluatePath((float)(bench_frame * sim_timestep));
+			GLsetCameraPose(pose.panv, pose.rota, pose.dollyEffect);
+		}
+		else if(!io.WantCaptureMouse) {
 			MouseEvent ev = {io.MousePos.x, io.MousePos.y, 
 				(io.MouseDown[0] ? MouseEvent::Button::Left : 
 				(io.MouseDown[1] ? MouseEvent::Button::Right :
@@ -111,17 +340,66 @@ int main(int argc, char** argv) {
 				MouseEvent::Button::None)))};
 			GLmousecb(ev);
 		}
-		GLrender((float)expected_frametime);
 
-		SDL_GL_SwapWindow(mainwindow);
-		waitforFrameEnd();
+		Uint64 counter = SDL_GetPerformanceCounter();
+		double frame_time = (double)(counter - prev_counter) / (double)SDL_GetPerformanceFrequency();
+		prev_counter = counter;
+		if (bench.enabled) {
+			// Exactly one step per frame, so every run simulates and draws the same frames
+			GLupdate((float)sim_timestep);
+			accumulator = sim_timestep;
+		}
+		else {
+			accumulator += frame_time < max_frame_time ? frame_time : max_frame_time;
+			while (accumulator >= sim_timestep) {
+				GLupdate((float)sim_timestep);
+				accumulator -= sim_timestep;
+			}
+		}
+		if (render_thread_enabled) {
+			GLpublishFrame((float)(accumulator / sim_timestep));
+		}
+		else {
+			GLrender((float)(accumulator / sim_timestep));
+			SDL_GL_SwapWindow(mainwindow);
+		}
+		double cpu_ms = (double)(SDL_GetPerformanceCounter() - frame_start) * 1000.0 / (double)SDL_GetPerformanceFrequency();
+		// Benchmarks run unpaced
+		double sleep_ms = bench.enabled ? 0.0 : FramePacer::waitForFrameEnd();
+		FrameStats::record((float)(cpu_ms + sleep_ms), (float)cpu_ms, (float)sleep_ms);
+		// With the render thread this marks the first frame handed over rather than shown
+		if (!StartupTrace::finished()) reportStartup(trace_path);
+		if (bench.enabled) {
+			FrameStats::Sample sample;
+			FrameStats::copyRecent(&sample, 1);
+			if (!Benchmark::addFrame(sample)) quit_app = true;
+			bench_frame++;
+		}
+	}
+
+	if (render_thread_enabled) {
+		GLstopRendering();
+		render_thread.join();
+		SDL_GL_MakeCurrent(mainwindow, maincontext);
+	}
+
+	int exit_code = 0;
+	if (bench.enabled) {
+		Benchmark::RunInfo info;
+		info.renderer = (const char*)glGetString(GL_RENDERER);
+		info.glVersion = (const char*)glGetString(GL_VERSION);
+		SDL_GL_GetDrawableSize(mainwindow, &info.width, &info.height);
+		info.timestep = (float)sim_timestep;
+		if (!Benchmark::writeReport(info)) exit_code = 1;
 	}
 
+	FramePacer::shutdown();
 	ImGui_ImplSdlGL3_Shutdown();
 	GLcleanup();
+	Jobs::shutdown();
 
 	SDL_GL_DeleteContext(maincontext);
 	SDL_DestroyWindow(mainwindow);
 	SDL_Quit();
-	return 0;
+	return exit_code;
 }
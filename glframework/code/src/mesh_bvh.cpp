@@ -0,0 +1,197 @@
+#include <xmmintrin.h>
+#include <algorithm>
+#include <cfloat>
+
+#include "mesh_bvh.h"
+#include "bvh_build.h"
+
+namespace {
+	using BVHBuild::Item;
+	using BVHBuild::maxStack;
+	using BVHBuild::safeInverse;
+
+	struct Builder {
+		static const int leafSize = 4;
+		const std::vector<glm::vec3>& verts;
+		std::vector<Item> tris;
+		MeshBVH& bvh;
+
+		Builder(const std::vector<glm::vec3>& v, MeshBVH& b) : verts(v), bvh(b) {}
+
+		void setBounds(int node, const glm::vec3& bmin, const glm::vec3& bmax) {
+			bvh.nodes[node].bmin = bmin;
+			bvh.nodes[node].bmax = bmax;
+		}
+		void makeLeaf(int node, int begin, int end) {
+			MeshBVH::TriPack pack;
+			for (int l = 0; l < leafSize; l++) {
+				int t = begin + l < end ? tris[begin + l].idx : -1;
+				glm::vec3 v0(0.f), e1(0.f), e2(0.f);
+				if (t >= 0) {
+					v0 = verts[3 * t];
+					e1 = verts[3 * t + 1] - v0;
+					e2 = verts[3 * t + 2] - v0;
+				}
+				for (int a = 0; a < 3; a++) {
+					pack.v0[a][l] = v0[a];
+					pack.e1[a][l] = e1[a];
+					pack.e2[a][l] = e2[a];
+				}
+				pack.triIdx[l] = t;
+			}
+			bvh.nodes[node].left = (int)bvh.packs.size();
+			bvh.nodes[node].isLeaf = 1;
+			bvh.packs.push_back(pack);
+		}
+		int makeInner(int node) {
+			int left = (int)bvh.nodes.size();
+			bvh.nodes.resize(left + 2);
+			bvh.nodes[node].left = left;
+			bvh.nodes[node].isLeaf = 0;
+			return left;
+		}
+	};
+
+	inline float rayBox(const MeshBVH::Node& n, const glm::vec3& orig, const glm::vec3& invDir, float tmin, float tmax) {
+		return BVHBuild::rayBox(n.bmin, n.bmax, orig, invDir, tmin, tmax);
+	}
+
+	struct SSERay {
+		__m128 o[3], d[3];
+		SSERay(const glm::vec3& orig, const glm::vec3& dir) {
+			for (int a = 0; a < 3; a++) {
+				o[a] = _mm_set1_ps(orig[a]);
+				d[a] = _mm_set1_ps(dir[a]);
+			}
+		}
+	};
+
+	// Moller-Trumbore against the 4 triangles of a leaf at once.
+	// Returns the hit lane mask and writes the distances to t.
+	inline int intersectPack(const MeshBVH::TriPack& p, const SSERay& r, __m128 tmin, __m128 tmax, __m128& t) {
+		__m128 e1x = _mm_loadu_ps(p.e1[0]), e1y = _mm_loadu_ps(p.e1[1]), e1z = _mm_loadu_ps(p.e1[2]);
+		__m128 e2x = _mm_loadu_ps(p.e2[0]), e2y = _mm_loadu_ps(p.e2[1]), e2z = _mm_loadu_ps(p.e2[2]);
+
+		// pvec = dir x e2
+		__m128 px = _mm_sub_ps(_mm_mul_ps(r.d[1], e2z), _mm_mul_ps(r.d[2], e2y));
+		__m128 py = _mm_sub_ps(_mm_mul_ps(r.d[2], e2x), _mm_mul_ps(r.d[0], e2z));
+		__m128 pz = _mm_sub_ps(_mm_mul_ps(r.d[0], e2y), _mm_mul_ps(r.d[1], e2x));
+		__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+		__m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.f), det);
+		__m128 valid = _mm_cmpgt_ps(absDet, _mm_set1_ps(1e-12f));
+		__m128 invDet = _mm_div_ps(_mm_set1_ps(1.f), det);
+
+		// tvec = orig - v0
+		__m128 tx = _mm_sub_ps(r.o[0], _mm_loadu_ps(p.v0[0]));
+		__m128 ty = _mm_sub_ps(r.o[1], _mm_loadu_ps(p.v0[1]));
+		__m128 tz = _mm_sub_ps(r.o[2], _mm_loadu_ps(p.v0[2]));
+		__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+
+		// qvec = tvec x e1
+		__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+		__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+		__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+		__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(r.d[0], qx), _mm_mul_ps(r.d[1], qy)), _mm_mul_ps(r.d[2], qz)), invDet);
+		t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+		__m128 zero = _mm_setzero_ps();
+		valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+		valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+		valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.f)));
+		valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, tmin));
+		valid = _mm_and_ps(valid, _mm_cmplt_ps(t, tmax));
+		return _mm_movemask_ps(valid);
+	}
+}
+
+void MeshBVH::build(const std::vector<glm::vec3>& verts) {
+	nodes.clear();
+	packs.clear();
+	int numTris = (int)verts.size() / 3;
+	if (numTris == 0) return;
+
+	Builder b(verts, *this);
+	b.tris.resize(numTris);
+	for (int i = 0; i < numTris; i++) {
+		const glm::vec3& a = verts[3 * i];
+		const glm::vec3& c = verts[3 * i + 1];
+		const glm::vec3& d = verts[3 * i + 2];
+		b.tris[i].bmin = glm::min(a, glm::min(c, d));
+		b.tris[i].bmax = glm::max(a, glm::max(c, d));
+		b.tris[i].centroid = (a + c + d) / 3.f;
+		b.tris[i].idx = i;
+	}
+	nodes.reserve(2 * numTris / Builder::leafSize + 1);
+	nodes.resize(1);
+	BVHBuild::build(b, b.tris.data(), 0, 0, numTris, 0);
+}
+
+bool MeshBVH::intersect(const glm::vec3& orig, const glm::vec3& dir, float tmin, float tmax, float& tHit, int& triHit) const {
+	if (nodes.empty()) return false;
+	glm::vec3 invDir = safeInverse(dir);
+	SSERay ray(orig, dir);
+	__m128 vtmin = _mm_set1_ps(tmin);
+	bool hit = false;
+	float closest = tmax;
+
+	int stack[maxStack];
+	int sp = 0;
+	if (rayBox(nodes[0], orig, invDir, tmin, closest) == FLT_MAX) return false;
+	stack[sp++] = 0;
+	while (sp > 0) {
+		const Node& n = nodes[stack[--sp]];
+		if (n.isLeaf) {
+			__m128 t;
+			int mask = intersectPack(packs[n.left], ray, vtmin, _mm_set1_ps(closest), t);
+			if (mask) {
+				float ts[4];
+				_mm_storeu_ps(ts, t);
+				for (int l = 0; l < 4; l++) {
+					if ((mask & (1 << l)) && ts[l] < closest) {
+						closest = ts[l];
+						triHit = packs[n.left].triIdx[l];
+						hit = true;
+					}
+				}
+			}
+			continue;
+		}
+		float d0 = rayBox(nodes[n.left], orig, invDir, tmin, closest);
+		float d1 = rayBox(nodes[n.left + 1], orig, invDir, tmin, closest);
+		// Push the far child first so the near one is visited next
+		if (d0 <= d1) {
+			if (d1 != FLT_MAX) stack[sp++] = n.left + 1;
+			if (d0 != FLT_MAX) stack[sp++] = n.left;
+		}
+		else {
+			if (d0 != FLT_MAX) stack[sp++] = n.left;
+			stack[sp++] = n.left + 1;
+		}
+	}
+	if (hit) tHit = closest;
+	return hit;
+}
+
+bool MeshBVH::occluded(const glm::vec3& orig, const glm::vec3& dir, float tmin, float tmax) const {
+	if (nodes.empty()) return false;
+	glm::vec3 invDir = safeInverse(dir);
+	SSERay ray(orig, dir);
+	__m128 vtmin = _mm_set1_ps(tmin);
+	__m128 vtmax = _mm_set1_ps(tmax);
+
+	int stack[maxStack];
+	int sp = 0;
+	stack[sp++] = 0;
+	while (sp > 0) {
+		const Node& n = nodes[stack[--sp]];
+		if (rayBox(n, orig, invDir, tmin, tmax) == FLT_MAX) continue;
+		if (n.isLeaf) {
+			__m128 t;
+			if (intersectPack(packs[n.left], ray, vtmin, vtmax, t)) return true;
+			continue;
+		}
+		stack[sp++] = n.left + 1;
+		stack[sp++] = n.left;
+	}
+	return false;
+}
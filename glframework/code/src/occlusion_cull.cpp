@@ -0,0 +1,252 @@
+#include <emmintrin.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "occlusion_cull.h"
+#include "batch_math.h"
+#include "job_system.h"
+
+namespace {
+	const int tilesX = Occlusion::width / Occlusion::tileWidth;
+	const int tilesY = Occlusion::height / Occlusion::tileHeight;
+	const int numLevels = 9;	// 256x128 down to 1x1
+	// Keeps a surface from hiding its own bounding box through rounding
+	const float depthBias = 1e-5f;
+	// Vertices closer than this in clip w are behind the camera for our purposes
+	const float minW = 1e-3f;
+
+	struct ScreenTri {
+		float x[3], y[3], z[3];
+		int minX, minY, maxX, maxY;	// pixel bounds, inclusive
+	};
+
+	glm::mat4 viewProjMat;
+	std::vector<glm::vec4> clipVerts;
+	std::vector<ScreenTri> tris;
+	std::vector<int> tileTris[tilesX * tilesY];
+	// Level 0 is the depth buffer, every further level keeps the max of 2x2 texels
+	std::vector<float> levels[numLevels];
+	int levelW[numLevels], levelH[numLevels];
+
+	struct LevelInit {
+		LevelInit() {
+			for (int l = 0; l < numLevels; l++) {
+				levelW[l] = std::max(Occlusion::width >> l, 1);
+				levelH[l] = std::max(Occlusion::height >> l, 1);
+				levels[l].assign(levelW[l] * levelH[l], 1.f);
+			}
+		}
+	} levelInit;
+
+	void setupTriangle(const glm::vec4& a, const glm::vec4& b, const glm::vec4& c) {
+		// Occluders crossing the near plane are dropped rather than clipped:
+		// fewer occluders is always safe
+		if (a.w < minW || b.w < minW || c.w < minW) return;
+		const glm::vec4* v[3] = { &a, &b, &c };
+		ScreenTri t;
+		float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+		for (int i = 0; i < 3; i++) {
+			float invW = 1.f / v[i]->w;
+			t.x[i] = (v[i]->x * invW * 0.5f + 0.5f) * Occlusion::width;
+			t.y[i] = (v[i]->y * invW * 0.5f + 0.5f) * Occlusion::height;
+			t.z[i] = v[i]->z * invW * 0.5f + 0.5f;
+			minX = std::min(minX, t.x[i]);
+			maxX = std::max(maxX, t.x[i]);
+			minY = std::min(minY, t.y[i]);
+			maxY = std::max(maxY, t.y[i]);
+		}
+		float area = (t.x[1] - t.x[0]) * (t.y[2] - t.y[0]) - (t.x[2] - t.x[0]) * (t.y[1] - t.y[0]);
+		if (area == 0.f) return;
+		if (area < 0.f) {
+			// Both windings count, store everything counter clockwise
+			std::swap(t.x[1], t.x[2]);
+			std::swap(t.y[1], t.y[2]);
+			std::swap(t.z[1], t.z[2]);
+		}
+		// Pixels whose centers (x + 0.5) fall inside the bounds
+		t.minX = std::max((int)ceilf(minX - 0.5f), 0);
+		t.minY = std::max((int)ceilf(minY - 0.5f), 0);
+		t.maxX = std::min((int)floorf(maxX - 0.5f), Occlusion::width - 1);
+		t.maxY = std::min((int)floorf(maxY - 0.5f), Occlusion::height - 1);
+		if (t.minX > t.maxX || t.minY > t.maxY) return;
+		tris.push_back(t);
+	}
+
+	void rasterizeTile(int tile) {
+		int tx0 = (tile % tilesX) * Occlusion::tileWidth, ty0 = (tile / tilesX) * Occlusion::tileHeight;
+		int tx1 = tx0 + Occlusion::tileWidth - 1, ty1 = ty0 + Occlusion::tileHeight - 1;
+		float* depth = levels[0].data();
+		const __m128 laneOffsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+		const __m128 zero = _mm_setzero_ps();
+		for (int index : tileTris[tile]) {
+			const ScreenTri& t = tris[index];
+			// Edge i is positive on the inside: A*x + B*y + C
+			float A[3], B[3], C[3];
+			for (int i = 0; i < 3; i++) {
+				int j = (i + 1) % 3;
+				A[i] = t.y[i] - t.y[j];
+				B[i] = t.x[j] - t.x[i];
+				C[i] = t.x[i] * t.y[j] - t.x[j] * t.y[i];
+			}
+			// Depth as a plane over the screen
+			float area = C[0] + C[1] + C[2];
+			float invArea = 1.f / area;
+			float zA = (A[1] * t.z[0] + A[2] * t.z[1] + A[0] * t.z[2]) * invArea;
+			float zB = (B[1] * t.z[0] + B[2] * t.z[1] + B[0] * t.z[2]) * invArea;
+			float zC = (C[1] * t.z[0] + C[2] * t.z[1] + C[0] * t.z[2]) * invArea;
+
+			int x0 = std::max(t.minX, tx0) & ~3, x1 = std::min(t.maxX, tx1);
+			int y0 = std::max(t.minY, ty0), y1 = std::min(t.maxY, ty1);
+			__m128 eA[3], eB[3], eC[3];
+			for (int i = 0; i < 3; i++) {
+				eA[i] = _mm_set1_ps(A[i]);
+				eB[i] = _mm_set1_ps(B[i]);
+				eC[i] = _mm_set1_ps(C[i]);
+			}
+			__m128 dzA = _mm_set1_ps(zA), dzB = _mm_set1_ps(zB), dzC = _mm_set1_ps(zC);
+			for (int y = y0; y <= y1; y++) {
+				__m128 py = _mm_set1_ps(y + 0.5f);
+				float* row = depth + y * Occlusion::width;
+				for (int x = x0; x <= x1; x += 4) {
+					__m128 px = _mm_add_ps(_mm_set1_ps((float)x), laneOffsets);
+					__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+					for (int i = 0; i < 3; i++) {
+						__m128 e = _mm_add_ps(_mm_add_ps(_mm_mul_ps(eA[i], px), _mm_mul_ps(eB[i], py)), eC[i]);
+						inside = _mm_and_ps(inside, _mm_cmpge_ps(e, zero));
+					}
+					if (_mm_movemask_ps(inside) == 0) continue;
+					__m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dzA, px), _mm_mul_ps(dzB, py)), dzC);
+					__m128 d = _mm_loadu_ps(row + x);
+					__m128 nearer = _mm_min_ps(d, z);
+					_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, d)));
+				}
+			}
+		}
+	}
+
+	void buildPyramid() {
+		for (int l = 1; l < numLevels; l++) {
+			const float* src = levels[l - 1].data();
+			float* dst = levels[l].data();
+			int sw = levelW[l - 1], sh = levelH[l - 1];
+			for (int y = 0; y < levelH[l]; y++) {
+				int y0 = std::min(2 * y, sh - 1), y1 = std::min(2 * y + 1, sh - 1);
+				for (int x = 0; x < levelW[l]; x++) {
+					int x0 = std::min(2 * x, sw - 1), x1 = std::min(2 * x + 1, sw - 1);
+					dst[y * levelW[l] + x] = std::max(std::max(src[y0 * sw + x0], src[y0 * sw + x1]),
+						std::max(src[y1 * sw + x0], src[y1 * sw + x1]));
+				}
+			}
+		}
+	}
+}
+
+namespace Occlusion {
+	void begin(const glm::mat4& viewProj) {
+		viewProjMat = viewProj;
+		tris.clear();
+		std::fill(levels[0].begin(), levels[0].end(), 1.f);
+	}
+
+	void addOccluder(const glm::mat4& model, const glm::vec3* verts, int numVerts) {
+		clipVerts.resize(numVerts);
+		for (int i = 0; i < numVerts; i++) clipVerts[i] = glm::vec4(verts[i], 1.f);
+		BatchMath::transform(viewProjMat * model, clipVerts.data(), clipVerts.data(), numVerts);
+		for (int i = 0; i + 2 < numVerts; i += 3) {
+			setupTriangle(clipVerts[i], clipVerts[i + 1], clipVerts[i + 2]);
+		}
+	}
+
+	void addBox(const glm::mat4& model, const glm::vec3& center, const glm::vec3& extents) {
+		// Corner i has bit 0, 1, 2 set for +x, +y, +z
+		glm::vec3 c[8];
+		for (int i = 0; i < 8; i++) {
+			c[i] = center + glm::vec3(i & 1 ? extents.x : -extents.x, i & 2 ? extents.y : -extents.y, i & 4 ? extents.z : -extents.z);
+		}
+		const int faces[6][4] = { { 0, 2, 6, 4 }, { 1, 5, 7, 3 }, { 0, 4, 5, 1 }, { 2, 3, 7, 6 }, { 0, 1, 3, 2 }, { 4, 6, 7, 5 } };
+		glm::vec3 verts[36];
+		for (int f = 0; f < 6; f++) {
+			const int* q = faces[f];
+			const int order[6] = { q[0], q[1], q[2], q[0], q[2], q[3] };
+			for (int k = 0; k < 6; k++) verts[f * 6 + k] = c[order[k]];
+		}
+		addOccluder(model, verts, 36);
+	}
+
+	void rasterize() {
+		for (int t = 0; t < tilesX * tilesY; t++) tileTris[t].clear();
+		for (int i = 0; i < (int)tris.size(); i++) {
+			const ScreenTri& t = tris[i];
+			for (int ty = t.minY / tileHeight; ty <= t.maxY / tileHeight; ty++) {
+				for (int tx = t.minX / tileWidth; tx <= t.maxX / tileWidth; tx++) {
+					tileTris[ty * tilesX + tx].push_back(i);
+				}
+			}
+		}
+		// Tiles own disjoint pixels, no synchronization needed
+		Jobs::parallelFor(0, tilesX * tilesY, 1, [](int begin, int end) {
+			for (int tile = begin; tile < end; tile++) rasterizeTile(tile);
+		});
+		buildPyramid();
+	}
+
+	bool testBox(const glm::vec3& center, const glm::vec3& extents) {
+		float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f, minZ = 1e30f;
+		for (int i = 0; i < 8; i++) {
+			glm::vec3 corner = center + glm::vec3(i & 1 ? extents.x : -extents.x, i & 2 ? extents.y : -extents.y, i & 4 ? extents.z : -extents.z);
+			glm::vec4 p = viewProjMat * glm::vec4(corner, 1.f);
+			// Reaches behind the camera, the projected rectangle means nothing
+			if (p.w < minW) return true;
+			float invW = 1.f / p.w;
+			float x = (p.x * invW * 0.5f + 0.5f) * width;
+			float y = (p.y * invW * 0.5f + 0.5f) * height;
+			minX = std::min(minX, x);
+			maxX = std::max(maxX, x);
+			minY = std::min(minY, y);
+			maxY = std::max(maxY, y);
+			minZ = std::min(minZ, p.z * invW * 0.5f + 0.5f);
+		}
+		int x0 = std::max((int)floorf(minX), 0), x1 = std::min((int)floorf(maxX), width - 1);
+		int y0 = std::max((int)floorf(minY), 0), y1 = std::min((int)floorf(maxY), height - 1);
+		// Off screen, that's for the frustum test to decide
+		if (x0 > x1 || y0 > y1) return true;
+
+		// Coarsest level where the rectangle spans at most four texels each way;
+		// 16 reads, and far fewer texels reaching past the box than with 2x2
+		int l = 0;
+		while (l + 1 < numLevels && ((x1 >> l) - (x0 >> l) > 3 || (y1 >> l) - (y0 >> l) > 3)) l++;
+		float maxDepth = 0.f;
+		const float* level = levels[l].data();
+		for (int y = y0 >> l; y <= y1 >> l; y++) {
+			for (int x = x0 >> l; x <= x1 >> l; x++) {
+				maxDepth = std::max(maxDepth, level[y * levelW[l] + x]);
+			}
+		}
+		return minZ <= maxDepth + depthBias;
+	}
+
+	int numTriangles() {
+		return (int)tris.size();
+	}
+
+	const float* depthBuffer() {
+		return levels[0].data();
+	}
+
+	int selectOccluder(const glm::vec3* verts, int numVerts, glm::vec3* out, int maxTris) {
+		int numTris = numVerts / 3;
+		std::vector<std::pair<float, int> > bySize(numTris);
+		for (int i = 0; i < numTris; i++) {
+			const glm::vec3* v = verts + 3 * i;
+			bySize[i] = std::make_pair(glm::length(glm::cross(v[1] - v[0], v[2] - v[0])), i);
+		}
+		int n = std::min(maxTris, numTris);
+		std::partial_sort(bySize.begin(), bySize.begin() + n, bySize.end(),
+			[](const std::pair<float, int>& a, const std::pair<float, int>& b) { return a.first > b.first; });
+		for (int i = 0; i < n; i++) {
+			for (int k = 0; k < 3; k++) out[3 * i + k] = verts[3 * bySize[i].second + k];
+		}
+		return 3 * n;
+	}
+}
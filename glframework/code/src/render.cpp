@@ -1,14 +1,35 @@
-#include <GL\glew.h>
-#include <glm\gtc\type_ptr.hpp>
-#include <glm\gtc\matrix_transform.hpp>
+#include <GL/glew.h>
+#include <SDL2/SDL.h>
+#include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/matrix_transform.hpp>
 #include <cstdio>
 #include <cassert>
+#include <cstring>
+#include <cstddef>
 #include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
-#include <imgui\imgui.h>
-#include <imgui\imgui_impl_sdl_gl3.h>
+#include <imgui/imgui.h>
+#include <imgui/imgui_impl_sdl_gl3.h>
 
 #include "GL_framework.h"
+#include "crt_compat.h"
+#include "ao_bake.h"
+#include "camera.h"
+#include "scene_graph.h"
+#include "batch_math.h"
+#include "frustum_cull.h"
+#include "occlusion_cull.h"
+#include "mesh_bvh.h"
+#include "scene_bvh.h"
+#include "spatial_grid.h"
+#include "primitives.h"
+#include "frame_pacer.h"
+#include "job_system.h"
+#include "frame_stats.h"
+#include "startup_trace.h"
 
 ///////// fw decl
 namespace ImGui {
@@ -19,17 +40,84 @@ void setupAxis();
 void cleanupAxis();
 void drawAxis();
 }
+namespace Deferred {
+void resizeGBuffer(int width, int height);
+}
+namespace Snapshots {
+void cleanup();
+}
+namespace Shadow {
+extern glm::mat4 lightMat;
+void bindShadowMap(GLuint program, GLuint unit, const glm::mat4& toLight);
+}
 ////////////////
 
+struct RenderSettings {
+	bool deferred = false;
+	bool depthPrepass = false;
+	bool shadows = true;
+	bool cacheShadowMap = true;
+	bool renderOnDemand = true;
+	bool lateLatch = true;
+	bool occlusionCulling = false;
+	bool pickMode = false;	// left click picks instead of rotating
+	bool farCopies = false;
+	bool impostors = true;
+	float impostorPixels = 64.f;
+	int impostorBudgetMB = 4;
+};
+struct RenderStats {
+	float gpuMs = 0.f;
+	GLuint prepassSamples = 0;
+	GLuint shadedSamples = 0;
+	int shadowRenders = 0;
+	bool shadowRedrawn = false;
+	int uploads = 0;
+	float inputLatencyMs = 0.f;
+	float latchedLatencyMs = 0.f;
+	int visibleDrawables = 0;
+	int culledDrawables = 0;
+	int occludedDrawables = 0;
+	int occluderTriangles = 0;
+	float cullMs = 0.f;
+	int pickedDrawable = -1;
+	int pickedTriangle = -1;
+	float pickDistance = 0.f;
+	float pickUs = 0.f;
+	float vertexGpuUs[2] = {};	// VertexBench results
+	float vertexWallUs[2] = {};
+	int impostorsDrawn = 0;
+	int meshCopiesDrawn = 0;
+	int impostorAtlases = 0;
+	float impostorAtlasMB = 0.f;
+	int impostorBakes = 0;
+};
+// Free camera state plus the mouse drag it was last updated from, so the
+// renderer can extend the drag with a later mouse reading
+struct CameraInput {
+	float panv[3];
+	float rota[2];
+	float mouseX, mouseY;
+	MouseEvent::Button button;
+	bool dragging;
+	Uint64 ticks;
+};
+// Viewport position of the last pick click, id changes with every click
+struct PickRequest {
+	float x, y;
+	unsigned id;
+};
+
+// Matrices and FOV belong to the renderer. Window size, settings, stats and
+// mouse driven camera controls belong to the update side.
 namespace RenderVars {
-	float FOV = glm::radians(75.f);
+	const float FOV = glm::radians(75.f);
 	const float zNear = 1.f;
 	const float zFar = 50.f;
 
-	glm::mat4 _projection;
-	glm::mat4 _modelView;
-	glm::mat4 _MVP;
-	glm::mat4 _inv_modelview;
+	// View, projection and everything derived from them, rebuilt only when the
+	// camera parameters change
+	Camera camera;
 	glm::vec4 _cameraPoint; 
 
 	struct prevMouse {
@@ -40,6 +128,13 @@ namespace RenderVars {
 
 	float panv[3] = { 0.f, -5.f, -15.f };
 	float rota[2] = { 0.f, 0.f };
+	bool mouseTracked = false;	// GLmousecb ran since the last snapshot
+	PickRequest pick = { 0.f, 0.f, 0 };
+
+	int width = 0, height = 0;
+	GLuint outputFbo = 0;	// where frames end up, 0 is the window
+	RenderSettings settings;
+	RenderStats stats;
 }
 namespace RV = RenderVars;
 
@@ -62,7 +157,7 @@ bool loadOBJ(const char * path,
 	while (1) {
 		char lineHeader[128];
 		// read the first word of the line
-		int res = fscanf_s(file, "%s", lineHeader, 128);
+		int res = fscanWord(file, lineHeader);
 		if (res == EOF)
 			break; // EOF = End Of File. Quit the loop.
 
@@ -87,6 +182,7 @@ bool loadOBJ(const char * path,
 			int matches = fscanf_s(file, "%d/%d/%d %d/%d/%d %d/%d/%d\n", &vertexIndex[0], &uvIndex[0], &normalIndex[0], &vertexIndex[1], &uvIndex[1], &normalIndex[1], &vertexIndex[2], &uvIndex[2], &normalIndex[2]);
 			if (matches != 9) {
 				printf("File can't be read by our simple parser : ( Try exporting with other options\n");
+				fclose(file);
 				return false;
 			}
 			vertexIndices.push_back(vertexIndex[0]);
@@ -118,33 +214,56 @@ bool loadOBJ(const char * path,
 		glm::vec3 vertex = temp_normals[normalIndex - 1];
 		out_normals.push_back(vertex);
 	}
+	fclose(file);
+	return true;
 }
 
-void GLResize(int width, int height) {
+void resizeViewport(int width, int height) {
 	glViewport(0, 0, width, height);
-	if(height != 0) RV::_projection = glm::perspective(RV::FOV, (float)width / (float)height, RV::zNear, RV::zFar);
-	else RV::_projection = glm::perspective(RV::FOV, 0.f, RV::zNear, RV::zFar);
+	if (height != 0) RV::camera.setAspect((float)width / (float)height);
+	Deferred::resizeGBuffer(width, height);
+}
+
+// Only records the size, the renderer picks it up with the next snapshot
+void GLResize(int width, int height) {
+	RV::width = width;
+	RV::height = height;
+}
+
+void dragCamera(MouseEvent::Button button, float diffx, float diffy, float panv[3], float rota[2]) {
+	switch(button) {
+	case MouseEvent::Button::Left: // ROTATE
+		rota[0] += diffx * 0.005f;
+		rota[1] += diffy * 0.005f;
+		break;
+	case MouseEvent::Button::Right: // MOVE XY
+		panv[0] += diffx * 0.03f;
+		panv[1] -= diffy * 0.03f;
+		break;
+	case MouseEvent::Button::Middle: // MOVE Z
+		panv[2] += diffy * 0.05f;
+		break;
+	default: break;
+	}
+}
+
+// In pick mode the left button picks what is under the cursor instead of rotating
+bool isPickButton(MouseEvent::Button button) {
+	return RV::settings.pickMode && button == MouseEvent::Button::Left;
 }
 
 void GLmousecb(MouseEvent ev) {
+	RV::mouseTracked = true;
 	if(RV::prevMouse.waspressed && RV::prevMouse.button == ev.button) {
 		float diffx = ev.posx - RV::prevMouse.lastx;
 		float diffy = ev.posy - RV::prevMouse.lasty;
-		switch(ev.button) {
-		case MouseEvent::Button::Left: // ROTATE
-			RV::rota[0] += diffx * 0.005f;
-			RV::rota[1] += diffy * 0.005f;
-			break;
-		case MouseEvent::Button::Right: // MOVE XY
-			RV::panv[0] += diffx * 0.03f;
-			RV::panv[1] -= diffy * 0.03f;
-			break;
-		case MouseEvent::Button::Middle: // MOVE Z
-			RV::panv[2] += diffy * 0.05f;
-			break;
-		default: break;
-		}
+		if (!isPickButton(ev.button)) dragCamera(ev.button, diffx, diffy, RV::panv, RV::rota);
 	} else {
+		if (isPickButton(ev.button)) {
+			RV::pick.x = ev.posx;
+			RV::pick.y = ev.posy;
+			RV::pick.id++;
+		}
 		RV::prevMouse.button = ev.button;
 		RV::prevMouse.waspressed = true;
 	}
@@ -183,34 +302,103 @@ void linkProgram(GLuint program) {
 	}
 }
 
+////////////////////////////////////////////////// MATERIALS
+// Material and light parameters live in std140 uniform blocks. Each material
+// owns a small UBO that is only re-uploaded after it has been edited, so
+// switching material between draws is a single glBindBufferBase.
+namespace Materials {
+	const GLuint materialBinding = 0;
+	const GLuint lightBinding = 1;
+
+	// Mirrors "layout(std140) uniform MaterialBlock" in the shaders
+	struct MaterialData {
+		glm::vec3 color;
+		float k_amb;
+		float k_dif;
+		float k_spe;
+		int spec_pow;
+		float pad;
+	};
+	// Mirrors "layout(std140) uniform LightBlock" in the shaders
+	struct LightData {
+		glm::vec3 light_pos;
+		float pad0;
+		glm::vec3 light_col;
+		float pad1;
+		glm::vec3 ambient_col;
+		float pad2;
+	};
+
+	struct Material {
+		MaterialData data;
+		GLuint ubo = 0;
+		bool dirty = true;
+	};
+
+	LightData light;
+	GLuint lightUbo;
+	bool lightDirty = true;
+	int numUploads = 0;
+
+	void createMaterial(Material& mat) {
+		glGenBuffers(1, &mat.ubo);
+		glBindBuffer(GL_UNIFORM_BUFFER, mat.ubo);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(MaterialData), NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		mat.dirty = true;
+	}
+	void destroyMaterial(Material& mat) {
+		glDeleteBuffers(1, &mat.ubo);
+		mat.ubo = 0;
+	}
+	void bindMaterial(Material& mat) {
+		if (mat.dirty) {
+			glBindBuffer(GL_UNIFORM_BUFFER, mat.ubo);
+			glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(MaterialData), &mat.data);
+			glBindBuffer(GL_UNIFORM_BUFFER, 0);
+			mat.dirty = false;
+			numUploads++;
+		}
+		glBindBufferBase(GL_UNIFORM_BUFFER, materialBinding, mat.ubo);
+	}
+
+	void setupLights() {
+		glGenBuffers(1, &lightUbo);
+		glBindBuffer(GL_UNIFORM_BUFFER, lightUbo);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(LightData), NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		glBindBufferBase(GL_UNIFORM_BUFFER, lightBinding, lightUbo);
+		lightDirty = true;
+	}
+	void cleanupLights() {
+		glDeleteBuffers(1, &lightUbo);
+	}
+	void updateLights() {
+		if (!lightDirty) return;
+		glBindBuffer(GL_UNIFORM_BUFFER, lightUbo);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(LightData), &light);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		lightDirty = false;
+		numUploads++;
+	}
+
+	// Points a linked program's blocks (if it declares them) at our binding slots
+	void bindBlocks(GLuint program) {
+		GLuint idx = glGetUniformBlockIndex(program, "MaterialBlock");
+		if (idx != GL_INVALID_INDEX) glUniformBlockBinding(program, idx, materialBinding);
+		idx = glGetUniformBlockIndex(program, "LightBlock");
+		if (idx != GL_INVALID_INDEX) glUniformBlockBinding(program, idx, lightBinding);
+	}
+}
+
 ////////////////////////////////////////////////// AXIS
 namespace Axis {
 	GLuint AxisVao;
-	GLuint AxisVbo[3];
+	GLuint AxisVbo[2];
 	GLuint AxisShader[2];
 	GLuint AxisProgram;
 
-	float AxisVerts[] = {
-		0.0, 0.0, 0.0,
-		1.0, 0.0, 0.0,
-		0.0, 0.0, 0.0,
-		0.0, 1.0, 0.0,
-		0.0, 0.0, 0.0,
-		0.0, 0.0, 1.0
-	};
-	float AxisColors[] = {
-		1.0, 0.0, 0.0, 1.0,
-		1.0, 0.0, 0.0, 1.0,
-		0.0, 1.0, 0.0, 1.0,
-		0.0, 1.0, 0.0, 1.0,
-		0.0, 0.0, 1.0, 1.0,
-		0.0, 0.0, 1.0, 1.0
-	};
-	GLubyte AxisIdx[] = {
-		0, 1,
-		2, 3,
-		4, 5
-	};
+	constexpr auto axisMesh = Primitives::axes(1.f);
 	const char* Axis_vertShader =
 		"#version 330\n\
 in vec3 in_Position;\n\
@@ -233,20 +421,18 @@ void main() {\n\
 void setupAxis() {
 	glGenVertexArrays(1, &AxisVao);
 	glBindVertexArray(AxisVao);
-	glGenBuffers(3, AxisVbo);
+	glGenBuffers(2, AxisVbo);
 
+	const GLsizei stride = sizeof(Primitives::ColorVertex);
 	glBindBuffer(GL_ARRAY_BUFFER, AxisVbo[0]);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 24, AxisVerts, GL_STATIC_DRAW);
-	glVertexAttribPointer((GLuint)0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(axisMesh.verts), axisMesh.verts, GL_STATIC_DRAW);
+	glVertexAttribPointer((GLuint)0, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(Primitives::ColorVertex, position));
 	glEnableVertexAttribArray(0);
-
-	glBindBuffer(GL_ARRAY_BUFFER, AxisVbo[1]);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 24, AxisColors, GL_STATIC_DRAW);
-	glVertexAttribPointer((GLuint)1, 4, GL_FLOAT, false, 0, 0);
+	glVertexAttribPointer((GLuint)1, 4, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(Primitives::ColorVertex, color));
 	glEnableVertexAttribArray(1);
 
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, AxisVbo[2]);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLubyte) * 6, AxisIdx, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, AxisVbo[1]);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(axisMesh.indices), axisMesh.indices, GL_STATIC_DRAW);
 
 	glBindVertexArray(0);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
@@ -263,7 +449,7 @@ void setupAxis() {
 	linkProgram(AxisProgram);
 }
 void cleanupAxis() {
-	glDeleteBuffers(3, AxisVbo);
+	glDeleteBuffers(2, AxisVbo);
 	glDeleteVertexArrays(1, &AxisVao);
 
 	glDeleteProgram(AxisProgram);
@@ -273,8 +459,8 @@ void cleanupAxis() {
 void drawAxis() {
 	glBindVertexArray(AxisVao);
 	glUseProgram(AxisProgram);
-	glUniformMatrix4fv(glGetUniformLocation(AxisProgram, "mvpMat"), 1, GL_FALSE, glm::value_ptr(RV::_MVP));
-	glDrawElements(GL_LINES, 6, GL_UNSIGNED_BYTE, 0);
+	glUniformMatrix4fv(glGetUniformLocation(AxisProgram, "mvpMat"), 1, GL_FALSE, glm::value_ptr(RV::camera.viewProjection()));
+	glDrawElements(GL_LINES, axisMesh.numIndices, GL_UNSIGNED_SHORT, 0);
 
 	glUseProgram(0);
 	glBindVertexArray(0);
@@ -284,77 +470,27 @@ void drawAxis() {
 ////////////////////////////////////////////////// CUBE
 namespace Cube {
 GLuint cubeVao;
-GLuint cubeVbo[3];
+GLuint cubeVbo[2];
 GLuint cubeShaders[3];
 GLuint cubeProgram;
 glm::vec4 objCol = {1.f, 0.f, 0.f, 1.f};
-glm::mat4 objMat = glm::mat4(1.f);
-
-extern const float halfW = 0.5f;
-int numVerts = 24 + 6; // 4 vertex/face * 6 faces + 6 PRIMITIVE RESTART
-
-					   //   4---------7
-					   //  /|        /|
-					   // / |       / |
-					   //5---------6  |
-					   //|  0------|--3
-					   //| /       | /
-					   //|/        |/
-					   //1---------2
-glm::vec3 verts[] = {
-	glm::vec3(-halfW, -halfW, -halfW),
-	glm::vec3(-halfW, -halfW,  halfW),
-	glm::vec3(halfW, -halfW,  halfW),
-	glm::vec3(halfW, -halfW, -halfW),
-	glm::vec3(-halfW,  halfW, -halfW),
-	glm::vec3(-halfW,  halfW,  halfW),
-	glm::vec3(halfW,  halfW,  halfW),
-	glm::vec3(halfW,  halfW, -halfW)
-};
-glm::vec3 norms[] = {
-	glm::vec3(0.f, -1.f,  0.f),
-	glm::vec3(0.f,  1.f,  0.f),
-	glm::vec3(-1.f,  0.f,  0.f),
-	glm::vec3(1.f,  0.f,  0.f),
-	glm::vec3(0.f,  0.f, -1.f),
-	glm::vec3(0.f,  0.f,  1.f)
-};
+Culling::Bounds bounds;
+MeshBVH meshBVH;
 
-glm::vec3 cubeVerts[] = {
-	verts[1], verts[0], verts[2], verts[3],
-	verts[5], verts[6], verts[4], verts[7],
-	verts[1], verts[5], verts[0], verts[4],
-	verts[2], verts[3], verts[6], verts[7],
-	verts[0], verts[4], verts[3], verts[7],
-	verts[1], verts[2], verts[5], verts[6]
-};
-glm::vec3 cubeNorms[] = {
-	norms[0], norms[0], norms[0], norms[0],
-	norms[1], norms[1], norms[1], norms[1],
-	norms[2], norms[2], norms[2], norms[2],
-	norms[3], norms[3], norms[3], norms[3],
-	norms[4], norms[4], norms[4], norms[4],
-	norms[5], norms[5], norms[5], norms[5]
-};
-GLubyte cubeIdx[] = {
-	0, 1, 2, 3, UCHAR_MAX,
-	4, 5, 6, 7, UCHAR_MAX,
-	8, 9, 10, 11, UCHAR_MAX,
-	12, 13, 14, 15, UCHAR_MAX,
-	16, 17, 18, 19, UCHAR_MAX,
-	20, 21, 22, 23, UCHAR_MAX
-};
+constexpr float halfW = 0.5f;
+// Interleaved positions and normals, four vertices and two triangles per face
+constexpr auto cubeMesh = Primitives::box<1>(halfW);
+const int numIndices = cubeMesh.numIndices;
 
 const char* cube_vertShader =
 "#version 330\n\
 in vec3 in_Position;\n\
 in vec3 in_Normal;\n\
 out vec4 vert_Normal;\n\
-uniform mat4 objMat;\n\
-uniform mat4 mv_Mat;\n\
+uniform mat4 modelView;\n\
 void main() {\n\
-	gl_Position = mv_Mat * objMat * vec4(in_Position, 1.0);\n\
-	vert_Normal = mv_Mat * objMat * vec4(in_Normal, 0.0);\n\
+	gl_Position = modelView * vec4(in_Position, 1.0);\n\
+	vert_Normal = modelView * vec4(in_Normal, 0.0);\n\
 }";
 
 const char* cube_geomShader =
@@ -393,23 +529,29 @@ void main() {\n\
 	out_Color = vec4(color.xyz * dot(vert_g_Normal, mv_Mat*vec4(0.0, 1.0, 0.0, 0.0)) + color.xyz * 0.3, 1.0 );\n\
 }";
 void setupCube() {
+	// Unindexed triangles for picking
+	std::vector<glm::vec3> tris;
+	for (int i = 0; i < numIndices; i++) {
+		const float* p = cubeMesh.verts[cubeMesh.indices[i]].position;
+		tris.push_back(glm::vec3(p[0], p[1], p[2]));
+	}
+	bounds = Culling::computeBounds(tris.data(), (int)tris.size());
+	meshBVH.build(tris);
+
 	glGenVertexArrays(1, &cubeVao);
 	glBindVertexArray(cubeVao);
-	glGenBuffers(3, cubeVbo);
+	glGenBuffers(2, cubeVbo);
 
+	const GLsizei stride = sizeof(Primitives::Vertex);
 	glBindBuffer(GL_ARRAY_BUFFER, cubeVbo[0]);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(cubeVerts), cubeVerts, GL_STATIC_DRAW);
-	glVertexAttribPointer((GLuint)0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(cubeMesh.verts), cubeMesh.verts, GL_STATIC_DRAW);
+	glVertexAttribPointer((GLuint)0, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(Primitives::Vertex, position));
 	glEnableVertexAttribArray(0);
-
-	glBindBuffer(GL_ARRAY_BUFFER, cubeVbo[1]);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(cubeNorms), cubeNorms, GL_STATIC_DRAW);
-	glVertexAttribPointer((GLuint)1, 3, GL_FLOAT, GL_FALSE, 0, 0);
+	glVertexAttribPointer((GLuint)1, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(Primitives::Vertex, normal));
 	glEnableVertexAttribArray(1);
 
-	glPrimitiveRestartIndex(UCHAR_MAX);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cubeVbo[2]);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(cubeIdx), cubeIdx, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cubeVbo[1]);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(cubeMesh.indices), cubeMesh.indices, GL_STATIC_DRAW);
 
 	glBindVertexArray(0);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
@@ -428,7 +570,7 @@ void setupCube() {
 	linkProgram(cubeProgram);
 }
 void cleanupCube() {
-	glDeleteBuffers(3, cubeVbo);
+	glDeleteBuffers(2, cubeVbo);
 	glDeleteVertexArrays(1, &cubeVao);
 
 	glDeleteProgram(cubeProgram);
@@ -436,27 +578,23 @@ void cleanupCube() {
 	glDeleteShader(cubeShaders[1]);
 	glDeleteShader(cubeShaders[2]);
 }
-void updateCube(const glm::mat4& transform) {
-	objMat = transform;
-}
-void drawCube() {
-	glEnable(GL_PRIMITIVE_RESTART);
+// modelView is the view times the cube's model matrix, combined on the CPU
+void drawCube(const glm::mat4& modelView) {
 	glBindVertexArray(cubeVao);
 	glUseProgram(cubeProgram);
 
 	static float time = 0;
 	time += 0.006;
 
-	glUniformMatrix4fv(glGetUniformLocation(cubeProgram, "objMat"), 1, GL_FALSE, glm::value_ptr(objMat));
-	glUniformMatrix4fv(glGetUniformLocation(cubeProgram, "mv_Mat"), 1, GL_FALSE, glm::value_ptr(RenderVars::_modelView));
-	glUniformMatrix4fv(glGetUniformLocation(cubeProgram, "projMat"), 1, GL_FALSE, glm::value_ptr(RenderVars::_projection));
+	glUniformMatrix4fv(glGetUniformLocation(cubeProgram, "modelView"), 1, GL_FALSE, glm::value_ptr(modelView));
+	glUniformMatrix4fv(glGetUniformLocation(cubeProgram, "mv_Mat"), 1, GL_FALSE, glm::value_ptr(RV::camera.view()));
+	glUniformMatrix4fv(glGetUniformLocation(cubeProgram, "projMat"), 1, GL_FALSE, glm::value_ptr(RV::camera.projection()));
 	glUniform1f(glGetUniformLocation(cubeProgram, "time"), 0.5);
 	glUniform4f(glGetUniformLocation(cubeProgram, "color"), objCol[0], objCol[1], objCol[2], objCol[3]);
-	glDrawElements(GL_TRIANGLE_STRIP, numVerts, GL_UNSIGNED_BYTE, 0);
+	glDrawElements(GL_TRIANGLES, numIndices, GL_UNSIGNED_SHORT, 0);
 
 	glUseProgram(0);
 	glBindVertexArray(0);
-	glDisable(GL_PRIMITIVE_RESTART);
 }
 }
 
@@ -464,48 +602,77 @@ void drawCube() {
 
 namespace Object {
 	GLuint objectVao;
-	GLuint objectVbo[2];
+	GLuint objectVbo[3];
 	GLuint objectShaders[2];
 	GLuint objectProgram;
 	glm::mat4 objMat = glm::mat4(1.f);
-	float k_amb = 0.f;
-	float k_dif = 0.f;
-	float k_spe = 0.f;
+	int numVerts = 0;
+	Materials::Material material;
+	// Edited by the GUI, copied into material through the frame snapshot
+	Materials::MaterialData materialParams;
+	int materialVersion = 0;
 	float light_pos[3] = { 5.f,10.f,0.f };
 	int dollyEffect = 0;
-
-	int spec_pow;
-	glm::vec3 light_col;
+	// The AO bake runs on the workers so it doesn't hold up the first frame;
+	// the mesh shows fully open until the GL thread uploads the result
+	std::vector<glm::vec3> aoVerts, aoNorms;
+	std::vector<unsigned char> aoValues;
+	Jobs::Counter aoBake;
+	std::atomic<bool> aoReady(false);
+	Culling::Bounds bounds;
+	bool visible = true;	// inside the view frustum this frame
+	// Triangles for picking, built by the AO bake job before it bakes
+	MeshBVH meshBVH;
+	std::atomic<bool> bvhReady(false);
+	// Largest triangles of the mesh, rasterized for occlusion culling
+	const int maxOccluderTris = 256;
+	std::vector<glm::vec3> occluderVerts;
 
 	const char* object_vertShader =
 		"#version 330\n\
+invariant gl_Position;\n\
 in vec3 in_Position;\n\
 in vec3 in_Normal;\n\
+in float in_AO;\n\
 out vec4 vert_Normal;\n\
 out vec3 out_Position;\n\
-uniform mat4 objMat;\n\
-uniform mat4 mv_Mat;\n\
-uniform mat4 mvpMat;\n\
+out vec4 vert_LightPos;\n\
+out float vert_AO;\n\
+uniform mat4 modelView;\n\
+uniform mat4 modelViewProj;\n\
+uniform mat4 normalMat;\n\
+uniform mat4 lightMat;\n\
 void main() {\n\
-	gl_Position = mvpMat * objMat * vec4(in_Position, 1.0);\n\
-	vert_Normal = mv_Mat * objMat * vec4(in_Normal, 0.0);\n\
-	out_Position = vec3(mv_Mat * objMat * vec4(in_Position, 1.0));\n\
+	vec4 position = vec4(in_Position, 1.0);\n\
+	gl_Position = modelViewProj * position;\n\
+	vert_Normal = normalMat * vec4(in_Normal, 0.0);\n\
+	out_Position = vec3(modelView * position);\n\
+	vert_LightPos = lightMat * position;\n\
+	vert_AO = in_AO;\n\
 }";
 	const char* object_fragShader =
 		"#version 330\n\
 in vec4 vert_Normal;\n\
 in vec3 out_Position;\n\
+in vec4 vert_LightPos;\n\
+in float vert_AO;\n\
 out vec3 out_Color;\n\
 uniform mat4 mv_Mat;\n\
-uniform vec3 color;\n\
-uniform float k_amb;\n\
-uniform float k_dif;\n\
-uniform float k_spe;\n\
-uniform int spec_pow;\n\
-uniform vec3 light_pos;\n\
-uniform vec3 light_col;\n\
+uniform sampler2DShadow shadowMap;\n\
+uniform bool useShadow;\n\
+layout(std140) uniform MaterialBlock {\n\
+	vec3 color;\n\
+	float k_amb;\n\
+	float k_dif;\n\
+	float k_spe;\n\
+	int spec_pow;\n\
+};\n\
+layout(std140) uniform LightBlock {\n\
+	vec3 light_pos;\n\
+	vec3 light_col;\n\
+	vec3 ambient_col;\n\
+};\n\
 uniform vec3 camera_pos;\n\
-uniform vec3 ambient_col;\n\
 void main() {\n\
 	vec3 l = normalize( vec3(mv_Mat * vec4(light_pos, 1.f)) - out_Position );\n\
 	vec3 dif_color = k_dif * light_col * clamp ( dot( vec3(vert_Normal), l ), 0.f, 1.f );\n\
@@ -515,27 +682,59 @@ void main() {\n\
 	//if(dif_color >= 0.4 && dif_color < 0.5) dif_color = 0.4;\n\
 	//if(dif_color >= 0.5) dif_color = 1;\n\
 \n\
-	vec3 amb_col = ambient_col * k_amb;\n\
+	vec3 amb_col = ambient_col * k_amb * vert_AO;\n\
 \n\
 	vec3 E = normalize( camera_pos - out_Position );\n\
 	vec3 R = reflect( -l, vec3(vert_Normal) );\n\
 	vec3 spec_col = k_spe * light_col * pow( clamp( dot( E, R ), 0.f, 1.f ), spec_pow );\n\
 \n\
-	out_Color = color * (dif_color + amb_col + spec_col);\n\
+	float lit = 1.0;\n\
+	vec3 sc = vert_LightPos.xyz / vert_LightPos.w * 0.5 + 0.5;\n\
+	if (useShadow && sc.z < 1.0) lit = texture(shadowMap, sc);\n\
+\n\
+	out_Color = color * (lit * (dif_color + spec_col) + amb_col);\n\
 }";
+	void uploadAO(void*) {
+		glBindBuffer(GL_ARRAY_BUFFER, objectVbo[2]);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, aoValues.size(), aoValues.data());
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		aoValues = std::vector<unsigned char>();
+		aoReady = true;
+	}
+	void bakeAO(void*) {
+		meshBVH.build(aoVerts);
+		bvhReady = true;
+		aoValues = AOBake::bakeVertexAO(aoVerts, aoNorms, "object.obj.ao");
+		aoVerts = std::vector<glm::vec3>();
+		aoNorms = std::vector<glm::vec3>();
+		// Queued before this job retires, so waiting on aoBake covers the hand-off
+		Jobs::runOnGLThread(&uploadAO, NULL, NULL);
+	}
+
 	void setupObject() {
 		std::vector<glm::vec3> verts, norms;
 		std::vector<glm::vec2> uvs;
 		loadOBJ("object.obj", verts, uvs, norms);
-
-		k_amb = k_dif = .5f;
-		k_spe = 1.f;
-		spec_pow = 30;
-		light_col = { 1.f, 1.f, 1.f };
+		numVerts = (int)verts.size();
+
+		std::vector<unsigned char> ao(verts.size(), 255);
+		bounds = Culling::computeBounds(verts.data(), (int)verts.size());
+		occluderVerts.resize(3 * maxOccluderTris);
+		occluderVerts.resize(Occlusion::selectOccluder(verts.data(), (int)verts.size(), occluderVerts.data(), maxOccluderTris));
+
+		Materials::createMaterial(material);
+		material.data.color = { 0.2f, 0.2f, 0.2f };
+		material.data.k_amb = material.data.k_dif = .5f;
+		material.data.k_spe = 1.f;
+		material.data.spec_pow = 30;
+		materialParams = material.data;
+		Materials::light.light_pos = { light_pos[0], light_pos[1], light_pos[2] };
+		Materials::light.light_col = { 1.f, 1.f, 1.f };
+		Materials::light.ambient_col = { 0.1f, 0.1f, 0.1f };
 
 		glGenVertexArrays(1, &objectVao);
 		glBindVertexArray(objectVao);
-		glGenBuffers(2, objectVbo);
+		glGenBuffers(3, objectVbo);
 
 		glBindBuffer(GL_ARRAY_BUFFER, objectVbo[0]);
 		glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3) * verts.size(), verts.data(), GL_STATIC_DRAW);///////////
@@ -547,6 +746,11 @@ void main() {\n\
 		glVertexAttribPointer((GLuint)1, 3, GL_FLOAT, GL_FALSE, 0, 0);
 		glEnableVertexAttribArray(1);
 
+		glBindBuffer(GL_ARRAY_BUFFER, objectVbo[2]);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(unsigned char) * ao.size(), ao.data(), GL_STATIC_DRAW);
+		glVertexAttribPointer((GLuint)2, 1, GL_UNSIGNED_BYTE, GL_TRUE, 0, 0);
+		glEnableVertexAttribArray(2);
+
 		glBindVertexArray(0);
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
@@ -559,10 +763,22 @@ void main() {\n\
 		glAttachShader(objectProgram, objectShaders[1]);
 		glBindAttribLocation(objectProgram, 0, "in_Position");
 		glBindAttribLocation(objectProgram, 1, "in_Normal");
+		glBindAttribLocation(objectProgram, 2, "in_AO");
 		linkProgram(objectProgram);
+		Materials::bindBlocks(objectProgram);
+
+		aoVerts.swap(verts);
+		aoNorms.swap(norms);
+		Jobs::run(&bakeAO, NULL, &aoBake);
+	}
+	// Blocks until the baked AO is in the vertex buffer, GL thread only
+	void waitForAO() {
+		Jobs::wait(aoBake);
+		Jobs::runGLJobs();
 	}
 	void cleanupObject() {
-		glDeleteBuffers(2, objectVbo);
+		Materials::destroyMaterial(material);
+		glDeleteBuffers(3, objectVbo);
 		glDeleteVertexArrays(1, &objectVao);
 
 		glDeleteProgram(objectProgram);
@@ -572,31 +788,1319 @@ void main() {\n\
 	void updateObject(const glm::mat4& transform) {
 		objMat = transform;
 	}
-	void drawObject() {
+	// The matrices are per draw and combined on the CPU: model view, model view
+	// projection, the normal matrix and model to shadow map clip space
+	void bindObject(const glm::mat4& modelView, const glm::mat4& mvp, const glm::mat4& normalMat, const glm::mat4& toLight) {
 		glBindVertexArray(objectVao);
 		glUseProgram(objectProgram);
 
+		glUniformMatrix4fv(glGetUniformLocation(objectProgram, "modelView"), 1, GL_FALSE, glm::value_ptr(modelView));
+		glUniformMatrix4fv(glGetUniformLocation(objectProgram, "modelViewProj"), 1, GL_FALSE, glm::value_ptr(mvp));
+		glUniformMatrix4fv(glGetUniformLocation(objectProgram, "normalMat"), 1, GL_FALSE, glm::value_ptr(normalMat));
+		glUniformMatrix4fv(glGetUniformLocation(objectProgram, "mv_Mat"), 1, GL_FALSE, glm::value_ptr(RV::camera.view()));
+		Materials::bindMaterial(material);
+		glUniform3f(glGetUniformLocation(objectProgram, "camera_pos"), RV::_cameraPoint.x, RV::_cameraPoint.y, RV::_cameraPoint.z);
+		Shadow::bindShadowMap(objectProgram, 0, toLight);
+	}
+	void drawObject(const glm::mat4& modelView, const glm::mat4& mvp, const glm::mat4& normalMat, const glm::mat4& toLight) {
+		bindObject(modelView, mvp, normalMat, toLight);
+		glDrawArrays(GL_TRIANGLES, 0, numVerts);
+
+		glUseProgram(0);
+		glBindVertexArray(0);
+	}
+}
 
+////////////////////////////////////////////////// SHADOW MAP
+// Depth map seen from the scene light. Rendering it is skipped unless the
+// light or one of the casters moved since the last time it was drawn.
+namespace Shadow {
+	bool enabled = true;
+	bool cacheMap = true;
+	const int mapSize = 2048;
+	const float minLightDistance = 1.f;	// past the 0.5 near plane of the light frustum
+	GLuint shadowFbo;
+	GLuint shadowTex;
+	GLuint shadowShaders[2];
+	GLuint shadowProgram;
+	glm::mat4 lightMat;
+
+	bool valid = false;
+	float cachedLightPos[3];
+	std::vector<glm::mat4> cachedCasters;
+	int numRenders = 0;
+	bool renderedThisFrame = false;
+
+	const char* shadow_vertShader =
+		"#version 330\n\
+in vec3 in_Position;\n\
+uniform mat4 lightMat;\n\
+void main() {\n\
+	gl_Position = lightMat * vec4(in_Position, 1.0);\n\
+}";
+	const char* shadow_fragShader =
+		"#version 330\n\
+void main() {\n\
+}";
 
-		glUniformMatrix4fv(glGetUniformLocation(objectProgram, "objMat"), 1, GL_FALSE, glm::value_ptr(objMat));
-		glUniformMatrix4fv(glGetUniformLocation(objectProgram, "mv_Mat"), 1, GL_FALSE, glm::value_ptr(RenderVars::_modelView));
-		glUniformMatrix4fv(glGetUniformLocation(objectProgram, "mvpMat"), 1, GL_FALSE, glm::value_ptr(RenderVars::_MVP));
-		glUniform3f(glGetUniformLocation(objectProgram, "color"), 0.2, 0.2, 0.2);
+	void setupShadow() {
+		glGenTextures(1, &shadowTex);
+		glBindTexture(GL_TEXTURE_2D, shadowTex);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, mapSize, mapSize, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+		const float border[4] = { 1.f, 1.f, 1.f, 1.f };
+		glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		glGenFramebuffers(1, &shadowFbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, shadowFbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, shadowTex, 0);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			fprintf(stderr, "Shadow framebuffer is incomplete\n");
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, RV::outputFbo);
+
+		shadowShaders[0] = compileShader(shadow_vertShader, GL_VERTEX_SHADER, "shadowVert");
+		shadowShaders[1] = compileShader(shadow_fragShader, GL_FRAGMENT_SHADER, "shadowFrag");
+		shadowProgram = glCreateProgram();
+		glAttachShader(shadowProgram, shadowShaders[0]);
+		glAttachShader(shadowProgram, shadowShaders[1]);
+		glBindAttribLocation(shadowProgram, 0, "in_Position");
+		linkProgram(shadowProgram);
+	}
+	void cleanupShadow() {
+		glDeleteFramebuffers(1, &shadowFbo);
+		glDeleteTextures(1, &shadowTex);
 
-		glUniform1f(glGetUniformLocation(objectProgram, "k_amb"), k_amb);
-		glUniform1f(glGetUniformLocation(objectProgram, "k_dif"), k_dif);
-		glUniform1f(glGetUniformLocation(objectProgram, "k_spe"), k_spe);
-		glUniform1i(glGetUniformLocation(objectProgram, "spec_pow"), spec_pow);
-		glUniform3f(glGetUniformLocation(objectProgram, "light_pos"), light_pos[0], light_pos[1], light_pos[2]);
-		glUniform3f(glGetUniformLocation(objectProgram, "light_col"), light_col[0], light_col[1], light_col[2]);
-		glUniform3f(glGetUniformLocation(objectProgram, "ambient_col"), 0.1f, 0.1f, 0.1f);
-		glUniform3f(glGetUniformLocation(objectProgram, "camera_pos"), RV::_cameraPoint.x, RV::_cameraPoint.y, RV::_cameraPoint.z);
+		glDeleteProgram(shadowProgram);
+		glDeleteShader(shadowShaders[0]);
+		glDeleteShader(shadowShaders[1]);
+	}
 
+	bool isDirty(const glm::mat4& objMat, const glm::mat4* cubeMats, int numCubes) {
+		if (!valid || !cacheMap) return true;
+		if (memcmp(cachedLightPos, &Materials::light.light_pos, sizeof(cachedLightPos)) != 0) return true;
+		if ((int)cachedCasters.size() != numCubes + 1) return true;
+		if (cachedCasters[0] != objMat) return true;
+		for (int i = 0; i < numCubes; i++) {
+			if (cachedCasters[i + 1] != cubeMats[i]) return true;
+		}
+		return false;
+	}
 
-		glDrawArrays(GL_TRIANGLES, 0, 14000); 
+	// Cube casters skip the geometry shader offset, it is a few millimetres at most
+	void renderShadowMap(const glm::mat4& objMat, const glm::mat4* cubeMats, int numCubes) {
+		glm::vec3 lightPos = Materials::light.light_pos;
+		// The light looks at the origin, so it needs some distance to it to have a
+		// direction at all. Closer lights are pushed out, straight up when right on it.
+		float dist = glm::length(lightPos);
+		if (dist < minLightDistance) {
+			lightPos = (dist > 0.f ? lightPos / dist : glm::vec3(0.f, 1.f, 0.f)) * minLightDistance;
+		}
+		glm::vec3 dir = glm::normalize(-lightPos);
+		glm::vec3 up = glm::abs(dir.y) > 0.99f ? glm::vec3(0.f, 0.f, 1.f) : glm::vec3(0.f, 1.f, 0.f);
+		lightMat = glm::perspective(glm::radians(120.f), 1.f, 0.5f, RV::zFar) * glm::lookAt(lightPos, glm::vec3(0.f), up);
+
+		GLint viewport[4];
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		glViewport(0, 0, mapSize, mapSize);
+		glBindFramebuffer(GL_FRAMEBUFFER, shadowFbo);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		glEnable(GL_POLYGON_OFFSET_FILL);
+		glPolygonOffset(2.f, 4.f);
+
+		// Model to light clip space per caster
+		glm::mat4 objLight;
+		BatchMath::mul(lightMat, objMat, objLight);
+		std::vector<glm::mat4> cubeLight(numCubes);
+		BatchMath::mul(lightMat, cubeMats, cubeLight.data(), numCubes);
+
+		glUseProgram(shadowProgram);
+		glBindVertexArray(Object::objectVao);
+		glUniformMatrix4fv(glGetUniformLocation(shadowProgram, "lightMat"), 1, GL_FALSE, glm::value_ptr(objLight));
+		glDrawArrays(GL_TRIANGLES, 0, Object::numVerts);
+
+		glBindVertexArray(Cube::cubeVao);
+		for (int i = 0; i < numCubes; i++) {
+			glUniformMatrix4fv(glGetUniformLocation(shadowProgram, "lightMat"), 1, GL_FALSE, glm::value_ptr(cubeLight[i]));
+			glDrawElements(GL_TRIANGLES, Cube::numIndices, GL_UNSIGNED_SHORT, 0);
+		}
+
+		glBindVertexArray(0);
+		glUseProgram(0);
+		glDisable(GL_POLYGON_OFFSET_FILL);
+		glBindFramebuffer(GL_FRAMEBUFFER, RV::outputFbo);
+		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+		memcpy(cachedLightPos, &Materials::light.light_pos, sizeof(cachedLightPos));
+		cachedCasters.assign(1, objMat);
+		cachedCasters.insert(cachedCasters.end(), cubeMats, cubeMats + numCubes);
+		valid = true;
+		numRenders++;
+	}
+
+	void updateShadowMap(const glm::mat4& objMat, const glm::mat4* cubeMats, int numCubes) {
+		renderedThisFrame = false;
+		if (!enabled) {
+			valid = false;
+			return;
+		}
+		if (isDirty(objMat, cubeMats, numCubes)) {
+			renderShadowMap(objMat, cubeMats, numCubes);
+			renderedThisFrame = true;
+		}
+	}
+
+	// toLight takes the positions the program works with (world or view space) to light clip space
+	void bindShadowMap(GLuint program, GLuint unit, const glm::mat4& toLight) {
+		glActiveTexture(GL_TEXTURE0 + unit);
+		glBindTexture(GL_TEXTURE_2D, shadowTex);
+		glActiveTexture(GL_TEXTURE0);
+		glUniform1i(glGetUniformLocation(program, "shadowMap"), unit);
+		glUniform1i(glGetUniformLocation(program, "useShadow"), enabled ? 1 : 0);
+		glUniformMatrix4fv(glGetUniformLocation(program, "lightMat"), 1, GL_FALSE, glm::value_ptr(toLight));
+	}
+}
+
+////////////////////////////////////////////////// GPU TIMER
+namespace GpuTimer {
+	GLuint timerQueries[2];
+	int frame = 0;
+	float lastMs = 0.f;
+
+	void setupTimer() {
+		glGenQueries(2, timerQueries);
+	}
+	void cleanupTimer() {
+		glDeleteQueries(2, timerQueries);
+	}
+	void beginTimer() {
+		glBeginQuery(GL_TIME_ELAPSED, timerQueries[frame & 1]);
+	}
+	void endTimer() {
+		glEndQuery(GL_TIME_ELAPSED);
+		frame++;
+		if (frame < 2) return;
+		// Read last frame's query, the one we just issued is most likely still in flight
+		GLuint prev = timerQueries[frame & 1];
+		GLint ready = 0;
+		glGetQueryObjectiv(prev, GL_QUERY_RESULT_AVAILABLE, &ready);
+		if (ready) {
+			GLuint64 ns = 0;
+			glGetQueryObjectui64v(prev, GL_QUERY_RESULT, &ns);
+			lastMs = (float)(ns * 1e-6);
+		}
+	}
+}
+
+////////////////////////////////////////////////// VERTEX BENCHMARK
+// Draws the object over and over into a single pixel, so nearly all the time
+// goes to vertex shading: once with the Object program, once with the vertex
+// shader it had when every vertex combined the matrices itself.
+namespace VertexBench {
+	const int numDraws = 100;
+	bool created = false;
+	GLuint legacyShaders[2];
+	GLuint legacyProgram;
+	GLuint query;
+	// Per draw in us, [0] with the legacy program and [1] with the current one.
+	// The wall clock around glFinish is for software rasterizers, whose timer
+	// queries read close to zero.
+	float gpuUs[2] = {}, wallUs[2] = {};
+
+	const char* legacy_vertShader =
+		"#version 330\n\
+invariant gl_Position;\n\
+in vec3 in_Position;\n\
+in vec3 in_Normal;\n\
+in float in_AO;\n\
+out vec4 vert_Normal;\n\
+out vec3 out_Position;\n\
+out vec4 vert_LightPos;\n\
+out float vert_AO;\n\
+uniform mat4 objMat;\n\
+uniform mat4 mv_Mat;\n\
+uniform mat4 mvpMat;\n\
+uniform mat4 lightMat;\n\
+void main() {\n\
+	gl_Position = mvpMat * objMat * vec4(in_Position, 1.0);\n\
+	vert_Normal = mv_Mat * objMat * vec4(in_Normal, 0.0);\n\
+	out_Position = vec3(mv_Mat * objMat * vec4(in_Position, 1.0));\n\
+	vert_LightPos = lightMat * objMat * vec4(in_Position, 1.0);\n\
+	vert_AO = in_AO;\n\
+}";
+
+	void setup() {
+		legacyShaders[0] = compileShader(legacy_vertShader, GL_VERTEX_SHADER, "legacyObjectVert");
+		legacyShaders[1] = compileShader(Object::object_fragShader, GL_FRAGMENT_SHADER, "objectFrag");
+		legacyProgram = glCreateProgram();
+		glAttachShader(legacyProgram, legacyShaders[0]);
+		glAttachShader(legacyProgram, legacyShaders[1]);
+		glBindAttribLocation(legacyProgram, 0, "in_Position");
+		glBindAttribLocation(legacyProgram, 1, "in_Normal");
+		glBindAttribLocation(legacyProgram, 2, "in_AO");
+		linkProgram(legacyProgram);
+		Materials::bindBlocks(legacyProgram);
+		glGenQueries(1, &query);
+		created = true;
+	}
+	void cleanup() {
+		if (!created) return;
+		created = false;
+		glDeleteQueries(1, &query);
+		glDeleteProgram(legacyProgram);
+		glDeleteShader(legacyShaders[0]);
+		glDeleteShader(legacyShaders[1]);
+	}
+
+	// Times numDraws draws with the bound program
+	void timeDraws(int variant) {
+		glDrawArrays(GL_TRIANGLES, 0, Object::numVerts);	// warm up
+		glFinish();
+		Uint64 start = SDL_GetPerformanceCounter();
+		glBeginQuery(GL_TIME_ELAPSED, query);
+		for (int i = 0; i < numDraws; i++) glDrawArrays(GL_TRIANGLES, 0, Object::numVerts);
+		glEndQuery(GL_TIME_ELAPSED);
+		glFinish();
+		double us = (double)(SDL_GetPerformanceCounter() - start) * 1e6 / (double)SDL_GetPerformanceFrequency();
+		GLuint64 ns = 0;
+		glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+		gpuUs[variant] = (float)(ns * 1e-3 / numDraws);
+		wallUs[variant] = (float)(us / numDraws);
+	}
+
+	// Queued with Jobs::runOnGLThread, before a frame clears the framebuffer
+	void run(void*) {
+		if (!created) setup();
+		GLint viewport[4];
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		glViewport(0, 0, 1, 1);
+
+		glm::mat4 modelView, mvp, normalMat, toLight;
+		BatchMath::mul(RV::camera.view(), Object::objMat, modelView);
+		BatchMath::mul(RV::camera.viewProjection(), Object::objMat, mvp);
+		BatchMath::normalMatrix(&modelView, &normalMat, 1);
+		BatchMath::mul(Shadow::lightMat, Object::objMat, toLight);
+		Object::bindObject(modelView, mvp, normalMat, toLight);
+		timeDraws(1);
+
+		glUseProgram(legacyProgram);
+		glUniformMatrix4fv(glGetUniformLocation(legacyProgram, "objMat"), 1, GL_FALSE, glm::value_ptr(Object::objMat));
+		glUniformMatrix4fv(glGetUniformLocation(legacyProgram, "mv_Mat"), 1, GL_FALSE, glm::value_ptr(RV::camera.view()));
+		glUniformMatrix4fv(glGetUniformLocation(legacyProgram, "mvpMat"), 1, GL_FALSE, glm::value_ptr(RV::camera.viewProjection()));
+		Materials::bindMaterial(Object::material);
+		glUniform3f(glGetUniformLocation(legacyProgram, "camera_pos"), RV::_cameraPoint.x, RV::_cameraPoint.y, RV::_cameraPoint.z);
+		Shadow::bindShadowMap(legacyProgram, 0, Shadow::lightMat);
+		timeDraws(0);
 
 		glUseProgram(0);
 		glBindVertexArray(0);
+		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	}
+}
+
+////////////////////////////////////////////////// LATE LATCH
+// Extends the camera drag with the newest mouse reading right before the view
+// is uploaded and measures input to GPU completion latency with and without it.
+namespace LateLatch {
+	bool enabled = true;
+	float inputLatencyMs = 0.f;		// input captured with the snapshot -> frame done on the GPU
+	float latchedLatencyMs = 0.f;	// mouse read right before the camera upload -> frame done on the GPU
+
+	GLuint stampQueries[2];
+	Uint64 inputTicks[2];
+	Uint64 latchTicks[2];
+	double gpuMinusCpuNs[2];
+	double ticksToNs = 0.0;
+	int frame = 0;
+
+	void setupLatch() {
+		glGenQueries(2, stampQueries);
+		ticksToNs = 1e9 / (double)SDL_GetPerformanceFrequency();
+	}
+	void cleanupLatch() {
+		glDeleteQueries(2, stampQueries);
+	}
+
+	// Mouse position and buttons as of the last event the main thread pumped,
+	// packed into one word so the render thread never has to call into SDL for them
+	std::atomic<Uint64> latestMouse(0);
+
+	void publishMouse(int x, int y, Uint32 buttons) {
+		Uint64 packed = (Uint64)(Uint16)x | (Uint64)(Uint16)y << 16 | (Uint64)buttons << 32;
+		latestMouse.store(packed, std::memory_order_release);
+	}
+	Uint32 readMouse(int& x, int& y) {
+		Uint64 packed = latestMouse.load(std::memory_order_acquire);
+		x = (Sint16)(packed & 0xffff);
+		y = (Sint16)(packed >> 16 & 0xffff);
+		return (Uint32)(packed >> 32);
+	}
+
+	Uint32 buttonMask(MouseEvent::Button button) {
+		switch (button) {
+		case MouseEvent::Button::Left: return SDL_BUTTON(SDL_BUTTON_LEFT);
+		case MouseEvent::Button::Middle: return SDL_BUTTON(SDL_BUTTON_MIDDLE);
+		case MouseEvent::Button::Right: return SDL_BUTTON(SDL_BUTTON_RIGHT);
+		default: return 0;
+		}
+	}
+
+	// Reads the latest published mouse state and carries on the drag the snapshot was captured in,
+	// so the camera reflects input up to this point instead of up to the publish
+	void latchCamera(const CameraInput& input, float panv[3], float rota[2]) {
+		int slot = frame & 1;
+		memcpy(panv, input.panv, sizeof(input.panv));
+		memcpy(rota, input.rota, sizeof(input.rota));
+		inputTicks[slot] = input.ticks;
+		latchTicks[slot] = input.ticks;
+		if (enabled && input.dragging) {
+			int x, y;
+			Uint32 buttons = readMouse(x, y);
+			latchTicks[slot] = SDL_GetPerformanceCounter();
+			if (buttons & buttonMask(input.button)) {
+				dragCamera(input.button, x - input.mouseX, y - input.mouseY, panv, rota);
+			}
+		}
+		// Pair both clocks so the timestamp query can be mapped back to CPU time
+		GLint64 gpuNow = 0;
+		glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+		gpuMinusCpuNs[slot] = (double)gpuNow - SDL_GetPerformanceCounter() * ticksToNs;
+	}
+
+	void markFrameEnd() {
+		glQueryCounter(stampQueries[frame & 1], GL_TIMESTAMP);
+		frame++;
+		if (frame < 2) return;
+		// Same as GpuTimer, read back the previous frame's query
+		int prev = frame & 1;
+		GLint ready = 0;
+		glGetQueryObjectiv(stampQueries[prev], GL_QUERY_RESULT_AVAILABLE, &ready);
+		if (ready) {
+			GLuint64 gpuDone = 0;
+			glGetQueryObjectui64v(stampQueries[prev], GL_QUERY_RESULT, &gpuDone);
+			double doneNs = (double)gpuDone - gpuMinusCpuNs[prev];
+			inputLatencyMs = (float)((doneNs - inputTicks[prev] * ticksToNs) * 1e-6);
+			latchedLatencyMs = (float)((doneNs - latchTicks[prev] * ticksToNs) * 1e-6);
+		}
+	}
+}
+
+// Main thread side of the latch, called for every mouse event it pumps
+void GLpublishMouse(int x, int y, Uint32 buttons) {
+	LateLatch::publishMouse(x, y, buttons);
+}
+
+////////////////////////////////////////////////// DEPTH PRE-PASS
+// Lays down depth with a position only program so the Phong pass that follows
+// runs with GL_EQUAL and shades each pixel once. Occlusion queries count the
+// fragments each pass lets through: with early-z and no pre-pass the shading pass
+// would run on everything the pre-pass lets through.
+namespace DepthPrepass {
+	bool enabled = false;
+	GLuint prepassShaders[2];
+	GLuint prepassProgram;
+	GLuint sampleQueries[2][2]; // [frame parity][0: pre-pass, 1: shading pass]
+	int frame = 0;
+	GLuint lastPrepassSamples = 0;
+	GLuint lastShadedSamples = 0;
+
+	const char* prepass_vertShader =
+		"#version 330\n\
+invariant gl_Position;\n\
+in vec3 in_Position;\n\
+uniform mat4 modelViewProj;\n\
+void main() {\n\
+	gl_Position = modelViewProj * vec4(in_Position, 1.0);\n\
+}";
+	const char* prepass_fragShader =
+		"#version 330\n\
+void main() {\n\
+}";
+
+	void setupPrepass() {
+		prepassShaders[0] = compileShader(prepass_vertShader, GL_VERTEX_SHADER, "prepassVert");
+		prepassShaders[1] = compileShader(prepass_fragShader, GL_FRAGMENT_SHADER, "prepassFrag");
+		prepassProgram = glCreateProgram();
+		glAttachShader(prepassProgram, prepassShaders[0]);
+		glAttachShader(prepassProgram, prepassShaders[1]);
+		glBindAttribLocation(prepassProgram, 0, "in_Position");
+		linkProgram(prepassProgram);
+
+		glGenQueries(4, &sampleQueries[0][0]);
+	}
+	void cleanupPrepass() {
+		glDeleteQueries(4, &sampleQueries[0][0]);
+
+		glDeleteProgram(prepassProgram);
+		glDeleteShader(prepassShaders[0]);
+		glDeleteShader(prepassShaders[1]);
+	}
+
+	// Writes Object's depth only, then leaves depth state set up for the shading pass.
+	// mvp must be the one the shading pass uses, so both compute the same depth.
+	void beginPrepass(const glm::mat4& mvp) {
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		glBindVertexArray(Object::objectVao);
+		glUseProgram(prepassProgram);
+		glUniformMatrix4fv(glGetUniformLocation(prepassProgram, "modelViewProj"), 1, GL_FALSE, glm::value_ptr(mvp));
+
+		glBeginQuery(GL_SAMPLES_PASSED, sampleQueries[frame & 1][0]);
+		glDrawArrays(GL_TRIANGLES, 0, Object::numVerts);
+		glEndQuery(GL_SAMPLES_PASSED);
+
+		glUseProgram(0);
+		glBindVertexArray(0);
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+		glDepthFunc(GL_EQUAL);
+		glDepthMask(GL_FALSE);
+		glBeginQuery(GL_SAMPLES_PASSED, sampleQueries[frame & 1][1]);
+	}
+	void endPrepass() {
+		glEndQuery(GL_SAMPLES_PASSED);
+		glDepthMask(GL_TRUE);
+		glDepthFunc(GL_LEQUAL);
+
+		frame++;
+		if (frame < 2) return;
+		GLuint* prev = sampleQueries[frame & 1];
+		GLint ready = 0;
+		glGetQueryObjectiv(prev[1], GL_QUERY_RESULT_AVAILABLE, &ready);
+		if (ready) {
+			glGetQueryObjectuiv(prev[0], GL_QUERY_RESULT, &lastPrepassSamples);
+			glGetQueryObjectuiv(prev[1], GL_QUERY_RESULT, &lastShadedSamples);
+		}
+	}
+}
+
+////////////////////////////////////////////////// DEFERRED
+// G-buffer layout:
+//   0: RG16F  view space normal, octahedral encoded
+//   1: RGBA8  albedo.rgb, k_amb * baked AO
+//   2: RGBA8  k_dif, k_spe, spec_pow / 255, unused
+//   depth: DEPTH_COMPONENT24, view position is rebuilt from it in the light pass
+namespace Deferred {
+	bool enabled = false;
+	// Created the first time deferred shading is switched on; until then
+	// resizes only record the size the G-buffer should have
+	bool created = false;
+	int wantWidth = 0, wantHeight = 0;
+	int gWidth = 0, gHeight = 0;
+	GLuint gFbo;
+	GLuint gTex[3];
+	GLuint gDepth;
+	GLuint quadVao;
+	GLuint geomShaders[2];
+	GLuint geomProgram;
+	GLuint lightShaders[2];
+	GLuint lightProgram;
+	glm::mat4 invProj;
+	unsigned invProjVersion = 0;
+
+	const char* gbuffer_vertShader =
+		"#version 330\n\
+invariant gl_Position;\n\
+in vec3 in_Position;\n\
+in vec3 in_Normal;\n\
+in float in_AO;\n\
+out vec3 vert_Normal;\n\
+out float vert_AO;\n\
+uniform mat4 modelViewProj;\n\
+uniform mat4 normalMat;\n\
+void main() {\n\
+	gl_Position = modelViewProj * vec4(in_Position, 1.0);\n\
+	vert_Normal = vec3(normalMat * vec4(in_Normal, 0.0));\n\
+	vert_AO = in_AO;\n\
+}";
+	const char* gbuffer_fragShader =
+		"#version 330\n\
+in vec3 vert_Normal;\n\
+in float vert_AO;\n\
+out vec2 out_Normal;\n\
+out vec4 out_Albedo;\n\
+out vec4 out_Material;\n\
+layout(std140) uniform MaterialBlock {\n\
+	vec3 color;\n\
+	float k_amb;\n\
+	float k_dif;\n\
+	float k_spe;\n\
+	int spec_pow;\n\
+};\n\
+vec2 octWrap(vec2 v) {\n\
+	return (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);\n\
+}\n\
+void main() {\n\
+	vec3 n = normalize(vert_Normal);\n\
+	n /= abs(n.x) + abs(n.y) + abs(n.z);\n\
+	out_Normal = n.z >= 0.0 ? n.xy : octWrap(n.xy);\n\
+	out_Albedo = vec4(color, k_amb * vert_AO);\n\
+	out_Material = vec4(k_dif, k_spe, float(spec_pow) / 255.0, 0.0);\n\
+}";
+	// Fullscreen triangle generated from gl_VertexID, no vertex buffers needed
+	const char* light_vertShader =
+		"#version 330\n\
+out vec2 vert_UV;\n\
+void main() {\n\
+	vert_UV = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n\
+	gl_Position = vec4(vert_UV * 2.0 - 1.0, 0.0, 1.0);\n\
+}";
+	const char* light_fragShader =
+		"#version 330\n\
+in vec2 vert_UV;\n\
+out vec3 out_Color;\n\
+uniform sampler2D gNormal;\n\
+uniform sampler2D gAlbedo;\n\
+uniform sampler2D gMaterial;\n\
+uniform sampler2D gDepth;\n\
+uniform sampler2DShadow shadowMap;\n\
+uniform bool useShadow;\n\
+uniform mat4 lightMat;\n\
+uniform mat4 invProjMat;\n\
+uniform mat4 mv_Mat;\n\
+layout(std140) uniform LightBlock {\n\
+	vec3 light_pos;\n\
+	vec3 light_col;\n\
+	vec3 ambient_col;\n\
+};\n\
+vec3 octDecode(vec2 f) {\n\
+	vec3 n = vec3(f, 1.0 - abs(f.x) - abs(f.y));\n\
+	float t = clamp(-n.z, 0.0, 1.0);\n\
+	n.x += n.x >= 0.0 ? -t : t;\n\
+	n.y += n.y >= 0.0 ? -t : t;\n\
+	return normalize(n);\n\
+}\n\
+void main() {\n\
+	float depth = texture(gDepth, vert_UV).r;\n\
+	if (depth >= 1.0) discard;\n\
+	gl_FragDepth = depth;\n\
+	vec4 pos = invProjMat * vec4(vec3(vert_UV, depth) * 2.0 - 1.0, 1.0);\n\
+	vec3 P = pos.xyz / pos.w;\n\
+	vec3 N = octDecode(texture(gNormal, vert_UV).rg);\n\
+	vec4 albedo = texture(gAlbedo, vert_UV);\n\
+	vec4 mat = texture(gMaterial, vert_UV);\n\
+\n\
+	vec3 l = normalize( vec3(mv_Mat * vec4(light_pos, 1.0)) - P );\n\
+	vec3 dif_color = mat.r * light_col * clamp( dot( N, l ), 0.0, 1.0 );\n\
+	vec3 amb_col = ambient_col * albedo.a;\n\
+	vec3 E = normalize( -P );\n\
+	vec3 R = reflect( -l, N );\n\
+	vec3 spec_col = mat.g * light_col * pow( clamp( dot( E, R ), 0.0, 1.0 ), mat.b * 255.0 );\n\
+\n\
+	float lit = 1.0;\n\
+	vec4 lp = lightMat * vec4(P, 1.0);\n\
+	vec3 sc = lp.xyz / lp.w * 0.5 + 0.5;\n\
+	if (useShadow && sc.z < 1.0) lit = texture(shadowMap, sc);\n\
+\n\
+	out_Color = albedo.rgb * (lit * (dif_color + spec_col) + amb_col);\n\
+}";
+
+	void resizeGBuffer(int width, int height) {
+		if (width <= 0 || height <= 0) return;
+		wantWidth = width;
+		wantHeight = height;
+		if (!created || (width == gWidth && height == gHeight)) return;
+		gWidth = width;
+		gHeight = height;
+
+		const GLenum internalFormats[3] = { GL_RG16F, GL_RGBA8, GL_RGBA8 };
+		const GLenum formats[3] = { GL_RG, GL_RGBA, GL_RGBA };
+		for (int i = 0; i < 3; i++) {
+			glBindTexture(GL_TEXTURE_2D, gTex[i]);
+			glTexImage2D(GL_TEXTURE_2D, 0, internalFormats[i], width, height, 0, formats[i], GL_UNSIGNED_BYTE, NULL);
+		}
+		glBindTexture(GL_TEXTURE_2D, gDepth);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	void setupDeferred() {
+		StartupTrace::Scope trace("setupDeferred");
+		created = true;
+		glGenFramebuffers(1, &gFbo);
+		glGenTextures(3, gTex);
+		glGenTextures(1, &gDepth);
+		for (int i = 0; i < 3; i++) {
+			glBindTexture(GL_TEXTURE_2D, gTex[i]);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		}
+		glBindTexture(GL_TEXTURE_2D, gDepth);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		resizeGBuffer(wantWidth, wantHeight);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, gFbo);
+		for (int i = 0; i < 3; i++) {
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, gTex[i], 0);
+		}
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, gDepth, 0);
+		const GLenum drawBuffers[3] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+		glDrawBuffers(3, drawBuffers);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			fprintf(stderr, "G-buffer framebuffer is incomplete\n");
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, RV::outputFbo);
+
+		// Core profile needs a VAO bound even if the draw sources no attributes
+		glGenVertexArrays(1, &quadVao);
+
+		geomShaders[0] = compileShader(gbuffer_vertShader, GL_VERTEX_SHADER, "gbufferVert");
+		geomShaders[1] = compileShader(gbuffer_fragShader, GL_FRAGMENT_SHADER, "gbufferFrag");
+		geomProgram = glCreateProgram();
+		glAttachShader(geomProgram, geomShaders[0]);
+		glAttachShader(geomProgram, geomShaders[1]);
+		glBindAttribLocation(geomProgram, 0, "in_Position");
+		glBindAttribLocation(geomProgram, 1, "in_Normal");
+		glBindAttribLocation(geomProgram, 2, "in_AO");
+		glBindFragDataLocation(geomProgram, 0, "out_Normal");
+		glBindFragDataLocation(geomProgram, 1, "out_Albedo");
+		glBindFragDataLocation(geomProgram, 2, "out_Material");
+		linkProgram(geomProgram);
+		Materials::bindBlocks(geomProgram);
+
+		lightShaders[0] = compileShader(light_vertShader, GL_VERTEX_SHADER, "deferredLightVert");
+		lightShaders[1] = compileShader(light_fragShader, GL_FRAGMENT_SHADER, "deferredLightFrag");
+		lightProgram = glCreateProgram();
+		glAttachShader(lightProgram, lightShaders[0]);
+		glAttachShader(lightProgram, lightShaders[1]);
+		linkProgram(lightProgram);
+		Materials::bindBlocks(lightProgram);
+	}
+	void cleanupDeferred() {
+		if (!created) return;
+		created = false;
+		glDeleteFramebuffers(1, &gFbo);
+		glDeleteTextures(3, gTex);
+		glDeleteTextures(1, &gDepth);
+		glDeleteVertexArrays(1, &quadVao);
+
+		glDeleteProgram(geomProgram);
+		glDeleteShader(geomShaders[0]);
+		glDeleteShader(geomShaders[1]);
+		glDeleteProgram(lightProgram);
+		glDeleteShader(lightShaders[0]);
+		glDeleteShader(lightShaders[1]);
+	}
+
+	// Fills the G-buffer with every Phong shaded object in the scene, the
+	// matrices being the object's per draw ones
+	void geometryPass(const glm::mat4& mvp, const glm::mat4& normalMat) {
+		glBindFramebuffer(GL_FRAMEBUFFER, gFbo);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		if (!Object::visible) {
+			glBindFramebuffer(GL_FRAMEBUFFER, RV::outputFbo);
+			return;
+		}
+		if (DepthPrepass::enabled) DepthPrepass::beginPrepass(mvp);
+
+		glBindVertexArray(Object::objectVao);
+		glUseProgram(geomProgram);
+		glUniformMatrix4fv(glGetUniformLocation(geomProgram, "modelViewProj"), 1, GL_FALSE, glm::value_ptr(mvp));
+		glUniformMatrix4fv(glGetUniformLocation(geomProgram, "normalMat"), 1, GL_FALSE, glm::value_ptr(normalMat));
+		Materials::bindMaterial(Object::material);
+		glDrawArrays(GL_TRIANGLES, 0, Object::numVerts);
+
+		glUseProgram(0);
+		glBindVertexArray(0);
+		if (DepthPrepass::enabled) DepthPrepass::endPrepass();
+		glBindFramebuffer(GL_FRAMEBUFFER, RV::outputFbo);
+	}
+
+	// Shades every covered pixel once and writes its depth back so forward
+	// passes drawn afterwards (axis, cubes) still depth test against the scene.
+	// The scene has a single unattenuated light, so one fullscreen pass covers it.
+	void lightingPass() {
+		glBindVertexArray(quadVao);
+		glUseProgram(lightProgram);
+		for (int i = 0; i < 3; i++) {
+			glActiveTexture(GL_TEXTURE0 + i);
+			glBindTexture(GL_TEXTURE_2D, gTex[i]);
+		}
+		glActiveTexture(GL_TEXTURE3);
+		glBindTexture(GL_TEXTURE_2D, gDepth);
+		glUniform1i(glGetUniformLocation(lightProgram, "gNormal"), 0);
+		glUniform1i(glGetUniformLocation(lightProgram, "gAlbedo"), 1);
+		glUniform1i(glGetUniformLocation(lightProgram, "gMaterial"), 2);
+		glUniform1i(glGetUniformLocation(lightProgram, "gDepth"), 3);
+
+		if (invProjVersion != RV::camera.projectionVersion()) {
+			invProj = glm::inverse(RV::camera.projection());
+			invProjVersion = RV::camera.projectionVersion();
+		}
+		glUniformMatrix4fv(glGetUniformLocation(lightProgram, "invProjMat"), 1, GL_FALSE, glm::value_ptr(invProj));
+		glUniformMatrix4fv(glGetUniformLocation(lightProgram, "mv_Mat"), 1, GL_FALSE, glm::value_ptr(RV::camera.view()));
+		Shadow::bindShadowMap(lightProgram, 4, Shadow::lightMat * RV::camera.inverseView());
+
+		glDepthFunc(GL_ALWAYS);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+		glDepthFunc(GL_LEQUAL);
+
+		for (int i = 4; i >= 0; i--) {
+			glActiveTexture(GL_TEXTURE0 + i);
+			glBindTexture(GL_TEXTURE_2D, 0);
+		}
+		glUseProgram(0);
+		glBindVertexArray(0);
+	}
+}
+
+////////////////////////////////////////////////// IMPOSTORS
+// Far copies of the object drawn as camera facing quads. An atlas holds the
+// mesh seen from framesPerSide^2 directions spread over the sphere by an
+// octahedral map, rendered offscreen once; a quad shows the frame nearest its
+// view direction and relights the model space normals stored there. Copies
+// projected smaller than switchPixels use one, at the atlas whose frame size
+// matches their size on screen. Atlases are cached least recently used first
+// under budgetBytes. Impostors skip the shadow map, far copies barely reach it.
+namespace Impostors {
+	bool enabled = true;
+	float switchPixels = 64.f;
+	size_t budgetBytes = 4u << 20;
+	// Created the first time distant copies are switched on
+	bool created = false;
+	const int framesPerSide = 8;
+	const int minFrameSize = 16, maxFrameSize = 128;
+	GLuint bakeFbo;
+	GLuint quadVao;
+	GLuint bakeShaders[2];
+	GLuint bakeProgram;
+	GLuint drawShaders[2];
+	GLuint drawProgram;
+
+	struct Atlas {
+		int frameSize;	// pixels per frame side
+		unsigned version;	// of the mesh it was baked from
+		GLuint normalTex;	// model space normals, alpha is coverage
+		GLuint aoTex;
+		size_t bytes;
+		unsigned lastUsed;	// frame number
+	};
+	std::vector<Atlas> atlases;
+	size_t usedBytes = 0;
+	unsigned frame = 0;
+	int numBakes = 0;
+	int numImpostors = 0, numMeshes = 0;	// drawn last frame
+
+	// One impostor to draw, collected before any is drawn so bakes don't
+	// interrupt the pass
+	struct Quad {
+		GLuint normalTex, aoTex;
+		glm::vec2 frame;
+		int copy;
+		glm::mat4 quadMat;	// quad corners (+-1, +-1) to view space
+	};
+	std::vector<Quad> quads;
+	std::vector<int> meshCopies;
+	std::vector<glm::mat4> modelViews, mvps, normalMats, lightMats;
+
+	const char* bake_vertShader =
+		"#version 330\n\
+in vec3 in_Position;\n\
+in vec3 in_Normal;\n\
+in float in_AO;\n\
+out vec3 vert_Normal;\n\
+out float vert_AO;\n\
+uniform mat4 viewProj;\n\
+void main() {\n\
+	gl_Position = viewProj * vec4(in_Position, 1.0);\n\
+	vert_Normal = in_Normal;\n\
+	vert_AO = in_AO;\n\
+}";
+	const char* bake_fragShader =
+		"#version 330\n\
+in vec3 vert_Normal;\n\
+in float vert_AO;\n\
+out vec4 out_Normal;\n\
+out float out_AO;\n\
+void main() {\n\
+	out_Normal = vec4(normalize(vert_Normal) * 0.5 + 0.5, 1.0);\n\
+	out_AO = vert_AO;\n\
+}";
+	const char* draw_vertShader =
+		"#version 330\n\
+out vec2 vert_UV;\n\
+out vec3 out_Position;\n\
+uniform mat4 quadMat;\n\
+uniform mat4 projMat;\n\
+void main() {\n\
+	vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n\
+	vec4 position = quadMat * vec4(corner * 2.0 - 1.0, 0.0, 1.0);\n\
+	vert_UV = corner;\n\
+	out_Position = position.xyz;\n\
+	gl_Position = projMat * position;\n\
+}";
+	// Same lighting as the object's, so a copy doesn't pop when it switches
+	const char* draw_fragShader =
+		"#version 330\n\
+in vec2 vert_UV;\n\
+in vec3 out_Position;\n\
+out vec3 out_Color;\n\
+uniform sampler2D atlasNormal;\n\
+uniform sampler2D atlasAO;\n\
+uniform vec2 frame;\n\
+uniform float framesPerSide;\n\
+uniform mat4 normalMat;\n\
+uniform mat4 mv_Mat;\n\
+layout(std140) uniform MaterialBlock {\n\
+	vec3 color;\n\
+	float k_amb;\n\
+	float k_dif;\n\
+	float k_spe;\n\
+	int spec_pow;\n\
+};\n\
+layout(std140) uniform LightBlock {\n\
+	vec3 light_pos;\n\
+	vec3 light_col;\n\
+	vec3 ambient_col;\n\
+};\n\
+uniform vec3 camera_pos;\n\
+void main() {\n\
+	vec2 uv = (frame + vert_UV) / framesPerSide;\n\
+	vec4 n = texture(atlasNormal, uv);\n\
+	if (n.a < 0.5) discard;\n\
+	vec3 normal = normalize(vec3(normalMat * vec4(n.xyz * 2.0 - 1.0, 0.0)));\n\
+	float ao = texture(atlasAO, uv).r;\n\
+	vec3 l = normalize( vec3(mv_Mat * vec4(light_pos, 1.f)) - out_Position );\n\
+	vec3 dif_color = k_dif * light_col * clamp( dot( normal, l ), 0.f, 1.f );\n\
+	vec3 amb_col = ambient_col * k_amb * ao;\n\
+	vec3 E = normalize( camera_pos - out_Position );\n\
+	vec3 R = reflect( -l, normal );\n\
+	vec3 spec_col = k_spe * light_col * pow( clamp( dot( E, R ), 0.f, 1.f ), spec_pow );\n\
+	out_Color = color * (dif_color + spec_col + amb_col);\n\
+}";
+
+	// Direction for a point of the octahedral map, uv in [0, 1]^2. The upper
+	// hemisphere fills the inner diamond, the lower one folds into the corners.
+	glm::vec3 octDecode(const glm::vec2& uv) {
+		glm::vec2 f = uv * 2.f - 1.f;
+		glm::vec3 n(f.x, 1.f - std::abs(f.x) - std::abs(f.y), f.y);
+		if (n.y < 0.f) {
+			float x = n.x;
+			n.x = (1.f - std::abs(n.z)) * (x >= 0.f ? 1.f : -1.f);
+			n.z = (1.f - std::abs(x)) * (n.z >= 0.f ? 1.f : -1.f);
+		}
+		return glm::normalize(n);
+	}
+	glm::vec2 octEncode(glm::vec3 d) {
+		d /= std::abs(d.x) + std::abs(d.y) + std::abs(d.z);
+		glm::vec2 f(d.x, d.z);
+		if (d.y < 0.f) {
+			f.x = (1.f - std::abs(d.z)) * (d.x >= 0.f ? 1.f : -1.f);
+			f.y = (1.f - std::abs(d.x)) * (d.z >= 0.f ? 1.f : -1.f);
+		}
+		return f * 0.5f + 0.5f;
+	}
+	// Right and up of a view looking back along dir, as glm::lookAt builds them.
+	// Baking and drawing share it so a frame and its quad line up.
+	void viewBasis(const glm::vec3& dir, glm::vec3& right, glm::vec3& up) {
+		glm::vec3 worldUp = std::abs(dir.y) > 0.99f ? glm::vec3(0.f, 0.f, 1.f) : glm::vec3(0.f, 1.f, 0.f);
+		right = glm::normalize(glm::cross(-dir, worldUp));
+		up = glm::cross(right, -dir);
+	}
+
+	void setupImpostors() {
+		StartupTrace::Scope trace("setupImpostors");
+		created = true;
+		glGenFramebuffers(1, &bakeFbo);
+		glGenVertexArrays(1, &quadVao);
+
+		bakeShaders[0] = compileShader(bake_vertShader, GL_VERTEX_SHADER, "impostorBakeVert");
+		bakeShaders[1] = compileShader(bake_fragShader, GL_FRAGMENT_SHADER, "impostorBakeFrag");
+		bakeProgram = glCreateProgram();
+		glAttachShader(bakeProgram, bakeShaders[0]);
+		glAttachShader(bakeProgram, bakeShaders[1]);
+		glBindAttribLocation(bakeProgram, 0, "in_Position");
+		glBindAttribLocation(bakeProgram, 1, "in_Normal");
+		glBindAttribLocation(bakeProgram, 2, "in_AO");
+		glBindFragDataLocation(bakeProgram, 0, "out_Normal");
+		glBindFragDataLocation(bakeProgram, 1, "out_AO");
+		linkProgram(bakeProgram);
+
+		drawShaders[0] = compileShader(draw_vertShader, GL_VERTEX_SHADER, "impostorVert");
+		drawShaders[1] = compileShader(draw_fragShader, GL_FRAGMENT_SHADER, "impostorFrag");
+		drawProgram = glCreateProgram();
+		glAttachShader(drawProgram, drawShaders[0]);
+		glAttachShader(drawProgram, drawShaders[1]);
+		linkProgram(drawProgram);
+		Materials::bindBlocks(drawProgram);
+	}
+	void releaseAtlas(int i) {
+		glDeleteTextures(1, &atlases[i].normalTex);
+		glDeleteTextures(1, &atlases[i].aoTex);
+		usedBytes -= atlases[i].bytes;
+		atlases.erase(atlases.begin() + i);
+	}
+	void cleanupImpostors() {
+		if (!created) return;
+		created = false;
+		while (!atlases.empty()) releaseAtlas((int)atlases.size() - 1);
+		glDeleteFramebuffers(1, &bakeFbo);
+		glDeleteVertexArrays(1, &quadVao);
+
+		glDeleteProgram(bakeProgram);
+		glDeleteShader(bakeShaders[0]);
+		glDeleteShader(bakeShaders[1]);
+		glDeleteProgram(drawProgram);
+		glDeleteShader(drawShaders[0]);
+		glDeleteShader(drawShaders[1]);
+	}
+
+	// Renders the object into a new atlas, one orthographic view of its bounding
+	// sphere per frame
+	Atlas bake(int frameSize, unsigned version) {
+		int size = frameSize * framesPerSide;
+		Atlas atlas;
+		atlas.frameSize = frameSize;
+		atlas.version = version;
+		atlas.bytes = (size_t)size * size * 5;
+		atlas.lastUsed = frame;
+		glGenTextures(1, &atlas.normalTex);
+		glGenTextures(1, &atlas.aoTex);
+		const GLuint textures[2] = { atlas.normalTex, atlas.aoTex };
+		const GLenum internalFormats[2] = { GL_RGBA8, GL_R8 };
+		const GLenum formats[2] = { GL_RGBA, GL_RED };
+		for (int i = 0; i < 2; i++) {
+			glBindTexture(GL_TEXTURE_2D, textures[i]);
+			glTexImage2D(GL_TEXTURE_2D, 0, internalFormats[i], size, size, 0, formats[i], GL_UNSIGNED_BYTE, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+		GLuint depth;
+		glGenRenderbuffers(1, &depth);
+		glBindRenderbuffer(GL_RENDERBUFFER, depth);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, size, size);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, bakeFbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, atlas.normalTex, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, atlas.aoTex, 0);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+		const GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+		glDrawBuffers(2, drawBuffers);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			fprintf(stderr, "Impostor framebuffer is incomplete\n");
+		}
+		GLint viewport[4];
+		GLfloat clearColor[4];
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+		glViewport(0, 0, size, size);
+		glClearColor(0.f, 0.f, 0.f, 0.f);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+		glm::vec3 center = Object::bounds.center;
+		float r = Object::bounds.radius;
+		glm::mat4 proj = glm::ortho(-r, r, -r, r, r, 3.f * r);
+		glUseProgram(bakeProgram);
+		glBindVertexArray(Object::objectVao);
+		for (int j = 0; j < framesPerSide; j++) {
+			for (int i = 0; i < framesPerSide; i++) {
+				glm::vec3 dir = octDecode(glm::vec2(i, j) / (float)(framesPerSide - 1));
+				glm::vec3 right, up;
+				viewBasis(dir, right, up);
+				glm::mat4 viewProj = proj * glm::lookAt(center + dir * 2.f * r, center, up);
+				glViewport(i * frameSize, j * frameSize, frameSize, frameSize);
+				glUniformMatrix4fv(glGetUniformLocation(bakeProgram, "viewProj"), 1, GL_FALSE, glm::value_ptr(viewProj));
+				glDrawArrays(GL_TRIANGLES, 0, Object::numVerts);
+			}
+		}
+		glBindVertexArray(0);
+		glUseProgram(0);
+
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, 0);
+		glDeleteRenderbuffers(1, &depth);
+		glBindFramebuffer(GL_FRAMEBUFFER, RV::outputFbo);
+		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+		glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+		usedBytes += atlas.bytes;
+		numBakes++;
+		return atlas;
+	}
+
+	// Drops the least recently used atlas not needed this frame, false if none is left
+	bool evictOne() {
+		int oldest = -1;
+		for (int i = 0; i < (int)atlases.size(); i++) {
+			if (atlases[i].lastUsed == frame) continue;
+			if (oldest < 0 || atlases[i].lastUsed < atlases[oldest].lastUsed) oldest = i;
+		}
+		if (oldest < 0) return false;
+		releaseAtlas(oldest);
+		return true;
+	}
+
+	// Atlas with the given frame size for the current mesh, baked on a miss.
+	// False when it can't fit the budget, the copy is then drawn as a mesh.
+	bool acquire(int frameSize, Atlas& out) {
+		// The AO lands after the first frames, atlases baked before are stale
+		unsigned version = Object::aoReady ? 1 : 0;
+		for (int i = 0; i < (int)atlases.size(); i++) {
+			if (atlases[i].frameSize != frameSize) continue;
+			if (atlases[i].version == version) {
+				atlases[i].lastUsed = frame;
+				out = atlases[i];
+				return true;
+			}
+			releaseAtlas(i);
+			break;
+		}
+		int size = frameSize * framesPerSide;
+		size_t bytes = (size_t)size * size * 5;
+		// Evict only if that makes room, atlases used this frame stay
+		size_t inUse = 0;
+		for (const Atlas& a : atlases) {
+			if (a.lastUsed == frame) inUse += a.bytes;
+		}
+		if (inUse + bytes > budgetBytes) return false;
+		while (usedBytes + bytes > budgetBytes) evictOne();
+		out = bake(frameSize, version);
+		atlases.push_back(out);
+		return true;
+	}
+
+	// Draws the visible copies of the object, each as a mesh or an impostor
+	void drawCopies(const glm::mat4* models, const unsigned char* visible, int count) {
+		frame++;
+		while (usedBytes > budgetBytes && evictOne()) {}
+		modelViews.resize(count);
+		mvps.resize(count);
+		normalMats.resize(count);
+		lightMats.resize(count);
+		BatchMath::mul(RV::camera.view(), models, modelViews.data(), count);
+		BatchMath::mul(RV::camera.viewProjection(), models, mvps.data(), count);
+		BatchMath::normalMatrix(modelViews.data(), normalMats.data(), count);
+		BatchMath::mul(Shadow::lightMat, models, lightMats.data(), count);
+
+		// Diameter on screen of a bounding sphere of radius r at view depth z is
+		// about r * proj[1][1] * height / z pixels
+		float pixelScale = RV::camera.projection()[1][1] * (float)RV::height;
+		glm::vec3 eye = RV::camera.position();
+		glm::vec3 center = Object::bounds.center;
+		quads.clear();
+		meshCopies.clear();
+		for (int i = 0; i < count; i++) {
+			if (!visible[i]) continue;
+			glm::vec4 viewCenter = modelViews[i] * glm::vec4(center, 1.f);
+			float radius = Object::bounds.radius * glm::length(glm::vec3(models[i][0]));
+			float pixels = -viewCenter.z > RV::zNear ? radius * pixelScale / -viewCenter.z : FLT_MAX;
+			Atlas atlas;
+			int frameSize = minFrameSize;
+			while (frameSize < pixels && frameSize < maxFrameSize) frameSize *= 2;
+			if (!enabled || pixels >= switchPixels || !acquire(frameSize, atlas)) {
+				meshCopies.push_back(i);
+				continue;
+			}
+			// The camera seen from the copy, in its model space
+			glm::vec3 toEye = glm::normalize(glm::inverse(glm::mat3(models[i])) * (eye - glm::vec3(models[i] * glm::vec4(center, 1.f))));
+			glm::vec2 uv = octEncode(toEye) * (float)(framesPerSide - 1);
+			glm::vec3 right, up;
+			viewBasis(toEye, right, up);
+			Quad q;
+			q.normalTex = atlas.normalTex;
+			q.aoTex = atlas.aoTex;
+			q.frame = glm::vec2(std::floor(uv.x + 0.5f), std::floor(uv.y + 0.5f));
+			q.copy = i;
+			q.quadMat = glm::mat4(modelViews[i] * glm::vec4(right * Object::bounds.radius, 0.f),
+				modelViews[i] * glm::vec4(up * Object::bounds.radius, 0.f), glm::vec4(0.f), viewCenter);
+			quads.push_back(q);
+		}
+		numImpostors = (int)quads.size();
+		numMeshes = (int)meshCopies.size();
+
+		for (int i : meshCopies) Object::drawObject(modelViews[i], mvps[i], normalMats[i], lightMats[i]);
+
+		if (!quads.empty()) {
+			glBindVertexArray(quadVao);
+			glUseProgram(drawProgram);
+			glUniform1i(glGetUniformLocation(drawProgram, "atlasNormal"), 0);
+			glUniform1i(glGetUniformLocation(drawProgram, "atlasAO"), 1);
+			glUniform1f(glGetUniformLocation(drawProgram, "framesPerSide"), (float)framesPerSide);
+			glUniformMatrix4fv(glGetUniformLocation(drawProgram, "projMat"), 1, GL_FALSE, glm::value_ptr(RV::camera.projection()));
+			glUniformMatrix4fv(glGetUniformLocation(drawProgram, "mv_Mat"), 1, GL_FALSE, glm::value_ptr(RV::camera.view()));
+			glUniform3f(glGetUniformLocation(drawProgram, "camera_pos"), RV::_cameraPoint.x, RV::_cameraPoint.y, RV::_cameraPoint.z);
+			Materials::bindMaterial(Object::material);
+			GLuint bound = 0;
+			for (const Quad& q : quads) {
+				if (q.normalTex != bound) {
+					glActiveTexture(GL_TEXTURE1);
+					glBindTexture(GL_TEXTURE_2D, q.aoTex);
+					glActiveTexture(GL_TEXTURE0);
+					glBindTexture(GL_TEXTURE_2D, q.normalTex);
+					bound = q.normalTex;
+				}
+				glUniformMatrix4fv(glGetUniformLocation(drawProgram, "quadMat"), 1, GL_FALSE, glm::value_ptr(q.quadMat));
+				glUniformMatrix4fv(glGetUniformLocation(drawProgram, "normalMat"), 1, GL_FALSE, glm::value_ptr(normalMats[q.copy]));
+				glUniform2f(glGetUniformLocation(drawProgram, "frame"), q.frame.x, q.frame.y);
+				glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+			}
+			glActiveTexture(GL_TEXTURE1);
+			glBindTexture(GL_TEXTURE_2D, 0);
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, 0);
+			glUseProgram(0);
+			glBindVertexArray(0);
+		}
+	}
+}
+
+////////////////////////////////////////////////// SCENE
+// Transforms of everything drawn, owned by the render thread. Nodes that
+// don't move cost nothing per frame.
+namespace Scene {
+	const int numRackCubes = 11;
+	SceneGraph graph;
+	SceneGraph::NodeId objectNode;
+	SceneGraph::NodeId rackNode;
+	SceneGraph::NodeId cubeNodes[numRackCubes];
+
+	// Drawable 0 is the object, the rack cubes follow
+	const int numDrawables = 1 + numRackCubes;
+	// World transforms, gathered when the graph changes them
+	glm::mat4 models[numDrawables];
+	glm::mat4* const cubeMats = models + 1;
+	unsigned gatheredVersion = 0;
+	// Per draw products for the vertex shaders, one batch per frame
+	glm::mat4 modelViews[numDrawables];
+	glm::mat4 mvps[numDrawables];
+	glm::mat4 normalMats[numDrawables];
+	glm::mat4 lightMats[numDrawables];
+	Culling::BoundsSet worldBounds;
+	unsigned char visible[numDrawables];
+	int numVisible = numDrawables;
+	int numOccluded = 0;
+	bool occlusionEnabled = false;
+	unsigned culledCameraVersion = 0, culledGraphVersion = 0;
+	bool culledWithOcclusion = false;
+	float cullMs = 0.f;
+	// Over worldBounds, refit whenever the graph moves something
+	SceneBVH bvh;
+	unsigned pickedId = 0;
+	int pickedDrawable = -1, pickedTriangle = -1;
+	float pickDistance = 0.f;
+	float pickUs = 0.f;
+	// Copies of the object on a ring around the scene, for impostors to stand
+	// in for. Static, and apart from the drawables: not picked or casting.
+	const int numFarCopies = 24;
+	const float farRingRadius = 32.f;
+	bool farCopiesEnabled = false;
+	glm::mat4 farModels[numFarCopies];
+	Culling::BoundsSet farBounds;
+	unsigned char farVisible[numFarCopies];
+
+	void setupScene() {
+		worldBounds.resize(numDrawables);
+		objectNode = graph.create(SceneGraph::invalid, glm::mat4(1.f));
+		rackNode = graph.create(SceneGraph::invalid, glm::translate(glm::mat4(1.f), glm::vec3(-5.f, 9.f, 14.f)));
+		for (int i = 0; i < numRackCubes; i++) {
+			glm::mat4 local = glm::translate(glm::mat4(1.f), glm::vec3(0.f, 0.f, -3.f * i));
+			cubeNodes[i] = graph.create(rackNode, glm::scale(local, glm::vec3(2)));
+		}
+		farBounds.resize(numFarCopies);
+		for (int i = 0; i < numFarCopies; i++) {
+			float angle = glm::two_pi<float>() * i / numFarCopies;
+			glm::mat4 m = glm::translate(glm::mat4(1.f), glm::vec3(std::cos(angle), 0.f, std::sin(angle)) * farRingRadius);
+			// Unscaled: the object shader lights with unnormalized normals
+			farModels[i] = glm::rotate(m, angle * 3.f, glm::vec3(0.f, 1.f, 0.f));
+			farBounds.set(i, Culling::transformBounds(Object::bounds, farModels[i]));
+		}
+	}
+	void cleanupScene() {
+		graph.clear();
+	}
+	void updateScene() {
+		graph.update();
+		if (gatheredVersion == graph.version()) return;
+		models[0] = graph.world(objectNode);
+		Object::updateObject(models[0]);
+		worldBounds.set(0, Culling::transformBounds(Object::bounds, models[0]));
+		for (int i = 0; i < numRackCubes; i++) {
+			cubeMats[i] = graph.world(cubeNodes[i]);
+			worldBounds.set(1 + i, Culling::transformBounds(Cube::bounds, cubeMats[i]));
+		}
+		bvh.refit(worldBounds);
+		gatheredVersion = graph.version();
+	}
+	// Occlusion pass, run by cullScene right after the frustum test. Drawables
+	// that test left hide each other: the object through its occluder
+	// triangles, the cubes as boxes
+	void occlusionCull() {
+		Occlusion::begin(RV::camera.viewProjection());
+		if (visible[0]) Occlusion::addOccluder(Object::objMat, Object::occluderVerts.data(), (int)Object::occluderVerts.size());
+		for (int i = 0; i < numRackCubes; i++) {
+			if (visible[1 + i]) Occlusion::addBox(cubeMats[i], Cube::bounds.center, Cube::bounds.extents);
+		}
+		Occlusion::rasterize();
+		for (int i = 0; i < numDrawables; i++) {
+			if (!visible[i]) continue;
+			glm::vec3 center(worldBounds.cx[i], worldBounds.cy[i], worldBounds.cz[i]);
+			glm::vec3 extents(worldBounds.ex[i], worldBounds.ey[i], worldBounds.ez[i]);
+			if (!Occlusion::testBox(center, extents)) {
+				visible[i] = 0;
+				numOccluded++;
+			}
+		}
+		numVisible -= numOccluded;
+	}
+	// Narrow phase of a pick: the drawable's triangle BVH, in its object space.
+	// The direction isn't renormalized there, so t stays a world distance.
+	bool rayDrawable(void* triHit, int item, const glm::vec3& orig, const glm::vec3& dir, float& tHit) {
+		const MeshBVH* mesh = &Cube::meshBVH;
+		glm::mat4 world = item == 0 ? Object::objMat : cubeMats[item - 1];
+		if (item == 0) {
+			if (!Object::bvhReady) return false;
+			mesh = &Object::meshBVH;
+		}
+		glm::mat4 inv = glm::inverse(world);
+		glm::vec3 o(inv * glm::vec4(orig, 1.f));
+		glm::vec3 d(inv * glm::vec4(dir, 0.f));
+		return mesh->intersect(o, d, 0.f, tHit, tHit, *(int*)triHit);
+	}
+	// Casts the ray under a viewport position against the drawables
+	void pick(const PickRequest& req, int width, int height) {
+		pickedId = req.id;
+		if (width <= 0 || height <= 0) return;
+		Uint64 start = SDL_GetPerformanceCounter();
+		glm::vec3 dir = RV::camera.ray(2.f * req.x / width - 1.f, 1.f - 2.f * req.y / height);
+		int tri = -1;
+		pickedDrawable = bvh.raycast(RV::camera.position(), dir, RV::camera.farPlane(), &rayDrawable, &tri, pickDistance);
+		pickedTriangle = pickedDrawable >= 0 ? tri : -1;
+		pickUs = (float)((double)(SDL_GetPerformanceCounter() - start) * 1e6 / (double)SDL_GetPerformanceFrequency());
+	}
+	// After the camera and the shadow map are up to date for the frame
+	void updateDrawMatrices() {
+		BatchMath::mul(RV::camera.view(), models, modelViews, numDrawables);
+		BatchMath::mul(RV::camera.viewProjection(), models, mvps, numDrawables);
+		BatchMath::normalMatrix(modelViews, normalMats, numDrawables);
+		BatchMath::mul(Shadow::lightMat, models, lightMats, numDrawables);
+	}
+	// Redone only when the camera or something in the scene moved
+	void cullScene() {
+		if (culledCameraVersion == RV::camera.version() && culledGraphVersion == graph.version()
+			&& culledWithOcclusion == occlusionEnabled) return;
+		Uint64 start = SDL_GetPerformanceCounter();
+		numVisible = Culling::cull(RV::camera.frustumPlanes(), worldBounds, visible);
+		numOccluded = 0;
+		if (occlusionEnabled) occlusionCull();
+		culledWithOcclusion = occlusionEnabled;
+		cullMs = (float)((double)(SDL_GetPerformanceCounter() - start) * 1000.0 / (double)SDL_GetPerformanceFrequency());
+		culledCameraVersion = RV::camera.version();
+		culledGraphVersion = graph.version();
+		Object::visible = visible[0] != 0;
+	}
+	void drawFarCopies() {
+		Culling::cull(RV::camera.frustumPlanes(), farBounds, farVisible);
+		Impostors::drawCopies(farModels, farVisible, numFarCopies);
 	}
 }
 
@@ -610,23 +2114,37 @@ void GLinit(int width, int height) {
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_CULL_FACE);
 
-	RV::_projection = glm::perspective(RV::FOV, (float)width / (float)height, RV::zNear, RV::zFar);
+	RV::camera.setPerspective(RV::FOV, RV::zNear, RV::zFar);
+	if (height != 0) RV::camera.setAspect((float)width / (float)height);
+	RV::width = width;
+	RV::height = height;
 
+	StartupTrace::Scope trace("GLinit");
 	// Setup shaders & geometry
-	Axis::setupAxis();
-	Cube::setupCube();
+	{ StartupTrace::Scope t("setupLights"); Materials::setupLights(); }
+	{ StartupTrace::Scope t("setupAxis"); Axis::setupAxis(); }
+	{ StartupTrace::Scope t("setupCube"); Cube::setupCube(); }
 
 
 	/////////////////////////////////////////////////////TODO
 	// Do your init code here
 	// ...
 	// ...
-	Object::setupObject();
+	{ StartupTrace::Scope t("setupObject"); Object::setupObject(); }
+	{ StartupTrace::Scope t("setupShadow"); Shadow::setupShadow(); }
+	{ StartupTrace::Scope t("setupPrepass"); DepthPrepass::setupPrepass(); }
+	// Deferred::setupDeferred runs on first use
+	{ StartupTrace::Scope t("setupTimer"); GpuTimer::setupTimer(); }
+	{ StartupTrace::Scope t("setupLatch"); LateLatch::setupLatch(); }
+	{ StartupTrace::Scope t("setupScene"); Scene::setupScene(); }
 	// ...
 	/////////////////////////////////////////////////////////
 }
 
 void GLcleanup() {
+	Snapshots::cleanup();
+	Object::waitForAO();
+	Materials::cleanupLights();
 	Axis::cleanupAxis();
 	Cube::cleanupCube();
 
@@ -634,72 +2152,364 @@ void GLcleanup() {
 	// Do your cleanup code here
 	// ...
 	Object::cleanupObject();
+	Shadow::cleanupShadow();
+	DepthPrepass::cleanupPrepass();
+	Deferred::cleanupDeferred();
+	Impostors::cleanupImpostors();
+	GpuTimer::cleanupTimer();
+	VertexBench::cleanup();
+	LateLatch::cleanupLatch();
+	Scene::cleanupScene();
 	// ...
 	// ...
 	/////////////////////////////////////////////////////////
 }
 
-float timeCounter = 0;
+// Simulation state, stepped at a fixed rate by GLupdate. GLrender draws a blend
+// of the last two states so motion stays smooth whatever rate frames come at.
+namespace Sim {
+	struct State {
+		float time = 0.f;
+	};
+	State prev, curr;
 
-void GLrender(float dt) {
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	State interpolate(const State& a, const State& b, float alpha) {
+		State s;
+		s.time = a.time + (b.time - a.time) * alpha;
+		return s;
+	}
+}
+
+void GLupdate(float dt) {
+	Sim::prev = Sim::curr;
+	Sim::curr.time += dt;
+}
 
-	
+////////////////////////////////////////////////// SCENE SNAPSHOTS
+// Everything the renderer needs from the update side for one frame. The update
+// thread fills one while the render thread draws the other, so neither side
+// ever reads state the other one is writing.
+struct SceneSnapshot {
+	Sim::State prev, curr;
+	float alpha;
+	int width, height;
+	CameraInput camera;
+	PickRequest pick;
+	int dollyEffect;
+	float light_pos[3];
+	Materials::MaterialData material;
+	int materialVersion;
+	RenderSettings settings;
+
+	// Deep copy of ImGui's draw lists, the originals are reused by the next NewFrame
+	ImDrawData drawData;
+	ImVector<ImDrawList*> drawLists;
+};
 
-	RV::_MVP = RV::_projection * RV::_modelView;
+namespace Snapshots {
+	SceneSnapshot slots[2];
+	std::mutex mutex;
+	std::condition_variable cond;
+	int latest = -1;
+	int reading = -1;
+	unsigned long long published = 0;
+	unsigned long long consumed = 0;
+	bool stopping = false;
+	RenderStats stats;
+
+	void(*imguiRenderFn)(ImDrawData*) = NULL;
+
+	// Render side bookkeeping
+	int appliedWidth = 0, appliedHeight = 0;
+	int appliedMaterialVersion = -1;
+
+	void copyDrawData(SceneSnapshot& snap, const ImDrawData* src) {
+		while (snap.drawLists.Size < src->CmdListsCount) {
+			snap.drawLists.push_back(new ImDrawList());
+		}
+		for (int i = 0; i < src->CmdListsCount; i++) {
+			const ImDrawList* from = src->CmdLists[i];
+			ImDrawList* to = snap.drawLists[i];
+			to->CmdBuffer.resize(from->CmdBuffer.Size);
+			to->IdxBuffer.resize(from->IdxBuffer.Size);
+			to->VtxBuffer.resize(from->VtxBuffer.Size);
+			memcpy(to->CmdBuffer.Data, from->CmdBuffer.Data, from->CmdBuffer.Size * sizeof(ImDrawCmd));
+			memcpy(to->IdxBuffer.Data, from->IdxBuffer.Data, from->IdxBuffer.Size * sizeof(ImDrawIdx));
+			memcpy(to->VtxBuffer.Data, from->VtxBuffer.Data, from->VtxBuffer.Size * sizeof(ImDrawVert));
+		}
+		snap.drawData.Valid = src->Valid;
+		snap.drawData.CmdLists = snap.drawLists.Data;
+		snap.drawData.CmdListsCount = src->CmdListsCount;
+		snap.drawData.TotalVtxCount = src->TotalVtxCount;
+		snap.drawData.TotalIdxCount = src->TotalIdxCount;
+	}
 
-	Axis::drawAxis();
+	void capture(SceneSnapshot& snap, float alpha) {
+		snap.prev = Sim::prev;
+		snap.curr = Sim::curr;
+		snap.alpha = alpha;
+		snap.width = RV::width;
+		snap.height = RV::height;
+		CameraInput& cam = snap.camera;
+		memcpy(cam.panv, RV::panv, sizeof(cam.panv));
+		memcpy(cam.rota, RV::rota, sizeof(cam.rota));
+		cam.mouseX = RV::prevMouse.lastx;
+		cam.mouseY = RV::prevMouse.lasty;
+		cam.button = RV::prevMouse.button;
+		// Only a drag the camera actually followed may be extended, not one ImGui took
+		cam.dragging = RV::mouseTracked && RV::prevMouse.button != MouseEvent::Button::None && !isPickButton(RV::prevMouse.button);
+		cam.ticks = SDL_GetPerformanceCounter();
+		RV::mouseTracked = false;
+		snap.pick = RV::pick;
+		snap.dollyEffect = Object::dollyEffect;
+		memcpy(snap.light_pos, Object::light_pos, sizeof(snap.light_pos));
+		snap.material = Object::materialParams;
+		snap.materialVersion = Object::materialVersion;
+		snap.settings = RV::settings;
+
+		// Finish the ImGui frame here, but leave the GL side of it to the renderer
+		ImGuiIO& io = ImGui::GetIO();
+		if (io.RenderDrawListsFn != NULL) {
+			imguiRenderFn = io.RenderDrawListsFn;
+			io.RenderDrawListsFn = NULL;
+		}
+		ImGui::Render();
+		copyDrawData(snap, ImGui::GetDrawData());
+	}
+
+	// Update side: fills the slot the renderer isn't reading and makes it the latest
+	void publish(float alpha) {
+		std::unique_lock<std::mutex> lk(mutex);
+		int w = latest == 0 ? 1 : 0;
+		cond.wait(lk, [&] { return reading != w || stopping; });
+		if (stopping) return;
+		RV::stats = stats;
+		lk.unlock();
+
+		capture(slots[w], alpha);
+
+		lk.lock();
+		latest = w;
+		published++;
+		cond.notify_all();
+	}
+
+	// Render side: blocks until a snapshot newer than the last one drawn is ready
+	SceneSnapshot* acquire() {
+		std::unique_lock<std::mutex> lk(mutex);
+		cond.wait(lk, [] { return published != consumed || stopping; });
+		if (stopping) return NULL;
+		reading = latest;
+		consumed = published;
+		return &slots[reading];
+	}
+
+	void release(const RenderStats& frameStats) {
+		std::lock_guard<std::mutex> lk(mutex);
+		reading = -1;
+		stats = frameStats;
+		cond.notify_all();
+	}
+
+	void stop() {
+		std::lock_guard<std::mutex> lk(mutex);
+		stopping = true;
+		cond.notify_all();
+	}
+
+	void cleanup() {
+		for (int s = 0; s < 2; s++) {
+			for (int i = 0; i < slots[s].drawLists.Size; i++) {
+				delete slots[s].drawLists[i];
+			}
+			slots[s].drawLists.clear();
+		}
+	}
+}
+
+// Render side: pushes snapshot values into the GL-facing modules
+void applySnapshot(const SceneSnapshot& snap) {
+	if (snap.width != Snapshots::appliedWidth || snap.height != Snapshots::appliedHeight) {
+		resizeViewport(snap.width, snap.height);
+		Snapshots::appliedWidth = snap.width;
+		Snapshots::appliedHeight = snap.height;
+	}
+	if (snap.materialVersion != Snapshots::appliedMaterialVersion) {
+		Object::material.data = snap.material;
+		Object::material.dirty = true;
+		Snapshots::appliedMaterialVersion = snap.materialVersion;
+	}
+	glm::vec3 lightPos(snap.light_pos[0], snap.light_pos[1], snap.light_pos[2]);
+	if (lightPos != Materials::light.light_pos) {
+		Materials::light.light_pos = lightPos;
+		Materials::lightDirty = true;
+	}
+	Deferred::enabled = snap.settings.deferred;
+	if (Deferred::enabled && !Deferred::created) Deferred::setupDeferred();
+	DepthPrepass::enabled = snap.settings.depthPrepass;
+	Shadow::enabled = snap.settings.shadows;
+	Shadow::cacheMap = snap.settings.cacheShadowMap;
+	LateLatch::enabled = snap.settings.lateLatch;
+	Scene::occlusionEnabled = snap.settings.occlusionCulling;
+	Scene::farCopiesEnabled = snap.settings.farCopies;
+	if (Scene::farCopiesEnabled && !Impostors::created) Impostors::setupImpostors();
+	Impostors::enabled = snap.settings.impostors;
+	Impostors::switchPixels = snap.settings.impostorPixels;
+	Impostors::budgetBytes = (size_t)snap.settings.impostorBudgetMB << 20;
+}
+
+void drawSnapshot(const SceneSnapshot& snap) {
+	applySnapshot(snap);
+	Sim::State state = Sim::interpolate(snap.prev, snap.curr, snap.alpha);
+
+	Scene::updateScene();
+	Shadow::updateShadowMap(Object::objMat, Scene::cubeMats, Scene::numRackCubes);
+
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	// The camera is resolved as late as possible, right before its upload, with
+	// the mouse read once more
+	float panv[3], rota[2];
+	LateLatch::latchCamera(snap.camera, panv, rota);
+	// Unchanged parameters leave the camera matrices as they are
+	const glm::vec3 up(0.f, 1.f, 0.f), forward(-1.f, 0.f, 0.f);
+	glm::vec3 position = glm::vec3(15 + 2 * (sin(state.time) * 2 - 1), 8, 0);
+	if (snap.dollyEffect == 1) {
+		RV::camera.setLookAt(position, position + forward, up);
+	}
+	else if (snap.dollyEffect == 2) {
+		glm::vec3 eye(10, 8, 0);
+		RV::camera.setLookAt(eye, eye + forward, up);
+		RV::camera.setPerspective(glm::asin(8 / glm::length(position)) * 2, RV::zNear, RV::zFar);
+	}
+	else if (snap.dollyEffect == 3) {
+		RV::camera.setLookAt(position, position + forward, up);
+		RV::camera.setPerspective(glm::asin(8 / glm::length(position)) * 2, RV::zNear, RV::zFar);
+	}
+	else {
+		RV::camera.setOrbit(glm::vec3(panv[0], panv[1], panv[2]), rota[1], rota[0]);
+		RV::camera.setPerspective(RV::FOV, RV::zNear, RV::zFar);
+	}
+	Materials::updateLights();
+	Scene::cullScene();
+	if (snap.pick.id != Scene::pickedId) Scene::pick(snap.pick, snap.width, snap.height);
+	Scene::updateDrawMatrices();
+
+	GpuTimer::beginTimer();
 
 	/////////////////////////////////////////////////////TODO
 	// Do your render code here
 	// ...
 
-	Object::drawObject();
-
-	for (int i = 0; i < 11; i++) {
-		Cube::updateCube(glm::mat4(1.f));
-		Cube::updateCube(glm::translate(Cube::objMat, glm::vec3(-5.f, 9.f, 14.f - 3*i)));
-		Cube::updateCube(glm::scale(Cube::objMat, glm::vec3(2)));
-		Cube::drawCube();
-	}
-
-	timeCounter += dt;
-	if (Object::dollyEffect == 1) {
-		RV::_modelView = glm::mat4(1.f);
-		glm::vec3 position = glm::vec3(15 + 2 * (sin(timeCounter) * 2 - 1), 8, 0);
-		RV::_modelView = glm::translate(RV::_modelView, position);
-		RV::_modelView = glm::lookAt(position, position + glm::vec3(-1, 0, 0), glm::vec3(0, 1, 0));
-	}
-	else if (Object::dollyEffect == 2) {
-		glm::vec3 position = glm::vec3(15 + 2 * (sin(timeCounter) * 2 - 1), 8, 0);
-		RV::_modelView = glm::translate(RV::_modelView, glm::vec3(10, 8, 0));
-		RV::FOV = glm::asin(8 / glm::length(position)) * 2;
-		RV::_projection = glm::perspective(RV::FOV, (float)4/3, RV::zNear, RV::zFar);
-		RV::_modelView = glm::lookAt(glm::vec3(10, 8, 0), glm::vec3(10, 8, 0) + glm::vec3(-1, 0, 0), glm::vec3(0, 1, 0));
-	}
-	else if (Object::dollyEffect == 3) {
-		RV::_modelView = glm::mat4(1.f);
-		glm::vec3 position = glm::vec3(15 + 2 * (sin(timeCounter) * 2 - 1), 8, 0);
-		RV::_modelView = glm::translate(RV::_modelView, position);
-		RV::_modelView = glm::lookAt(position, position + glm::vec3(-1, 0, 0), glm::vec3(0, 1, 0));
-		RV::FOV = glm::asin(8 / glm::length(position)) * 2;
-		RV::_projection = glm::perspective(RV::FOV, (float)4 / 3, RV::zNear, RV::zFar);
+	if (Deferred::enabled) {
+		Deferred::geometryPass(Scene::mvps[0], Scene::normalMats[0]);
+		Deferred::lightingPass();
 	}
-	else {
-		RV::_modelView = glm::mat4(1.f);
-		RV::_modelView = glm::translate(RV::_modelView, glm::vec3(RV::panv[0], RV::panv[1], RV::panv[2]));
-		RV::_modelView = glm::rotate(RV::_modelView, RV::rota[1], glm::vec3(1.f, 0.f, 0.f));
-		RV::_modelView = glm::rotate(RV::_modelView, RV::rota[0], glm::vec3(0.f, 1.f, 0.f));
-		RV::FOV = glm::radians(75.f);
-		RV::_projection = glm::perspective(RV::FOV, (float)4 / 3, RV::zNear, RV::zFar);
+	else if (Object::visible) {
+		if (DepthPrepass::enabled) DepthPrepass::beginPrepass(Scene::mvps[0]);
+		Object::drawObject(Scene::modelViews[0], Scene::mvps[0], Scene::normalMats[0], Scene::lightMats[0]);
+		if (DepthPrepass::enabled) DepthPrepass::endPrepass();
+	}
+
+	// Drawn after the deferred light pass, which overwrites depth
+	Axis::drawAxis();
+
+	for (int i = 0; i < Scene::numRackCubes; i++) {
+		if (!Scene::visible[1 + i]) continue;
+		Cube::drawCube(Scene::modelViews[1 + i]);
 	}
+	if (Scene::farCopiesEnabled) Scene::drawFarCopies();
+
+	GpuTimer::endTimer();
 
 
 	// ...
 	// ...
 	/////////////////////////////////////////////////////////
+}
+
+// Draws the newest published snapshot, returns false once rendering was stopped
+bool GLrenderLatest() {
+	SceneSnapshot* snap = Snapshots::acquire();
+	if (snap == NULL) return false;
+	Uint64 start = SDL_GetPerformanceCounter();
+	// GL work queued by the job system runs here, on the context owning thread
+	Jobs::runGLJobs();
+	drawSnapshot(*snap);
+	if (Snapshots::imguiRenderFn != NULL) {
+		Snapshots::imguiRenderFn(&snap->drawData);
+	}
+	LateLatch::markFrameEnd();
+	float renderMs = (float)((SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency());
+	FrameStats::reportRender(renderMs, GpuTimer::lastMs);
+
+	RenderStats frameStats;
+	frameStats.gpuMs = GpuTimer::lastMs;
+	frameStats.prepassSamples = DepthPrepass::lastPrepassSamples;
+	frameStats.shadedSamples = DepthPrepass::lastShadedSamples;
+	frameStats.shadowRenders = Shadow::numRenders;
+	frameStats.shadowRedrawn = Shadow::renderedThisFrame;
+	frameStats.uploads = Materials::numUploads;
+	frameStats.inputLatencyMs = LateLatch::inputLatencyMs;
+	frameStats.latchedLatencyMs = LateLatch::latchedLatencyMs;
+	frameStats.visibleDrawables = Scene::numVisible;
+	frameStats.culledDrawables = Scene::numDrawables - Scene::numVisible - Scene::numOccluded;
+	frameStats.occludedDrawables = Scene::numOccluded;
+	frameStats.occluderTriangles = Occlusion::numTriangles();
+	frameStats.cullMs = Scene::cullMs;
+	frameStats.pickedDrawable = Scene::pickedDrawable;
+	frameStats.pickedTriangle = Scene::pickedTriangle;
+	frameStats.pickDistance = Scene::pickDistance;
+	frameStats.pickUs = Scene::pickUs;
+	memcpy(frameStats.vertexGpuUs, VertexBench::gpuUs, sizeof(frameStats.vertexGpuUs));
+	memcpy(frameStats.vertexWallUs, VertexBench::wallUs, sizeof(frameStats.vertexWallUs));
+	frameStats.impostorsDrawn = Scene::farCopiesEnabled ? Impostors::numImpostors : 0;
+	frameStats.meshCopiesDrawn = Scene::farCopiesEnabled ? Impostors::numMeshes : 0;
+	frameStats.impostorAtlases = (int)Impostors::atlases.size();
+	frameStats.impostorAtlasMB = (float)Impostors::usedBytes / (1 << 20);
+	frameStats.impostorBakes = Impostors::numBakes;
+	Snapshots::release(frameStats);
+	return true;
+}
 
-	ImGui::Render();
+// Hands the current update state to the render thread
+void GLpublishFrame(float alpha) {
+	Snapshots::publish(alpha);
+}
+
+void GLstopRendering() {
+	Snapshots::stop();
+}
+
+// False while the main loop may idle until the next input
+bool GLisAnimating() {
+	// A frame still has to show the baked AO once it lands
+	return !RV::settings.renderOnDemand || Object::dollyEffect != 0 || !Object::aoReady;
+}
+
+// Finishes background loading, e.g. so benchmarks don't time half loaded
+// frames. Call from the thread that owns the context.
+void GLwaitForAssets() {
+	Object::waitForAO();
+}
+
+// Redirects rendering into fbo, e.g. for headless runs. Call before GLinit.
+void GLsetOutputFramebuffer(GLuint fbo) {
+	RV::outputFbo = fbo;
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+}
+
+// Scripted camera for benchmark runs, replaces the mouse controlled one
+void GLsetCameraPose(const float panv[3], const float rota[2], int dollyEffect) {
+	memcpy(RV::panv, panv, sizeof(RV::panv));
+	memcpy(RV::rota, rota, sizeof(RV::rota));
+	Object::dollyEffect = dollyEffect;
+}
+
+// Single threaded path: publish and draw right away
+void GLrender(float alpha) {
+	GLpublishFrame(alpha);
+	GLrenderLatest();
 }
 
 void GUI() {
@@ -708,15 +2518,103 @@ void GUI() {
 
 	{
 		ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+		ImGui::Text("GPU scene %.3f ms (%s)", RV::stats.gpuMs, RV::settings.deferred ? "deferred" : "forward");
+		int targetFps = (int)(FramePacer::targetRate() + 0.5);
+		if (ImGui::DragInt("Target FPS", &targetFps, 1.f, 10, 240)) FramePacer::setTargetRate(targetFps);
+		ImGui::Text("Frame %.3f ms, jitter %.3f ms (spin %.2f ms)", FramePacer::frameTimeMeanMs(), FramePacer::frameTimeJitterMs(), FramePacer::spinMarginMs());
+		static double jobOverheadNs = 0.0;
+		if (ImGui::Button("Benchmark jobs")) jobOverheadNs = Jobs::benchmarkOverheadNs(100000);
+		ImGui::SameLine();
+		ImGui::Text("%u workers, %.0f ns/job", Jobs::numWorkers(), jobOverheadNs);
+		static BatchMath::BenchResult mathBench = {};
+		static bool mathBenchRan = false;
+		int mathLevel = (int)BatchMath::level();
+		if (ImGui::Combo("Matrix kernels", &mathLevel, BatchMath::levelNames, (int)BatchMath::detect() + 1)) {
+			BatchMath::setLevel((BatchMath::Level)mathLevel);
+		}
+		ImGui::SameLine();
+		if (ImGui::Button("Benchmark")) {
+			mathBench = BatchMath::benchmark(4096);
+			mathBenchRan = true;
+		}
+		if (mathBenchRan) {
+			for (int k = 0; k < 5; k++) {
+				ImGui::Text("  %-15s glm %6.2f ns, %s %6.2f ns", BatchMath::kernelNames[k], mathBench.glmNs[k], BatchMath::levelNames[mathLevel], mathBench.batchNs[k]);
+				if (mathBench.mismatch[k]) {
+					ImGui::SameLine();
+					ImGui::Text("MISMATCH, off by %g", mathBench.maxError[k]);
+				}
+			}
+		}
+		static double graphFullMs = 0.0, graphPartialMs = 0.0;
+		static int graphRecomputed = 0;
+		if (ImGui::Button("Benchmark scene graph")) graphRecomputed = SceneGraph::benchmark(1000000, 1000, graphFullMs, graphPartialMs);
+		ImGui::SameLine();
+		ImGui::Text("1M nodes %.2f ms, 1000 moved %.3f ms (%d updated)", graphFullMs, graphPartialMs, graphRecomputed);
+		ImGui::Checkbox("Render on demand", &RV::settings.renderOnDemand);
+		ImGui::Checkbox("Late latch camera", &RV::settings.lateLatch);
+		ImGui::SameLine();
+		ImGui::Text("input to GPU %.2f ms (latched %.2f ms)", RV::stats.inputLatencyMs, RV::stats.latchedLatencyMs);
+		ImGui::Text("Frustum culling: %d visible, %d culled (%.3f ms)", RV::stats.visibleDrawables, RV::stats.culledDrawables, RV::stats.cullMs);
+		static double cullBenchMs = 0.0;
+		if (ImGui::Button("Benchmark culling")) cullBenchMs = Culling::benchmark(100000);
+		ImGui::SameLine();
+		ImGui::Text("100k boxes %.3f ms", cullBenchMs);
+		ImGui::Checkbox("Occlusion culling", &RV::settings.occlusionCulling);
+		if (RV::settings.occlusionCulling) {
+			ImGui::SameLine();
+			ImGui::Text("%d occluded, %d occluder triangles", RV::stats.occludedDrawables, RV::stats.occluderTriangles);
+		}
+		ImGui::Checkbox("Pick mode", &RV::settings.pickMode);
+		ImGui::SameLine();
+		if (RV::stats.pickedDrawable < 0) ImGui::Text("nothing picked");
+		else if (RV::stats.pickedDrawable == 0) ImGui::Text("object, triangle %d at %.2f (%.1f us)", RV::stats.pickedTriangle, RV::stats.pickDistance, RV::stats.pickUs);
+		else ImGui::Text("cube %d, triangle %d at %.2f (%.1f us)", RV::stats.pickedDrawable - 1, RV::stats.pickedTriangle, RV::stats.pickDistance, RV::stats.pickUs);
+		static SceneBVH::BenchResult bvhBench = {};
+		if (ImGui::Button("Benchmark BVH")) bvhBench = SceneBVH::benchmark(100000);
+		ImGui::SameLine();
+		ImGui::Text("100k boxes: build %.1f ms, refit %.2f ms, cull %.3f ms (flat %.3f ms), %.0f ns/ray", bvhBench.buildMs, bvhBench.refitMs, bvhBench.cullMs, bvhBench.flatCullMs, bvhBench.rayNs);
+		static double gridBuildMs = 0.0, gridQueryUs = 0.0;
+		if (ImGui::Button("Benchmark hash grid")) SpatialGrid::benchmark(1000000, gridBuildMs, gridQueryUs);
+		ImGui::SameLine();
+		ImGui::Text("1M points: rebuild %.2f ms, radius query %.2f us", gridBuildMs, gridQueryUs);
+		if (ImGui::Button("Benchmark vertex shader")) Jobs::runOnGLThread(&VertexBench::run, NULL, NULL);
+		ImGui::SameLine();
+		ImGui::Text("object draw GPU %.1f us (%.1f per vertex products), wall %.1f us (%.1f)", RV::stats.vertexGpuUs[1], RV::stats.vertexGpuUs[0], RV::stats.vertexWallUs[1], RV::stats.vertexWallUs[0]);
+		ImGui::Checkbox("Distant copies", &RV::settings.farCopies);
+		if (RV::settings.farCopies) {
+			ImGui::SameLine();
+			ImGui::Checkbox("Impostors", &RV::settings.impostors);
+			ImGui::SameLine();
+			ImGui::Text("%d impostors, %d meshes", RV::stats.impostorsDrawn, RV::stats.meshCopiesDrawn);
+			ImGui::DragFloat("Impostor below px", &RV::settings.impostorPixels, 1.f, 0.f, 512.f);
+			ImGui::DragInt("Atlas budget MB", &RV::settings.impostorBudgetMB, 0.1f, 0, 64);
+			ImGui::Text("%d atlases, %.2f MB, %d bakes", RV::stats.impostorAtlases, RV::stats.impostorAtlasMB, RV::stats.impostorBakes);
+		}
+		ImGui::Checkbox("Deferred shading", &RV::settings.deferred);
+		ImGui::Checkbox("Depth pre-pass", &RV::settings.depthPrepass);
+		ImGui::Checkbox("Shadows", &RV::settings.shadows);
+		if (RV::settings.shadows) {
+			ImGui::SameLine();
+			ImGui::Checkbox("Cache shadow map", &RV::settings.cacheShadowMap);
+			ImGui::Text("Shadow map renders: %d%s", RV::stats.shadowRenders, RV::stats.shadowRedrawn ? " (redrawn)" : " (cached)");
+		}
+		if (RV::settings.depthPrepass) {
+			GLuint saved = RV::stats.prepassSamples - RV::stats.shadedSamples;
+			ImGui::Text("Shaded %u of %u fragments (%u saved)", RV::stats.shadedSamples, RV::stats.prepassSamples, saved);
+		}
 
 		/////////////////////////////////////////////////////TODO
 		// Do your GUI code here....
 		// ...
 		// ...
-		ImGui::DragFloat("k Diffuse", &Object::k_dif, 0.005f,0,1);
-		ImGui::DragFloat("k Specular", &Object::k_amb, 0.005f,0,1);
-		ImGui::DragFloat("k Ambiental", &Object::k_spe, 0.005f,0,1);
+		Materials::MaterialData& mat = Object::materialParams;
+		if (ImGui::DragFloat("k Diffuse", &mat.k_dif, 0.005f,0,1)) Object::materialVersion++;
+		if (ImGui::DragFloat("k Specular", &mat.k_spe, 0.005f,0,1)) Object::materialVersion++;
+		if (ImGui::DragFloat("k Ambiental", &mat.k_amb, 0.005f,0,1)) Object::materialVersion++;
+		if (ImGui::DragInt("Specular power", &mat.spec_pow, 0.5f, 1, 255)) Object::materialVersion++;
 		ImGui::DragFloat3("Light Position", Object::light_pos);
+		ImGui::Text("Material/light uploads: %d", RV::stats.uploads);
 		if (ImGui::Button("Dolly Effect")) {
 			Object::dollyEffect++;
 			if (Object::dollyEffect >= 4)
@@ -725,6 +2623,43 @@ void GUI() {
 		// ...
 		/////////////////////////////////////////////////////////
 	}
+	if (ImGui::CollapsingHeader("Startup")) {
+		StartupTrace::Event events[StartupTrace::capacity];
+		int n = StartupTrace::copyEvents(events, StartupTrace::capacity);
+		long long total = StartupTrace::totalNs();
+		if (total >= 0) ImGui::Text("First frame after %.1f ms%s", total * 1e-6, Object::aoReady ? "" : ", AO still baking");
+		ImGui::Columns(2, "startup", false);
+		for (int i = 0; i < n; i++) {
+			ImGui::Text("%*s%s", events[i].depth * 2, "", events[i].name);
+			ImGui::NextColumn();
+			ImGui::Text("%8.3f ms", (events[i].endNs - events[i].startNs) * 1e-6);
+			ImGui::NextColumn();
+		}
+		ImGui::Columns(1);
+	}
+	if (ImGui::CollapsingHeader("Frame stats")) {
+		static FrameStats::Sample samples[FrameStats::capacity];
+		int count = FrameStats::copyRecent(samples, FrameStats::capacity);
+		ImGui::Text("%d frames      mean     p50     p95     p99     max", count);
+		FrameStats::Summary frame = FrameStats::summarize(samples, count, FrameStats::Frame);
+		for (int c = 0; c < FrameStats::NumChannels; c++) {
+			FrameStats::Channel channel = (FrameStats::Channel)c;
+			FrameStats::Summary s = c == FrameStats::Frame ? frame : FrameStats::summarize(samples, count, channel);
+			ImGui::Text("%-8s %7.2f %7.2f %7.2f %7.2f %7.2f", FrameStats::channelNames[c], s.mean, s.p50, s.p95, s.p99, s.max);
+		}
+		ImGui::PlotLines("Frame ms", &samples[0].frameMs, count, 0, NULL, 0.f, FLT_MAX, ImVec2(0, 50), sizeof(FrameStats::Sample));
+		ImGui::PlotLines("CPU ms", &samples[0].cpuMs, count, 0, NULL, 0.f, FLT_MAX, ImVec2(0, 50), sizeof(FrameStats::Sample));
+		ImGui::PlotLines("GPU ms", &samples[0].gpuMs, count, 0, NULL, 0.f, FLT_MAX, ImVec2(0, 50), sizeof(FrameStats::Sample));
+		const int numBins = 32;
+		float bins[numBins];
+		// Twice the p99 keeps the spikes visible without squashing the bulk
+		float range = frame.p99 > 0.f ? 2.f * frame.p99 : 1.f;
+		FrameStats::histogram(samples, count, FrameStats::Frame, range, bins, numBins);
+		char overlay[32];
+		snprintf(overlay, sizeof(overlay), "0 - %.1f ms", range);
+		ImGui::PlotHistogram("Frame histogram", bins, numBins, 0, overlay, 0.f, FLT_MAX, ImVec2(0, 50));
+		if (ImGui::Button("Reset stats")) FrameStats::reset();
+	}
 	// .........................
 
 	ImGui::End();
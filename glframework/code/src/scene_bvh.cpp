@@ -0,0 +1,303 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "scene_bvh.h"
+#include "camera.h"
+#include "bvh_build.h"
+#include "bench_util.h"
+
+namespace {
+	using BVHBuild::Item;
+	using BVHBuild::maxStack;
+	using BVHBuild::safeInverse;
+	using BVHBuild::surfaceArea;
+	// Refitted trees this much costlier than at build time get rebuilt
+	const float rebuildRatio = 1.5f;
+
+	struct Builder {
+		// Items are whole meshes with their own BVH, keep leaves small
+		static const int leafSize = 2;
+		std::vector<Item> work;
+		std::vector<SceneBVH::Node>& nodes;
+
+		Builder(std::vector<SceneBVH::Node>& n) : nodes(n) {}
+
+		void setBounds(int node, const glm::vec3& bmin, const glm::vec3& bmax) {
+			nodes[node].bmin = bmin;
+			nodes[node].bmax = bmax;
+		}
+		void makeLeaf(int node, int begin, int end) {
+			nodes[node].first = begin;
+			nodes[node].count = end - begin;
+		}
+		int makeInner(int node) {
+			int left = (int)nodes.size();
+			nodes.resize(left + 2);
+			nodes[node].first = left;
+			nodes[node].count = 0;
+			return left;
+		}
+	};
+
+	// Entry distance along the ray, from its origin on
+	inline float rayBox(const glm::vec3& bmin, const glm::vec3& bmax, const glm::vec3& orig, const glm::vec3& invDir, float tmax) {
+		return BVHBuild::rayBox(bmin, bmax, orig, invDir, 0.f, tmax);
+	}
+
+	// Clears the bits of planes the box is fully inside of; false if it is
+	// fully outside one of them
+	inline bool boxInPlanes(const glm::vec4* planes, const glm::vec3& bmin, const glm::vec3& bmax, int& mask) {
+		glm::vec3 c = (bmin + bmax) * 0.5f;
+		glm::vec3 e = (bmax - bmin) * 0.5f;
+		for (int p = 0; p < Camera::NumPlanes; p++) {
+			if (!(mask & (1 << p))) continue;
+			glm::vec3 n(planes[p]);
+			float d = glm::dot(n, c) + planes[p].w;
+			float r = glm::dot(glm::abs(n), e);
+			if (d + r < 0.f) return false;
+			if (d - r >= 0.f) mask &= ~(1 << p);
+		}
+		return true;
+	}
+
+	// Culling::cull's item test on the planes left in mask: each plane against
+	// whichever of the box and the sphere reaches less far across it
+	inline bool itemInPlanes(const glm::vec4* planes, const glm::vec3& bmin, const glm::vec3& bmax, float radius, int mask) {
+		glm::vec3 c = (bmin + bmax) * 0.5f;
+		glm::vec3 e = (bmax - bmin) * 0.5f;
+		for (int p = 0; p < Camera::NumPlanes; p++) {
+			if (!(mask & (1 << p))) continue;
+			glm::vec3 n(planes[p]);
+			float d = glm::dot(n, c) + planes[p].w;
+			float r = std::min(glm::dot(glm::abs(n), e), radius);
+			if (d + r < 0.f) return false;
+		}
+		return true;
+	}
+
+	// Benchmark narrow phase: the item's own box
+	bool rayItemBox(void* user, int item, const glm::vec3& orig, const glm::vec3& dir, float& tHit) {
+		const Culling::BoundsSet& set = *(const Culling::BoundsSet*)user;
+		glm::vec3 c(set.cx[item], set.cy[item], set.cz[item]);
+		glm::vec3 e(set.ex[item], set.ey[item], set.ez[item]);
+		float t = rayBox(c - e, c + e, orig, safeInverse(dir), tHit);
+		if (t == FLT_MAX) return false;
+		tHit = t;
+		return true;
+	}
+}
+
+void SceneBVH::build(const Culling::BoundsSet& set) {
+	nodes.clear();
+	items.clear();
+	itemMin.clear();
+	itemMax.clear();
+	itemRadius.clear();
+	int count = set.size();
+	if (count == 0) return;
+
+	Builder b(nodes);
+	b.work.resize(count);
+	for (int i = 0; i < count; i++) {
+		glm::vec3 c(set.cx[i], set.cy[i], set.cz[i]);
+		glm::vec3 e(set.ex[i], set.ey[i], set.ez[i]);
+		b.work[i].bmin = c - e;
+		b.work[i].bmax = c + e;
+		b.work[i].centroid = c;
+		b.work[i].idx = i;
+	}
+	nodes.reserve(2 * count / Builder::leafSize + 1);
+	nodes.resize(1);
+	BVHBuild::build(b, b.work.data(), 0, 0, count, 0);
+
+	items.resize(count);
+	itemMin.resize(count);
+	itemMax.resize(count);
+	itemRadius.resize(count);
+	for (int s = 0; s < count; s++) {
+		items[s] = b.work[s].idx;
+		itemMin[s] = b.work[s].bmin;
+		itemMax[s] = b.work[s].bmax;
+		itemRadius[s] = set.radius[items[s]];
+	}
+	builtCost = cost();
+}
+
+bool SceneBVH::refit(const Culling::BoundsSet& set) {
+	if (set.size() != numItems()) {
+		build(set);
+		return true;
+	}
+	for (int s = 0; s < numItems(); s++) {
+		int i = items[s];
+		glm::vec3 c(set.cx[i], set.cy[i], set.cz[i]);
+		glm::vec3 e(set.ex[i], set.ey[i], set.ez[i]);
+		itemMin[s] = c - e;
+		itemMax[s] = c + e;
+		itemRadius[s] = set.radius[i];
+	}
+	// Children always come after their parent, so a reverse sweep is bottom up
+	for (int n = (int)nodes.size() - 1; n >= 0; n--) {
+		Node& node = nodes[n];
+		glm::vec3 bmin(FLT_MAX), bmax(-FLT_MAX);
+		if (node.count > 0) {
+			for (int s = node.first; s < node.first + node.count; s++) {
+				bmin = glm::min(bmin, itemMin[s]);
+				bmax = glm::max(bmax, itemMax[s]);
+			}
+		}
+		else {
+			bmin = glm::min(nodes[node.first].bmin, nodes[node.first + 1].bmin);
+			bmax = glm::max(nodes[node.first].bmax, nodes[node.first + 1].bmax);
+		}
+		node.bmin = bmin;
+		node.bmax = bmax;
+	}
+	if (cost() > rebuildRatio * builtCost) {
+		build(set);
+		return true;
+	}
+	return false;
+}
+
+// SAH cost of the whole tree relative to its root box
+float SceneBVH::cost() const {
+	if (nodes.empty()) return 0.f;
+	float sum = 0.f;
+	for (size_t n = 0; n < nodes.size(); n++) {
+		float area = surfaceArea(nodes[n].bmin, nodes[n].bmax);
+		sum += nodes[n].count > 0 ? area * nodes[n].count : area;
+	}
+	float rootArea = surfaceArea(nodes[0].bmin, nodes[0].bmax);
+	return rootArea > 0.f ? sum / rootArea : 0.f;
+}
+
+int SceneBVH::raycast(const glm::vec3& orig, const glm::vec3& dir, float tmax, ItemRay test, void* user, float& tHit) const {
+	if (nodes.empty()) return -1;
+	glm::vec3 invDir = safeInverse(dir);
+	float closest = tmax;
+	int hit = -1;
+
+	int stack[maxStack];
+	int sp = 0;
+	if (rayBox(nodes[0].bmin, nodes[0].bmax, orig, invDir, closest) == FLT_MAX) return -1;
+	stack[sp++] = 0;
+	while (sp > 0) {
+		const Node& n = nodes[stack[--sp]];
+		if (n.count > 0) {
+			// Nearest box first, so the farther one is often skipped
+			int slots[Builder::leafSize];
+			float enter[Builder::leafSize];
+			int numSlots = 0;
+			for (int s = n.first; s < n.first + n.count; s++) {
+				float t = rayBox(itemMin[s], itemMax[s], orig, invDir, closest);
+				if (t == FLT_MAX) continue;
+				int k = numSlots++;
+				for (; k > 0 && enter[k - 1] > t; k--) {
+					slots[k] = slots[k - 1];
+					enter[k] = enter[k - 1];
+				}
+				slots[k] = s;
+				enter[k] = t;
+			}
+			for (int k = 0; k < numSlots; k++) {
+				if (enter[k] >= closest) break;
+				if (test(user, items[slots[k]], orig, dir, closest)) hit = items[slots[k]];
+			}
+			continue;
+		}
+		const Node& a = nodes[n.first];
+		const Node& b = nodes[n.first + 1];
+		float d0 = rayBox(a.bmin, a.bmax, orig, invDir, closest);
+		float d1 = rayBox(b.bmin, b.bmax, orig, invDir, closest);
+		// Push the far child first so the near one is visited next
+		if (d0 <= d1) {
+			if (d1 != FLT_MAX) stack[sp++] = n.first + 1;
+			if (d0 != FLT_MAX) stack[sp++] = n.first;
+		}
+		else {
+			if (d0 != FLT_MAX) stack[sp++] = n.first;
+			stack[sp++] = n.first + 1;
+		}
+	}
+	if (hit >= 0) tHit = closest;
+	return hit;
+}
+
+int SceneBVH::cull(const glm::vec4* planes, unsigned char* visible) const {
+	memset(visible, 0, items.size());
+	if (nodes.empty()) return 0;
+	const int allPlanes = (1 << Camera::NumPlanes) - 1;
+	int numVisible = 0;
+
+	struct Entry { int node, mask; };
+	Entry stack[maxStack];
+	int sp = 0;
+	stack[sp++] = { 0, allPlanes };
+	while (sp > 0) {
+		Entry e = stack[--sp];
+		const Node& n = nodes[e.node];
+		int mask = e.mask;
+		if (mask != 0 && !boxInPlanes(planes, n.bmin, n.bmax, mask)) continue;
+		if (n.count > 0) {
+			for (int s = n.first; s < n.first + n.count; s++) {
+				if (mask != 0 && !itemInPlanes(planes, itemMin[s], itemMax[s], itemRadius[s], mask)) continue;
+				visible[items[s]] = 1;
+				numVisible++;
+			}
+			continue;
+		}
+		stack[sp++] = { n.first + 1, mask };
+		stack[sp++] = { n.first, mask };
+	}
+	return numVisible;
+}
+
+SceneBVH::BenchResult SceneBVH::benchmark(int count) {
+	using BenchUtil::Clock;
+	using BenchUtil::msSince;
+	Camera camera;
+	Culling::setBenchmarkView(camera);
+	Culling::BoundsSet set = Culling::randomBounds(count, 2463534242u);
+	BenchUtil::Random rnd(0x9e3779b9u);
+
+	BenchResult r;
+	SceneBVH bvh;
+	Clock::time_point start = Clock::now();
+	bvh.build(set);
+	r.buildMs = msSince(start);
+
+	// Everything drifts a little, as with a frame of animation
+	for (int i = 0; i < count; i++) {
+		set.cx[i] += rnd.unit() - 0.5f;
+		set.cy[i] += rnd.unit() - 0.5f;
+		set.cz[i] += rnd.unit() - 0.5f;
+	}
+	start = Clock::now();
+	bvh.refit(set);
+	r.refitMs = msSince(start);
+
+	const int runs = 20;
+	std::vector<unsigned char> visible(count);
+	bvh.cull(camera.frustumPlanes(), visible.data());
+	start = Clock::now();
+	for (int k = 0; k < runs; k++) bvh.cull(camera.frustumPlanes(), visible.data());
+	r.cullMs = msSince(start) / runs;
+	start = Clock::now();
+	for (int k = 0; k < runs; k++) Culling::cull(camera.frustumPlanes(), set, visible.data());
+	r.flatCullMs = msSince(start) / runs;
+
+	const int numRays = 10000;
+	glm::vec3 orig = camera.position();
+	start = Clock::now();
+	for (int k = 0; k < numRays; k++) {
+		glm::vec3 dir = camera.ray(rnd.unit() * 2.f - 1.f, rnd.unit() * 2.f - 1.f);
+		float t;
+		bvh.raycast(orig, dir, camera.farPlane() * 2.f, &rayItemBox, &set, t);
+	}
+	r.rayNs = msSince(start) * 1e6 / numRays;
+	return r;
+}
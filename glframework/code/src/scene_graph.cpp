@@ -0,0 +1,128 @@
+#include <glm/gtc/matrix_transform.hpp>
+#include <cassert>
+#include <cstdint>
+
+#include "scene_graph.h"
+#include "batch_math.h"
+#include "job_system.h"
+#include "bench_util.h"
+
+namespace {
+	const unsigned none = SceneGraph::invalid;
+	// Below this many dirty nodes a level isn't worth spreading over the workers
+	const int parallelGrain = 2048;
+}
+
+void SceneGraph::markDirty(Level& level, unsigned i) {
+	if (level.dirty[i]) return;
+	level.dirty[i] = 1;
+	level.queued.push_back(i);
+}
+
+SceneGraph::NodeId SceneGraph::create(NodeId parentId, const glm::mat4& localMat) {
+	int d = parentId == invalid ? 0 : depth(parentId) + 1;
+	if ((int)levels.size() <= d) levels.resize(d + 1);
+	Level& level = levels[d];
+	unsigned i = (unsigned)level.local.size();
+	// Depth and index have to fit their bits of the id, and the very last id is invalid
+	assert(d < (1 << (32 - indexBits)));
+	assert(i < (1u << indexBits) && makeId(d, i) != invalid);
+	level.local.push_back(localMat);
+	level.world.push_back(localMat);
+	level.firstChild.push_back(none);
+	level.dirty.push_back(0);
+	if (parentId == invalid) {
+		level.parent.push_back(none);
+		level.nextSibling.push_back(none);
+	}
+	else {
+		Level& up = levels[d - 1];
+		unsigned p = index(parentId);
+		level.parent.push_back(p);
+		level.nextSibling.push_back(up.firstChild[p]);
+		up.firstChild[p] = i;
+	}
+	markDirty(level, i);
+	return makeId(d, i);
+}
+
+void SceneGraph::setLocal(NodeId node, const glm::mat4& localMat) {
+	Level& level = levels[depth(node)];
+	unsigned i = index(node);
+	level.local[i] = localMat;
+	markDirty(level, i);
+}
+
+void SceneGraph::clear() {
+	levels.clear();
+	changedNodes.clear();
+}
+
+SceneGraph::NodeId SceneGraph::parent(NodeId node) const {
+	int d = depth(node);
+	unsigned p = levels[d].parent[index(node)];
+	return p == none ? invalid : makeId(d - 1, p);
+}
+
+size_t SceneGraph::size() const {
+	size_t n = 0;
+	for (const Level& level : levels) n += level.local.size();
+	return n;
+}
+
+int SceneGraph::update() {
+	changedNodes.clear();
+	for (size_t d = 0; d < levels.size(); d++) {
+		Level& level = levels[d];
+		if (level.queued.empty()) continue;
+		const glm::mat4* parentWorld = d > 0 ? levels[d - 1].world.data() : NULL;
+		Jobs::parallelFor(0, (int)level.queued.size(), parallelGrain, [&](int begin, int end) {
+			for (int k = begin; k < end; k++) {
+				unsigned i = level.queued[k];
+				if (parentWorld != NULL) BatchMath::mul(parentWorld[level.parent[i]], level.local[i], level.world[i]);
+				else level.world[i] = level.local[i];
+				level.dirty[i] = 0;
+			}
+		});
+		// Children inherit the change, the next level picks them up
+		for (unsigned i : level.queued) {
+			changedNodes.push_back(makeId((int)d, i));
+			if (level.firstChild[i] == none) continue;
+			Level& down = levels[d + 1];
+			for (unsigned c = level.firstChild[i]; c != none; c = down.nextSibling[c]) {
+				markDirty(down, c);
+			}
+		}
+		level.queued.clear();
+	}
+	if (!changedNodes.empty()) updateVersion++;
+	return (int)changedNodes.size();
+}
+
+int SceneGraph::benchmark(int numNodes, int numChanged, double& fullMs, double& partialMs) {
+	// Ten children per node: 1M nodes are six levels deep
+	SceneGraph graph;
+	std::vector<NodeId> nodes;
+	nodes.reserve(numNodes);
+	glm::mat4 offset = glm::translate(glm::mat4(1.f), glm::vec3(1.f, 0.f, 0.f));
+	nodes.push_back(graph.create(invalid, glm::mat4(1.f)));
+	for (size_t p = 0; (int)nodes.size() < numNodes; p++) {
+		for (int c = 0; c < 10 && (int)nodes.size() < numNodes; c++) {
+			nodes.push_back(graph.create(nodes[p], offset));
+		}
+	}
+
+	auto start = BenchUtil::Clock::now();
+	graph.update();
+	fullMs = BenchUtil::msSince(start);
+
+	BenchUtil::Random rnd(0x9e3779b9u);
+	glm::mat4 moved = glm::translate(glm::mat4(1.f), glm::vec3(0.f, 1.f, 0.f));
+	for (int i = 0; i < numChanged; i++) {
+		graph.setLocal(nodes[rnd.next() % nodes.size()], moved);
+	}
+	start = BenchUtil::Clock::now();
+	int recomputed = graph.update();
+	partialMs = BenchUtil::msSince(start);
+	return recomputed;
+}
@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <cmath>
+
+#include "spatial_grid.h"
+#include "job_system.h"
+#include "bench_util.h"
+
+namespace {
+	const int grain = 16384;
+	const int maxChunks = 64;
+	// Top bits of the bucket index that pick the first level bin
+	const int coarseBits = 10;
+	// 21 bits per packed cell coordinate, centered on 0
+	const int keyBits = 21;
+	const int keyBias = 1 << (keyBits - 1);
+	const uint64_t keyMask = (1u << keyBits) - 1;
+
+	inline int cellCoord(float v, float invCell) {
+		float c = std::floor(v * invCell);
+		return (int)std::max(std::min(c, (float)(keyBias - 1)), (float)-keyBias);
+	}
+}
+
+SpatialGrid::SpatialGrid(float cellSize) : mask(0) {
+	setCellSize(cellSize);
+}
+
+uint64_t SpatialGrid::keyOf(int x, int y, int z) const {
+	return ((uint64_t)(x + keyBias) & keyMask) | (((uint64_t)(y + keyBias) & keyMask) << keyBits)
+		| (((uint64_t)(z + keyBias) & keyMask) << (2 * keyBits));
+}
+
+unsigned SpatialGrid::bucketOf(int x, int y, int z) const {
+	// Teschner et al. with a final mix, the table only keeps the low bits
+	unsigned h = ((unsigned)x * 73856093u) ^ ((unsigned)y * 19349663u) ^ ((unsigned)z * 83492791u);
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+	return h & mask;
+}
+
+void SpatialGrid::build(const glm::vec3* points, int count) {
+	int tableBits = 0;
+	while ((1 << tableBits) < count) tableBits++;
+	unsigned tableSize = 1u << tableBits;
+	mask = tableSize - 1;
+	int binBits = std::min(tableBits, coarseBits);
+	int numBins = 1 << binBits;
+	int shift = tableBits - binBits;
+	int numChunks = std::max(1, std::min(maxChunks, count / grain));
+	keys.resize(count);
+	buckets.resize(count);
+	binned.resize(count);
+	binnedBucket.resize(count);
+	entries.resize(count);
+	bucketStart.resize(tableSize + 1);
+	binStart.resize(numBins + 1);
+	chunkOffsets.assign(numChunks * numBins, 0);
+	auto chunkRange = [&](int c, int& begin, int& end) {
+		begin = (int)((long long)count * c / numChunks);
+		end = (int)((long long)count * (c + 1) / numChunks);
+	};
+
+	// Two level counting sort without atomics. First the points go to coarse
+	// bins of the table's top bits, each chunk counting and then writing into
+	// its own ranges; then every bin sorts its points into their buckets while
+	// they are in cache. Both passes read sequentially, and the order comes
+	// out the same every time.
+	Jobs::parallelFor(0, numChunks, 1, [&](int first, int last) {
+		for (int c = first; c < last; c++) {
+			int begin, end;
+			chunkRange(c, begin, end);
+			int* hist = &chunkOffsets[c * numBins];
+			for (int i = begin; i < end; i++) {
+				int x = cellCoord(points[i].x, invCell);
+				int y = cellCoord(points[i].y, invCell);
+				int z = cellCoord(points[i].z, invCell);
+				keys[i] = keyOf(x, y, z);
+				buckets[i] = bucketOf(x, y, z);
+				hist[buckets[i] >> shift]++;
+			}
+		}
+	});
+	int offset = 0;
+	for (int bin = 0; bin < numBins; bin++) {
+		binStart[bin] = offset;
+		for (int c = 0; c < numChunks; c++) {
+			int n = chunkOffsets[c * numBins + bin];
+			chunkOffsets[c * numBins + bin] = offset;
+			offset += n;
+		}
+	}
+	binStart[numBins] = count;
+	Jobs::parallelFor(0, numChunks, 1, [&](int first, int last) {
+		for (int c = first; c < last; c++) {
+			int begin, end;
+			chunkRange(c, begin, end);
+			int* cursor = &chunkOffsets[c * numBins];
+			for (int i = begin; i < end; i++) {
+				int j = cursor[buckets[i] >> shift]++;
+				Entry& e = binned[j];
+				e.x = points[i].x;
+				e.y = points[i].y;
+				e.z = points[i].z;
+				e.index = i;
+				e.cell = keys[i];
+				binnedBucket[j] = buckets[i];
+			}
+		}
+	});
+	Jobs::parallelFor(0, numBins, 1, [&](int first, int last) {
+		for (int bin = first; bin < last; bin++) {
+			int* start = &bucketStart[(size_t)bin << shift];
+			int numBuckets = 1 << shift;
+			for (int b = 0; b < numBuckets; b++) start[b] = 0;
+			for (int j = binStart[bin]; j < binStart[bin + 1]; j++) start[binnedBucket[j] & (numBuckets - 1)]++;
+			int next = binStart[bin];
+			for (int b = 0; b < numBuckets; b++) {
+				int n = start[b];
+				start[b] = next;
+				next += n;
+			}
+			// Fill in order, advancing each bucket's start and shifting it back after
+			for (int j = binStart[bin]; j < binStart[bin + 1]; j++) {
+				entries[start[binnedBucket[j] & (numBuckets - 1)]++] = binned[j];
+			}
+			for (int b = numBuckets - 1; b > 0; b--) start[b] = start[b - 1];
+			start[0] = binStart[bin];
+		}
+	});
+	bucketStart[tableSize] = count;
+}
+
+// Calls test on the points of every cell overlapping the box. Different cells
+// may share a bucket, so only the points whose own cell is the one visited
+// count, and each point is seen once.
+template<typename F>
+int SpatialGrid::visitCells(const glm::vec3& bmin, const glm::vec3& bmax, const F& test, std::vector<int>& out) const {
+	if (entries.empty()) return 0;
+	size_t before = out.size();
+	int x0 = cellCoord(bmin.x, invCell), x1 = cellCoord(bmax.x, invCell);
+	int y0 = cellCoord(bmin.y, invCell), y1 = cellCoord(bmax.y, invCell);
+	int z0 = cellCoord(bmin.z, invCell), z1 = cellCoord(bmax.z, invCell);
+	double numCells = (double)(x1 - x0 + 1) * (y1 - y0 + 1) * (z1 - z0 + 1);
+	if (numCells > (double)entries.size()) {
+		// More cells than points, a straight pass over all of them is cheaper
+		for (const Entry& e : entries) {
+			if (test(e.x, e.y, e.z)) out.push_back(e.index);
+		}
+		return (int)(out.size() - before);
+	}
+	for (int z = z0; z <= z1; z++) {
+		for (int y = y0; y <= y1; y++) {
+			for (int x = x0; x <= x1; x++) {
+				uint64_t key = keyOf(x, y, z);
+				unsigned b = bucketOf(x, y, z);
+				for (int s = bucketStart[b]; s < bucketStart[b + 1]; s++) {
+					const Entry& e = entries[s];
+					if (e.cell == key && test(e.x, e.y, e.z)) out.push_back(e.index);
+				}
+			}
+		}
+	}
+	return (int)(out.size() - before);
+}
+
+int SpatialGrid::queryRadius(const glm::vec3& center, float radius, std::vector<int>& out) const {
+	float r2 = radius * radius;
+	return visitCells(center - radius, center + radius, [&](float x, float y, float z) {
+		float dx = x - center.x, dy = y - center.y, dz = z - center.z;
+		return dx * dx + dy * dy + dz * dz <= r2;
+	}, out);
+}
+
+int SpatialGrid::queryBox(const glm::vec3& bmin, const glm::vec3& bmax, std::vector<int>& out) const {
+	return visitCells(bmin, bmax, [&](float x, float y, float z) {
+		return x >= bmin.x && y >= bmin.y && z >= bmin.z && x <= bmax.x && y <= bmax.y && z <= bmax.z;
+	}, out);
+}
+
+void SpatialGrid::benchmark(int numPoints, double& buildMs, double& queryUs) {
+	BenchUtil::Random rnd(0x9e3779b9u);
+	float side = std::cbrt((float)numPoints);
+	std::vector<glm::vec3> points(numPoints);
+	for (int i = 0; i < numPoints; i++) points[i] = glm::vec3(rnd.unit(), rnd.unit(), rnd.unit()) * side;
+
+	SpatialGrid grid(1.f);
+	grid.build(points.data(), numPoints);
+	const int runs = 10;
+	buildMs = 0.0;
+	for (int r = 0; r < runs; r++) {
+		for (int i = 0; i < numPoints; i++) points[i] += glm::vec3(rnd.unit(), rnd.unit(), rnd.unit()) * 0.1f - 0.05f;
+		auto start = BenchUtil::Clock::now();
+		grid.build(points.data(), numPoints);
+		buildMs += BenchUtil::msSince(start);
+	}
+	buildMs /= runs;
+
+	const int numQueries = 1000;
+	std::vector<int> found;
+	found.reserve(256);
+	auto start = BenchUtil::Clock::now();
+	for (int q = 0; q < numQueries; q++) {
+		found.clear();
+		grid.queryRadius(points[(rnd.next() >> 4) % numPoints], 2.f, found);
+	}
+	queryUs = BenchUtil::msSince(start) * 1000.0 / numQueries;
+}
@@ -0,0 +1,119 @@
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+#include "crt_compat.h"
+#include "startup_trace.h"
+
+namespace {
+	typedef std::chrono::steady_clock Clock;
+	const Clock::time_point origin = Clock::now();
+
+	std::mutex lock;
+	StartupTrace::Event events[StartupTrace::capacity];
+	int numEvents = 0;
+	long long finishNs = -1;
+	std::thread::id threadIds[8];
+	int numThreads = 0;
+	thread_local int depth = 0;
+
+	// Small stable numbers read better in the trace viewer than hashed thread ids
+	int threadIndex(std::thread::id id) {
+		for (int i = 0; i < numThreads; i++) {
+			if (threadIds[i] == id) return i;
+		}
+		if (numThreads == sizeof(threadIds) / sizeof(threadIds[0])) return numThreads - 1;
+		threadIds[numThreads] = id;
+		return numThreads++;
+	}
+}
+
+namespace StartupTrace {
+	long long nowNs() {
+		return (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - origin).count();
+	}
+
+	int begin(const char* name) {
+		long long t = nowNs();
+		std::lock_guard<std::mutex> guard(lock);
+		if (finishNs >= 0 || numEvents == capacity) return -1;
+		Event& e = events[numEvents];
+		e.name = name;
+		e.startNs = t;
+		e.endNs = -1;
+		e.depth = depth++;
+		e.thread = threadIndex(std::this_thread::get_id());
+		return numEvents++;
+	}
+
+	void end(int id) {
+		if (id < 0) return;
+		long long t = nowNs();
+		std::lock_guard<std::mutex> guard(lock);
+		events[id].endNs = t;
+		depth--;
+	}
+
+	void finish() {
+		long long t = nowNs();
+		std::lock_guard<std::mutex> guard(lock);
+		if (finishNs < 0) finishNs = t;
+	}
+
+	bool finished() {
+		std::lock_guard<std::mutex> guard(lock);
+		return finishNs >= 0;
+	}
+
+	long long totalNs() {
+		std::lock_guard<std::mutex> guard(lock);
+		return finishNs;
+	}
+
+	int copyEvents(Event* out, int maxEvents) {
+		std::lock_guard<std::mutex> guard(lock);
+		int n = numEvents < maxEvents ? numEvents : maxEvents;
+		for (int i = 0; i < n; i++) out[i] = events[i];
+		return n;
+	}
+
+	void print() {
+		Event copy[capacity];
+		int n = copyEvents(copy, capacity);
+		printf("Startup trace (ms since process start):\n");
+		for (int i = 0; i < n; i++) {
+			const Event& e = copy[i];
+			double start = e.startNs * 1e-6;
+			double dur = e.endNs >= 0 ? (e.endNs - e.startNs) * 1e-6 : 0.0;
+			printf("  %9.3f %9.3f  %*s%s%s\n", start, dur, e.depth * 2, "", e.name, e.endNs < 0 ? " (open)" : "");
+		}
+		long long total = totalNs();
+		if (total >= 0) printf("  %9.3f            first frame\n", total * 1e-6);
+	}
+
+	bool writeChromeTrace(const char* path) {
+		Event copy[capacity];
+		int n = copyEvents(copy, capacity);
+		FILE* f;
+		fopen_s(&f, path, "w");
+		if (f == NULL) {
+			printf("Couldn't write %s\n", path);
+			return false;
+		}
+		// Complete events take microseconds; the fraction keeps the ns resolution
+		fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+		for (int i = 0; i < n; i++) {
+			const Event& e = copy[i];
+			long long end = e.endNs >= 0 ? e.endNs : e.startNs;
+			fprintf(f, "\t{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f},\n",
+				e.name, e.thread, e.startNs * 1e-3, (end - e.startNs) * 1e-3);
+		}
+		long long total = totalNs();
+		fprintf(f, "\t{\"name\": \"first frame\", \"ph\": \"i\", \"s\": \"g\", \"pid\": 1, \"tid\": 0, \"ts\": %.3f}\n",
+			(total >= 0 ? total : nowNs()) * 1e-3);
+		fprintf(f, "]}\n");
+		fclose(f);
+		return true;
+	}
+}